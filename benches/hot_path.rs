@@ -0,0 +1,350 @@
+//! Microbenchmarks of replica and client hot paths, which run without DPDK
+//! devices. Run with `cargo bench`, and compare against a saved baseline with
+//! `cargo bench -- --save-baseline <name>` and `--baseline <name>`.
+
+use std::{
+    sync::{
+        atomic::{AtomicBool, AtomicU64, Ordering},
+        Arc,
+    },
+    time::{Duration, Instant},
+};
+
+use criterion::{
+    black_box, criterion_group, criterion_main, BatchSize, BenchmarkId, Criterion, Throughput,
+};
+use oskr::{
+    app::ycsb::{CompactOp, Op},
+    common::{
+        deserialize, deserialize_view, serialize, OpNumber, Opaque, SignedMessage, SigningKey,
+    },
+    facade::App,
+    framework::{dpdk::RoundRobin, memory_database, sqlite, ycsb_workload::ZipfianGenerator},
+    protocol::{hotstuff, pbft, zyzzyva},
+    stage::{Handle, State},
+};
+use serde::{de::DeserializeOwned, Serialize};
+
+fn signing_key() -> SigningKey {
+    SigningKey::K256(k256::ecdsa::SigningKey::from_bytes(&[1; 32]).unwrap())
+}
+
+// `view` deserializes into the borrowed form that replicas actually receive
+// into, if protocol has one
+fn bench_message<M>(c: &mut Criterion, name: &str, message: M, view: Option<fn(&[u8])>)
+where
+    M: Serialize + DeserializeOwned + Clone,
+{
+    let mut buffer = [0; 1500];
+    let len = serialize(message.clone())(&mut buffer[..]) as usize;
+    let mut group = c.benchmark_group(name);
+    group.throughput(Throughput::Bytes(len as u64));
+    group.bench_function("serialize", |b| {
+        b.iter_batched(
+            || message.clone(),
+            |message| serialize(message)(&mut buffer[..]),
+            BatchSize::SmallInput,
+        )
+    });
+    group.bench_function("deserialize", |b| {
+        b.iter(|| deserialize::<M>(&buffer[..len]).unwrap())
+    });
+    if let Some(view) = view {
+        group.bench_function("deserialize view", |b| b.iter(|| view(&buffer[..len])));
+    }
+    group.finish();
+}
+
+fn pbft_view(buffer: &[u8]) {
+    black_box(deserialize_view::<pbft::message::ToReplicaView>(buffer).unwrap());
+}
+
+fn zyzzyva_view(buffer: &[u8]) {
+    black_box(deserialize_view::<zyzzyva::message::ToReplicaView>(buffer).unwrap());
+}
+
+fn message(c: &mut Criterion) {
+    let key = signing_key();
+    let op = vec![0; 100];
+
+    let request = pbft::message::Request {
+        op: op.clone().into(),
+        request_number: 1,
+        client_id: [0; 4],
+    };
+    bench_message(
+        c,
+        "pbft request",
+        pbft::message::ToReplica::Request(request),
+        Some(pbft_view),
+    );
+    let prepare = pbft::message::Prepare {
+        view_number: 0,
+        op_number: 1,
+        digest: [0; 32],
+        replica_id: 1,
+    };
+    bench_message(
+        c,
+        "pbft prepare",
+        pbft::message::ToReplica::Prepare(SignedMessage::sign(prepare, &key)),
+        Some(pbft_view),
+    );
+
+    let order_request = zyzzyva::message::OrderRequest {
+        view_number: 0,
+        op_number: 1,
+        history_digest: [0; 32],
+        digest: [0; 32],
+    };
+    let batch = (0..10)
+        .map(|i| zyzzyva::message::Request {
+            op: op.clone().into(),
+            request_number: i,
+            client_id: [0; 4],
+        })
+        .collect();
+    bench_message(
+        c,
+        "zyzzyva order request",
+        zyzzyva::message::ToReplica::OrderRequest(SignedMessage::sign(order_request, &key), batch),
+        Some(zyzzyva_view),
+    );
+
+    let vote = hotstuff::message::VoteGeneric {
+        view_number: 0,
+        node: [0; 32],
+    };
+    // hotstuff has no borrowed mirror
+    bench_message(
+        c,
+        "hotstuff vote generic",
+        hotstuff::message::ToReplica::VoteGeneric(SignedMessage::sign(vote, &key)),
+        None,
+    );
+}
+
+fn signed(c: &mut Criterion) {
+    let message = pbft::message::Prepare {
+        view_number: 0,
+        op_number: 1,
+        digest: [0; 32],
+        replica_id: 1,
+    };
+    let mut group = c.benchmark_group("signed");
+    for (name, key) in [
+        ("k256", signing_key()),
+        ("secp256k1", signing_key().use_secp256k1()),
+    ] {
+        let verifying_key = key.verifying_key();
+        group.bench_function(BenchmarkId::new("sign", name), |b| {
+            b.iter(|| SignedMessage::sign(message.clone(), &key))
+        });
+        let signed = SignedMessage::sign(message.clone(), &key);
+        group.bench_function(BenchmarkId::new("verify", name), |b| {
+            b.iter_batched(
+                || signed.clone(),
+                |signed| signed.verify(&verifying_key).unwrap(),
+                BatchSize::SmallInput,
+            )
+        });
+    }
+    // per message cost of a quorum-sized batch, against verifying one by one
+    let key_list: Vec<_> = (1..=4)
+        .map(|i| SigningKey::K256(k256::ecdsa::SigningKey::from_bytes(&[i; 32]).unwrap()).use_bls())
+        .collect();
+    let verifying_key: Vec<_> = key_list.iter().map(SigningKey::verifying_key).collect();
+    let batch: Vec<_> = key_list
+        .iter()
+        .map(|key| SignedMessage::sign(message.clone(), key))
+        .collect();
+    group.throughput(Throughput::Elements(batch.len() as u64));
+    group.bench_function(BenchmarkId::new("verify each", "bls"), |b| {
+        b.iter_batched(
+            || batch.clone(),
+            |batch| {
+                for (signed, key) in batch.into_iter().zip(&verifying_key) {
+                    signed.verify(key).unwrap();
+                }
+            },
+            BatchSize::SmallInput,
+        )
+    });
+    group.bench_function(BenchmarkId::new("verify batch", "bls"), |b| {
+        b.iter_batched(
+            || batch.clone(),
+            |batch| SignedMessage::verify_batch(batch.into_iter().zip(&verifying_key)).unwrap(),
+            BatchSize::SmallInput,
+        )
+    });
+    group.finish();
+}
+
+struct Null;
+impl State for Null {
+    type Shared = ();
+    fn shared(&self) -> Self::Shared {}
+}
+
+// submit from current thread, the way rx thread does, and drain with
+// `n_worker` workers
+fn submit(c: &mut Criterion) {
+    let mut group = c.benchmark_group("submit");
+    group.throughput(Throughput::Elements(1));
+    for n_worker in [1, 2, 4] {
+        group.bench_function(BenchmarkId::new("stateless", n_worker), |b| {
+            b.iter_custom(|iters| {
+                let stage = Handle::from(Null);
+                let count = Arc::new(AtomicU64::new(0));
+                let shutdown = AtomicBool::new(false);
+                // take submit before workers start, which may hold state while
+                // waiting for tasks
+                let mut submit = None;
+                stage.with_stateless(|stage| submit = Some(stage.submit.clone()));
+                let submit = submit.unwrap();
+                crossbeam::scope(|s| {
+                    for _ in 0..n_worker {
+                        s.spawn(|_| stage.run_worker(|| shutdown.load(Ordering::SeqCst)));
+                    }
+                    let start = Instant::now();
+                    for _ in 0..iters {
+                        let count = count.clone();
+                        submit.stateless(move |_| {
+                            count.fetch_add(1, Ordering::Relaxed);
+                        });
+                    }
+                    while count.load(Ordering::Relaxed) != iters {}
+                    let elapsed = start.elapsed();
+                    shutdown.store(true, Ordering::SeqCst);
+                    elapsed
+                })
+                .unwrap()
+            })
+        });
+    }
+    group.finish();
+}
+
+// every thread acquires and releases shared tx queues in a loop
+fn round_robin(c: &mut Criterion) {
+    let mut group = c.benchmark_group("round robin");
+    group.throughput(Throughput::Elements(1));
+    for n_thread in [1, 2, 4] {
+        group.bench_function(BenchmarkId::new("acquire", n_thread), |b| {
+            let round_robin = RoundRobin::new(2);
+            b.iter_custom(|iters| {
+                let start = Instant::now();
+                crossbeam::scope(|s| {
+                    for _ in 0..n_thread {
+                        s.spawn(|_| {
+                            for _ in 0..iters / n_thread {
+                                let i = round_robin.acquire();
+                                round_robin.release(i);
+                            }
+                        });
+                    }
+                })
+                .unwrap();
+                start.elapsed()
+            })
+        });
+    }
+    group.finish();
+}
+
+const N_RECORD: u64 = 10000;
+const N_FIELD: usize = 10;
+
+fn execute(app: &mut impl App, op_number: OpNumber, op: CompactOp) {
+    let mut buffer = Vec::new();
+    serialize(Op::Compact(op))(&mut buffer);
+    app.execute(op_number, &buffer);
+}
+
+fn value_list(n: usize) -> Vec<Opaque> {
+    (0..n).map(|_| vec![0; 100].into()).collect()
+}
+
+// through `App::execute`, i.e. including op decoding and result encoding
+fn bench_database(c: &mut Criterion, name: &str, mut app: impl App) {
+    let all_field = CompactOp::field_mask(0..N_FIELD);
+    for key in 0..N_RECORD {
+        execute(
+            &mut app,
+            key as _,
+            CompactOp::Insert(key, all_field, value_list(N_FIELD)),
+        );
+    }
+    let mut op_number = N_RECORD as OpNumber;
+    let mut key = 0;
+    let mut next = || {
+        op_number += 1;
+        key = (key + 7919) % N_RECORD;
+        (op_number, key)
+    };
+
+    let mut group = c.benchmark_group(name);
+    group.bench_function("read", |b| {
+        b.iter(|| {
+            let (op_number, key) = next();
+            execute(&mut app, op_number, CompactOp::Read(key, 0))
+        })
+    });
+    group.bench_function("update", |b| {
+        b.iter(|| {
+            let (op_number, key) = next();
+            execute(
+                &mut app,
+                op_number,
+                CompactOp::Update(key, CompactOp::field_mask([0]), value_list(1)),
+            )
+        })
+    });
+    group.bench_function("scan", |b| {
+        b.iter(|| {
+            let (op_number, key) = next();
+            execute(&mut app, op_number, CompactOp::Scan(key, 10, 0))
+        })
+    });
+    group.finish();
+}
+
+fn database(c: &mut Criterion) {
+    bench_database(c, "memory database", memory_database::Database::default());
+    let database = sqlite::Database::default();
+    database.create_table(
+        CompactOp::TABLE,
+        &(0..N_FIELD)
+            .map(CompactOp::field_name)
+            .collect::<Vec<_>>()
+            .iter()
+            .map(|field| &**field)
+            .collect::<Vec<_>>(),
+    );
+    bench_database(c, "sqlite", database);
+}
+
+fn zipfian(c: &mut Criterion) {
+    let mut group = c.benchmark_group("zipfian");
+    group.bench_function("next long", |b| {
+        let mut generator = ZipfianGenerator::new(0, 1000000);
+        b.iter(|| generator.next_long(1000000))
+    });
+    // item count grows as inserting, which extends zeta incrementally
+    group.bench_function("next long growing", |b| {
+        let mut generator = ZipfianGenerator::new(0, 1000000);
+        let mut item_count = 1000000;
+        b.iter(|| {
+            item_count += 1;
+            generator.next_long(item_count)
+        })
+    });
+    group.finish();
+}
+
+criterion_group! {
+    name = benches;
+    config = Criterion::default().measurement_time(Duration::from_secs(3));
+    targets = message, signed, submit, round_robin, database, zipfian
+}
+criterion_main!(benches);
@@ -32,16 +32,17 @@ impl Default for App {
         Self::new(|_, _, op| {
             let mut result = b"reply: ".to_vec();
             result.extend_from_slice(&op);
-            result
+            result.into()
         })
     }
 }
 
 impl facade::App for App {
-    fn execute(&mut self, op_number: OpNumber, op: Opaque) -> Opaque {
-        self.upcall_log.push(Upcall::Execute(op_number, op.clone()));
+    fn execute(&mut self, op_number: OpNumber, op: &[u8]) -> Opaque {
+        self.upcall_log
+            .push(Upcall::Execute(op_number, Opaque::copy_from_slice(op)));
         let execute_stub = replace(&mut self.execute_stub, Box::new(|_, _, _| unreachable!()));
-        let result = execute_stub(self, op_number, op);
+        let result = execute_stub(self, op_number, Opaque::copy_from_slice(op));
         let _ = replace(&mut self.execute_stub, execute_stub);
         result
     }
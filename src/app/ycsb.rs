@@ -1,12 +1,13 @@
 use std::collections::{BTreeMap, HashMap, HashSet};
 
 use async_trait::async_trait;
+use futures::future::select_all;
 use serde_derive::{Deserialize, Serialize};
 use tracing::info;
 
 use crate::{
-    common::{deserialize, serialize, OpNumber, Opaque},
-    facade::{App, Invoke, Receiver, Transport},
+    common::{deserialize, serialize, OpNumber, Opaque, RequestNumber},
+    facade::{App, Invoke, Pipeline, Receiver, Transport},
 };
 
 #[derive(Debug, Clone, Serialize, Deserialize)]
@@ -16,6 +17,101 @@ pub enum Op {
     Update(String, String, HashMap<String, Opaque>),
     Insert(String, String, HashMap<String, Opaque>),
     Delete(String, String),
+    Compact(CompactOp),
+}
+
+/// Compact form of `Op` for YCSB core workload layout, i.e. table
+/// `usertable`, key named `user{key}` and field named `field{index}`.
+///
+/// Key is numbered and field set is a bitmask of field index, where zero mask
+/// means all fields. Values of update and insert are in field index order.
+/// Database executes it without building and hashing names if it can.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub enum CompactOp {
+    Read(u64, u64),
+    Scan(u64, usize, u64),
+    Update(u64, u64, Vec<Opaque>),
+    Insert(u64, u64, Vec<Opaque>),
+    Delete(u64),
+}
+
+impl CompactOp {
+    pub const TABLE: &'static str = "usertable";
+
+    pub fn key_name(key: u64) -> String {
+        format!("user{}", key)
+    }
+
+    pub fn field_name(index: usize) -> String {
+        format!("field{}", index)
+    }
+
+    pub fn field_index(field: &str) -> Option<usize> {
+        let index = field.strip_prefix("field")?.parse().ok()?;
+        // keep one form for each index, e.g. reject `field01`
+        if index < 64 && Self::field_name(index) == field {
+            Some(index)
+        } else {
+            None
+        }
+    }
+
+    pub fn field_mask(index_iter: impl IntoIterator<Item = usize>) -> u64 {
+        index_iter
+            .into_iter()
+            .fold(0, |mask, index| mask | 1u64 << index)
+    }
+
+    fn field_index_iter(mask: u64) -> impl Iterator<Item = usize> {
+        (0..64).filter(move |index| mask & 1u64 << index != 0)
+    }
+
+    fn field_set(mask: u64) -> HashSet<String> {
+        Self::field_index_iter(mask).map(Self::field_name).collect()
+    }
+
+    fn value_table(mask: u64, value_list: Vec<Opaque>) -> HashMap<String, Opaque> {
+        Self::field_index_iter(mask)
+            .map(Self::field_name)
+            .zip(value_list)
+            .collect()
+    }
+
+    /// Translate into the named form.
+    pub fn expand(self) -> Op {
+        let table = Self::TABLE.to_string();
+        match self {
+            Self::Read(key, mask) => Op::Read(table, Self::key_name(key), Self::field_set(mask)),
+            Self::Scan(key, count, mask) => {
+                Op::Scan(table, Self::key_name(key), count, Self::field_set(mask))
+            }
+            Self::Update(key, mask, value_list) => Op::Update(
+                table,
+                Self::key_name(key),
+                Self::value_table(mask, value_list),
+            ),
+            Self::Insert(key, mask, value_list) => Op::Insert(
+                table,
+                Self::key_name(key),
+                Self::value_table(mask, value_list),
+            ),
+            Self::Delete(key) => Op::Delete(table, Self::key_name(key)),
+        }
+    }
+
+    /// Compact a row of named result, dropping fields that are not in the
+    /// layout.
+    pub fn compact_row(row: BTreeMap<String, Opaque>) -> (u64, Vec<Opaque>) {
+        let mut value_list: Vec<_> = row
+            .into_iter()
+            .filter_map(|(field, value)| Some((Self::field_index(&field)?, value)))
+            .collect();
+        value_list.sort_unstable_by_key(|(index, _)| *index);
+        (
+            Self::field_mask(value_list.iter().map(|(index, _)| *index)),
+            value_list.into_iter().map(|(_, value)| value).collect(),
+        )
+    }
 }
 
 // we are using BTreeMap instead of HashMap to maintain a deterministic order
@@ -31,6 +127,9 @@ pub enum Result {
     InsertOk,
     DeleteOk,
     Error(Error),
+    // field mask and values in field index order
+    CompactReadOk(u64, Vec<Opaque>),
+    CompactScanOk(Vec<(u64, Vec<Opaque>)>),
 }
 
 #[derive(Debug, Clone, Serialize, Deserialize)]
@@ -46,6 +145,7 @@ pub enum Error {
 }
 
 pub type DatabaseResult = std::result::Result<(), Error>;
+#[allow(unused_variables)]
 pub trait Database {
     fn read(
         &mut self,
@@ -75,55 +175,106 @@ pub trait Database {
         value_table: HashMap<String, Opaque>,
     ) -> DatabaseResult;
     fn delete(&mut self, table: String, key: String) -> DatabaseResult;
+
+    // following are optional for databases that support rollback, semantic
+    // matches the corresponding `App` methods
+    /// Following operations are executed for `op_number`.
+    fn begin(&mut self, op_number: OpNumber) {}
+    /// Undo every operation executed for op number greater than `op_number`.
+    fn rollback(&mut self, op_number: OpNumber) {
+        unimplemented!()
+    }
+    /// Operations up to `op_number` will never be rolled back.
+    fn commit(&mut self, op_number: OpNumber) {}
+    /// Make operations since last flush durable.
+    fn flush(&mut self) {}
+
+    /// Default implementation executes the named form of op.
+    fn execute_compact(&mut self, op: CompactOp) -> Result {
+        match execute_op(self, op.expand()) {
+            Result::ReadOk(row) => {
+                let (mask, value_list) = CompactOp::compact_row(row);
+                Result::CompactReadOk(mask, value_list)
+            }
+            Result::ScanOk(row_list) => {
+                Result::CompactScanOk(row_list.into_iter().map(CompactOp::compact_row).collect())
+            }
+            result => result,
+        }
+    }
 }
 
-// should we allow app do customized rollback?
-impl<A: Database> App for A {
-    fn execute(&mut self, _op_number: OpNumber, op: Opaque) -> Opaque {
-        let result = match deserialize(&*op).unwrap() {
-            Op::Read(table, key, field_set) => {
-                let mut result = BTreeMap::new();
-                if let Err(error) = self.read(table, key, field_set, &mut result) {
-                    Result::Error(error)
-                } else {
-                    Result::ReadOk(result)
-                }
+fn execute_op<A: Database + ?Sized>(database: &mut A, op: Op) -> Result {
+    match op {
+        Op::Read(table, key, field_set) => {
+            let mut result = BTreeMap::new();
+            if let Err(error) = database.read(table, key, field_set, &mut result) {
+                Result::Error(error)
+            } else {
+                Result::ReadOk(result)
             }
-            Op::Scan(table, start_key, record_count, field_set) => {
-                let mut result = Vec::new();
-                if let Err(error) =
-                    self.scan(table, start_key, record_count, field_set, &mut result)
-                {
-                    Result::Error(error)
-                } else {
-                    Result::ScanOk(result)
-                }
+        }
+        Op::Scan(table, start_key, record_count, field_set) => {
+            let mut result = Vec::new();
+            if let Err(error) =
+                database.scan(table, start_key, record_count, field_set, &mut result)
+            {
+                Result::Error(error)
+            } else {
+                Result::ScanOk(result)
             }
-            Op::Update(table, key, value_table) => {
-                if let Err(error) = self.update(table, key, value_table) {
-                    Result::Error(error)
-                } else {
-                    Result::UpdateOk
-                }
+        }
+        Op::Update(table, key, value_table) => {
+            if let Err(error) = database.update(table, key, value_table) {
+                Result::Error(error)
+            } else {
+                Result::UpdateOk
             }
-            Op::Insert(table, key, value_table) => {
-                if let Err(error) = self.insert(table, key, value_table) {
-                    Result::Error(error)
-                } else {
-                    Result::InsertOk
-                }
+        }
+        Op::Insert(table, key, value_table) => {
+            if let Err(error) = database.insert(table, key, value_table) {
+                Result::Error(error)
+            } else {
+                Result::InsertOk
             }
-            Op::Delete(table, key) => {
-                if let Err(error) = self.delete(table, key) {
-                    Result::Error(error)
-                } else {
-                    Result::DeleteOk
-                }
+        }
+        Op::Delete(table, key) => {
+            if let Err(error) = database.delete(table, key) {
+                Result::Error(error)
+            } else {
+                Result::DeleteOk
             }
-        };
-        let mut buffer = Opaque::new();
+        }
+        Op::Compact(op) => database.execute_compact(op),
+    }
+}
+
+// should we allow app do customized rollback?
+impl<A: Database> App for A {
+    fn execute(&mut self, op_number: OpNumber, op: &[u8]) -> Opaque {
+        self.begin(op_number);
+        let result = execute_op(self, deserialize(op).unwrap());
+        let mut buffer = Vec::new();
         serialize(result)(&mut buffer);
-        buffer
+        buffer.into()
+    }
+
+    // ops are not replayed here, protocol is expected to execute them again
+    fn rollback(
+        &mut self,
+        _current: OpNumber,
+        to: OpNumber,
+        _op_list: &mut dyn Iterator<Item = (OpNumber, Opaque)>,
+    ) {
+        Database::rollback(self, to);
+    }
+
+    fn commit(&mut self, op_number: OpNumber) {
+        Database::commit(self, op_number);
+    }
+
+    fn flush(&mut self) {
+        Database::flush(self);
     }
 }
 
@@ -149,3 +300,194 @@ impl<T: Transport> Receiver<T> for TraceClient<T> {
         &self.0
     }
 }
+
+/// Client of a sharded deployment, which has one inner client per group, and
+/// routes every op to the group that owns its key.
+///
+/// Keys are partitioned by hash, so a range of keys spreads over all groups,
+/// and scanned rows do not carry their keys to be merged in key order. With
+/// multiple groups, scan is rejected locally with `NotImplemented` error
+/// instead of returning rows of one group only. Op that is not a YCSB op, e.g.
+/// of null workload, is spread over groups in turn.
+pub struct ShardClient<C> {
+    client_list: Vec<C>,
+    next: usize,
+    // pipelined requests, keyed by (group id, request number of the group's
+    // client), only used with multiple groups
+    request_number: RequestNumber,
+    pending_table: HashMap<(usize, RequestNumber), RequestNumber>,
+    // pipelined requests that are rejected without sending
+    rejected_list: Vec<(RequestNumber, Opaque)>,
+}
+
+impl<C> ShardClient<C> {
+    pub fn new(client_list: Vec<C>) -> Self {
+        assert!(!client_list.is_empty());
+        Self {
+            client_list,
+            next: 0,
+            request_number: 0,
+            pending_table: HashMap::new(),
+            rejected_list: Vec::new(),
+        }
+    }
+
+    /// The group owns `key` among `n_group` groups. FNV-1a is used instead of
+    /// std hasher, whose algorithm is not guaranteed to be stable, so clients
+    /// built separately still agree.
+    pub fn shard(key: &str, n_group: usize) -> usize {
+        let mut hash = 0xcbf29ce484222325_u64;
+        for byte in key.bytes() {
+            hash ^= byte as u64;
+            hash = hash.wrapping_mul(0x100000001b3);
+        }
+        // take high bits, low bits of FNV only depend on low bits of input
+        ((hash as u128 * n_group as u128) >> 64) as usize
+    }
+
+    // `None` for scan, which no single group can serve
+    fn route(&mut self, op: &[u8]) -> Option<usize> {
+        let n_group = self.client_list.len();
+        let key = match deserialize(op) {
+            Ok(Op::Scan(..) | Op::Compact(CompactOp::Scan(..))) => return None,
+            Ok(Op::Read(_, key, _))
+            | Ok(Op::Update(_, key, _))
+            | Ok(Op::Insert(_, key, _))
+            | Ok(Op::Delete(_, key)) => key,
+            Ok(Op::Compact(
+                CompactOp::Read(key, _)
+                | CompactOp::Update(key, _, _)
+                | CompactOp::Insert(key, _, _)
+                | CompactOp::Delete(key),
+            )) => CompactOp::key_name(key),
+            Err(_) => {
+                self.next = (self.next + 1) % n_group;
+                return Some(self.next);
+            }
+        };
+        Some(Self::shard(&key, n_group))
+    }
+
+    fn rejected() -> Opaque {
+        let mut buffer = Vec::new();
+        serialize(Result::Error(Error::NotImplemented))(&mut buffer);
+        buffer.into()
+    }
+}
+
+#[async_trait]
+impl<C: Invoke + Send> Invoke for ShardClient<C> {
+    async fn invoke(&mut self, op: Opaque) -> Opaque {
+        // skip decoding for classical deployment
+        let group_id = if self.client_list.len() == 1 {
+            0
+        } else if let Some(group_id) = self.route(&op) {
+            group_id
+        } else {
+            return Self::rejected();
+        };
+        self.client_list[group_id].invoke(op).await
+    }
+}
+
+/// Request numbers of groups are independent, so they are translated into
+/// one sequence. Completing waits on all groups.
+#[async_trait]
+impl<C: Pipeline + Send> Pipeline for ShardClient<C> {
+    fn submit(&mut self, op: Opaque) -> RequestNumber {
+        if self.client_list.len() == 1 {
+            return self.client_list[0].submit(op);
+        }
+        self.request_number += 1;
+        if let Some(group_id) = self.route(&op) {
+            let request_number = self.client_list[group_id].submit(op);
+            self.pending_table
+                .insert((group_id, request_number), self.request_number);
+        } else {
+            self.rejected_list
+                .push((self.request_number, Self::rejected()));
+        }
+        self.request_number
+    }
+
+    async fn complete(&mut self) -> (RequestNumber, Opaque) {
+        if self.client_list.len() == 1 {
+            return self.client_list[0].complete().await;
+        }
+        if let Some(rejected) = self.rejected_list.pop() {
+            return rejected;
+        }
+        // pending forever if nothing was submitted, same as inner clients
+        // inner `complete` keeps nothing across awaiting, so the ones that
+        // lose the race are safe to drop
+        let ((request_number, result), group_id, _) =
+            select_all(self.client_list.iter_mut().map(|client| client.complete())).await;
+        let request_number = self
+            .pending_table
+            .remove(&(group_id, request_number))
+            .unwrap();
+        (request_number, result)
+    }
+}
+
+impl<T: Transport, C: Receiver<T>> Receiver<T> for ShardClient<C> {
+    // address of the first group's client, only for logging
+    fn get_address(&self) -> &T::Address {
+        self.client_list[0].get_address()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::collections::HashSet;
+
+    use crate::common::serialize;
+
+    use super::{CompactOp, Op, ShardClient};
+
+    fn route(client: &mut ShardClient<()>, op: Op) -> Option<usize> {
+        let mut buffer = Vec::new();
+        serialize(op)(&mut buffer);
+        client.route(&buffer)
+    }
+
+    #[test]
+    fn shard_route() {
+        let mut client = ShardClient::new(vec![(); 4]);
+        let mut count = [0; 4];
+        for key in 0..1000 {
+            let group_id = route(&mut client, Op::Compact(CompactOp::Read(key, 0))).unwrap();
+            // compact and named form of the same key go to the same group
+            assert_eq!(
+                route(
+                    &mut client,
+                    Op::Read(
+                        CompactOp::TABLE.to_string(),
+                        CompactOp::key_name(key),
+                        HashSet::new()
+                    )
+                ),
+                Some(group_id)
+            );
+            assert_eq!(
+                route(
+                    &mut client,
+                    Op::Compact(CompactOp::Update(key, 1, Vec::new()))
+                ),
+                Some(group_id)
+            );
+            count[group_id] += 1;
+        }
+        assert!(count.iter().all(|count| *count > 150));
+
+        // range of keys spreads over groups
+        assert_eq!(
+            route(&mut client, Op::Compact(CompactOp::Scan(0, 10, 0))),
+            None
+        );
+
+        // not a YCSB op
+        assert_eq!(client.route(&[]), Some(1));
+        assert_eq!(client.route(&[]), Some(2));
+    }
+}
@@ -1,32 +1,36 @@
 use std::{
+    collections::{HashMap, VecDeque},
     ffi::c_void,
     fs,
     mem::take,
     path::PathBuf,
+    pin::Pin,
     sync::{
         atomic::{AtomicU32, Ordering},
         Arc,
     },
-    time::Duration,
+    time::{Duration, Instant},
 };
 
+use async_trait::async_trait;
 use clap::{ArgEnum, Parser};
-use futures::{channel::oneshot, select, FutureExt};
+use futures::{channel::oneshot, future::pending, select, Future, FutureExt};
 use hdrhistogram::SyncHistogram;
 use oskr::{
-    app::ycsb,
-    common::{panic_abort, Config, Opaque},
+    app::ycsb::{self, ShardClient},
+    common::{panic_abort, Config, Opaque, RequestNumber},
     dpdk_shim::{rte_eal_mp_remote_launch, rte_eal_mp_wait_lcore, rte_rmt_call_main_t},
-    facade::{self, AsyncEcosystem as _, Invoke, Receiver},
+    facade::{self, AsyncEcosystem as _, Invoke, Pipeline, Receiver},
     framework::{
         busy_poll::AsyncEcosystem,
-        dpdk::Transport,
+        dpdk::{RxSteering, Transport},
         latency::{Latency, LocalLatency, MeasureClock},
         ycsb_workload::{OpKind, Property, Workload},
     },
     protocol::{hotstuff, pbft, unreplicated, zyzzyva},
 };
 use quanta::Clock;
+use rand::{rngs::StdRng, Rng, SeedableRng};
 use tracing::{debug, info};
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq, ArgEnum)]
@@ -54,6 +58,12 @@ impl WorkloadName {
     ];
 }
 
+#[derive(Debug, Clone, Copy, PartialEq, Eq, ArgEnum)]
+enum Arrival {
+    Constant,
+    Poisson,
+}
+
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
 enum Status {
     WarmUp,
@@ -93,8 +103,20 @@ fn main() {
         n_worker: usize,
         #[clap(long = "tx", default_value_t = 1)]
         n_tx: u16,
+        #[clap(long = "rx", default_value_t = 1)]
+        n_rx: u16,
         #[clap(short = 't', long = "client-number", default_value_t = 1)]
         n_client: usize,
+        // open loop target rate in ops per second of all clients, closed loop
+        // if not set, in which case each client is an outstanding request
+        #[clap(long)]
+        rate: Option<f64>,
+        // open loop only, up to how many requests each client keeps
+        // outstanding through pipeline
+        #[clap(long = "outstanding", default_value_t = 1)]
+        n_outstanding: usize,
+        #[clap(long, arg_enum, default_value_t = Arrival::Poisson)]
+        arrival: Arrival,
         #[clap(short, long, default_value_t = 1)]
         duration: u64,
         #[clap(long = "warm", default_value_t = 0)]
@@ -115,7 +137,9 @@ fn main() {
     let args = Args::parse();
     let core_mask = u128::from_str_radix(&args.mask, 16).unwrap();
     info!("initialize with {} cores", core_mask.count_ones());
-    assert!(core_mask.count_ones() > args.n_worker as u32); // strictly greater-than to preserve one rx core
+    // strictly greater-than to preserve one rx core, and every extra rx queue
+    // takes one more core
+    assert!(core_mask.count_ones() > (args.n_worker + args.n_rx as usize - 1) as u32);
 
     let prefix = args.config.file_name().unwrap().to_str().unwrap();
     let config = args.config.with_file_name(format!("{}.config", prefix));
@@ -124,7 +148,9 @@ fn main() {
         .parse()
         .unwrap();
     config.collect_signing_key(&args.config, !args.use_k256);
-    let config = Config::for_shard(config, 0); // TODO
+    // directory of shards, every client has one inner client per group
+    let config = Config::for_global(config);
+    info!("{} groups", config.n_group());
 
     let mut property = Property::default();
     if let Some(property_file) = &args.property_file {
@@ -141,9 +167,16 @@ fn main() {
         property.rewrite_load();
     }
 
-    let mut transport = Transport::setup(core_mask, args.port_id, 1, args.n_tx);
+    let mut transport = Transport::setup(
+        core_mask,
+        args.port_id,
+        args.n_rx,
+        args.n_tx,
+        RxSteering::Dest,
+    );
     transport.set_drop_rate(args.drop_rate);
     struct WorkerData<Client> {
+        transport: *const Transport,
         client_list: Vec<Vec<Client>>,
         count: Arc<AtomicU32>,
         latency: Vec<LocalLatency>,
@@ -151,11 +184,22 @@ fn main() {
         args: Arc<Args>,
         ycsb_workload: Arc<Workload>,
     }
-    impl<C: Receiver<Transport> + Invoke + Send + 'static> WorkerData<C> {
+    impl<C: Receiver<Transport> + Invoke + Pipeline + Send + 'static> WorkerData<C> {
         extern "C" fn worker(arg: *mut c_void) -> i32 {
             // TODO take a safer shared reference
             let worker_data: &mut Self = unsafe { &mut *(arg as *mut _) };
             let worker_id = Transport::worker_id();
+            let n_worker = worker_data.args.n_worker;
+            if (n_worker..n_worker + worker_data.args.n_rx as usize - 1).contains(&worker_id) {
+                let transport = unsafe { &*worker_data.transport };
+                let status = worker_data.status.clone();
+                let queue_id = (worker_id - n_worker + 1) as u16;
+                info!("worker {} poll rx queue {}", worker_id, queue_id);
+                transport.run(queue_id, || {
+                    status.load(Ordering::SeqCst) == Status::Shutdown as _
+                });
+                return 0;
+            }
             let client_list = if let Some(client_list) = worker_data.client_list.get_mut(worker_id)
             {
                 take(client_list)
@@ -171,19 +215,39 @@ fn main() {
             let args = worker_data.args.clone();
 
             // I want a broadcast :|
-            let (client_list, shutdown_list): (Vec<_>, Vec<_>) = client_list
-                .into_iter()
-                .map(|client| {
-                    spawn_client(
-                        client,
-                        count.clone(),
-                        status.clone(),
-                        latency.clone(),
-                        args.workload,
-                        ycsb_workload.clone(),
-                    )
-                })
-                .unzip();
+            let (client_list, shutdown_list): (Vec<_>, Vec<_>) = if let Some(rate) = args.rate {
+                client_list
+                    .into_iter()
+                    .map(|client| {
+                        spawn_open_loop(
+                            client,
+                            // every client takes an equal share
+                            rate / args.n_client as f64,
+                            args.arrival,
+                            args.n_outstanding,
+                            count.clone(),
+                            status.clone(),
+                            latency.clone(),
+                            args.workload,
+                            ycsb_workload.clone(),
+                        )
+                    })
+                    .unzip()
+            } else {
+                client_list
+                    .into_iter()
+                    .map(|client| {
+                        spawn_client(
+                            client,
+                            count.clone(),
+                            status.clone(),
+                            latency.clone(),
+                            args.workload,
+                            ycsb_workload.clone(),
+                        )
+                    })
+                    .unzip()
+            };
 
             // track client exit or not directly?
             let limit = match args.workload {
@@ -199,7 +263,7 @@ fn main() {
             let clock = Clock::new();
             let start = clock.start();
             if worker_id == 0 {
-                AsyncEcosystem::poll_until(|| {
+                poll_until(|| {
                     clock.delta(start, clock.end()) >= Duration::from_secs(args.warm_up_duration)
                 });
                 status.store(Status::Run as _, Ordering::SeqCst);
@@ -208,7 +272,7 @@ fn main() {
                 let mut prev = 0;
                 for _ in 0..args.duration {
                     let start = clock.start();
-                    AsyncEcosystem::poll_until(|| {
+                    poll_until(|| {
                         count.load(Ordering::SeqCst) > limit
                             || clock.delta(start, clock.end()) >= Duration::from_secs(1)
                     });
@@ -221,7 +285,7 @@ fn main() {
                 }
                 status.store(Status::Shutdown as _, Ordering::SeqCst);
             } else {
-                AsyncEcosystem::poll_until(|| {
+                poll_until(|| {
                     count.load(Ordering::SeqCst) > limit
                         || clock.delta(start, clock.end())
                             >= Duration::from_secs(args.warm_up_duration + args.duration)
@@ -234,6 +298,7 @@ fn main() {
                 let _ = shutdown.send(());
             }
             AsyncEcosystem::poll_all();
+            Transport::flush_tx();
             // client_list.into_iter().for_each(|mut client| {
             //     assert!(Pin::new(&mut client)
             //         .poll(&mut Context::from_waker(noop_waker_ref()))
@@ -244,7 +309,8 @@ fn main() {
         }
 
         fn launch(
-            mut client: impl FnMut() -> C,
+            transport: &mut Transport,
+            mut client: impl FnMut(&mut Transport) -> C,
             args: Args,
             status: Arc<AtomicU32>,
             latency: Vec<LocalLatency>,
@@ -254,11 +320,12 @@ fn main() {
                 .map(|i| {
                     (i..args.n_client)
                         .step_by(args.n_worker as usize)
-                        .map(|_| client())
+                        .map(|_| client(transport))
                         .collect()
                 })
                 .collect();
             let mut worker_data = Self {
+                transport,
                 client_list,
                 count: Arc::new(AtomicU32::new(0)),
                 latency,
@@ -286,12 +353,13 @@ fn main() {
     .collect();
     match args.mode {
         Mode::Unreplicated => WorkerData::launch(
-            || {
-                unreplicated::Client::<_, AsyncEcosystem>::register_new(
-                    config.clone(),
-                    &mut transport,
-                    false,
-                )
+            &mut transport,
+            |transport| {
+                shard_client(&config, transport, |config, transport| {
+                    unreplicated::Client::<_, AsyncEcosystem>::register_new(
+                        config, transport, false,
+                    )
+                })
             },
             args,
             status.clone(),
@@ -299,12 +367,11 @@ fn main() {
             property,
         ),
         Mode::UnreplicatedSigned => WorkerData::launch(
-            || {
-                unreplicated::Client::<_, AsyncEcosystem>::register_new(
-                    config.clone(),
-                    &mut transport,
-                    true,
-                )
+            &mut transport,
+            |transport| {
+                shard_client(&config, transport, |config, transport| {
+                    unreplicated::Client::<_, AsyncEcosystem>::register_new(config, transport, true)
+                })
             },
             args,
             status.clone(),
@@ -312,29 +379,39 @@ fn main() {
             property,
         ),
         Mode::PBFT => WorkerData::launch(
-            || pbft::Client::<_, AsyncEcosystem>::register_new(config.clone(), &mut transport),
+            &mut transport,
+            |transport| {
+                shard_client(&config, transport, |config, transport| {
+                    pbft::Client::<_, AsyncEcosystem>::register_new(config, transport)
+                })
+            },
             args,
             status.clone(),
             latency.iter().map(|latency| latency.local()).collect(),
             property,
         ),
         Mode::HotStuff => WorkerData::launch(
-            || hotstuff::Client::<_, AsyncEcosystem>::register_new(config.clone(), &mut transport),
+            &mut transport,
+            |transport| {
+                shard_client(&config, transport, |config, transport| {
+                    hotstuff::Client::<_, AsyncEcosystem>::register_new(config, transport)
+                })
+            },
             args,
             status.clone(),
             latency.iter().map(|latency| latency.local()).collect(),
             property,
         ),
         Mode::Zyzzyva => WorkerData::launch(
+            &mut transport,
             {
                 let wait_all = args.wait_all;
-                let transport = &mut transport;
-                move || {
-                    zyzzyva::Client::<_, AsyncEcosystem>::register_new(
-                        config.clone(),
-                        transport,
-                        wait_all,
-                    )
+                move |transport: &mut Transport| {
+                    Serial::new(shard_client(&config, transport, |config, transport| {
+                        zyzzyva::Client::<_, AsyncEcosystem>::register_new(
+                            config, transport, wait_all,
+                        )
+                    }))
                 }
             },
             args,
@@ -343,7 +420,8 @@ fn main() {
             property,
         ),
         Mode::YCSB => WorkerData::launch(
-            || ycsb::TraceClient::default(),
+            &mut transport,
+            |_| Serial::new(ycsb::TraceClient::default()),
             args,
             status.clone(),
             latency.iter().map(|latency| latency.local()).collect(),
@@ -353,6 +431,13 @@ fn main() {
 
     transport.run(0, || status.load(Ordering::SeqCst) == Status::Shutdown as _);
     unsafe { rte_eal_mp_wait_lcore() };
+    let occupancy = transport.tx_burst_occupancy();
+    if !occupancy.is_empty() {
+        println!("tx burst occupancy {:?}", occupancy);
+    }
+    if transport.tx_drop() > 0 {
+        println!("tx drop {}", transport.tx_drop());
+    }
 
     for mut latency in latency {
         latency.refresh();
@@ -367,6 +452,26 @@ fn main() {
     }
 }
 
+fn shard_client<C>(
+    config: &Config<Transport>,
+    transport: &mut Transport,
+    mut client: impl FnMut(Config<Transport>, &mut Transport) -> C,
+) -> ShardClient<C> {
+    ShardClient::new(
+        (0..config.n_group())
+            .map(|group_id| client(config.shard(group_id), transport))
+            .collect(),
+    )
+}
+
+// every poll pass over all clients is a natural point to flush tx buffer
+fn poll_until(predict: impl Fn() -> bool) {
+    AsyncEcosystem::poll_until(|| {
+        Transport::flush_tx();
+        predict()
+    });
+}
+
 fn spawn_client<C: Receiver<Transport> + Invoke + Send + 'static>(
     mut client: C,
     count: Arc<AtomicU32>,
@@ -411,33 +516,8 @@ fn spawn_client<C: Receiver<Transport> + Invoke + Send + 'static>(
                 WorkloadName::YCSB => {
                     let (op, post_action) = ycsb_workload.one_op();
                     let measure = clock.measure();
-                    let invoke = async {
-                        match op {
-                            OpKind::Read(op) => {
-                                client.invoke(op).await;
-                                WorkloadName::YCSB_READ
-                            }
-                            OpKind::Update(op) => {
-                                client.invoke(op).await;
-                                WorkloadName::YCSB_UPDATE
-                            }
-                            OpKind::ReadModifyWrite(read_op, update_op) => {
-                                client.invoke(read_op).await;
-                                client.invoke(update_op).await;
-                                WorkloadName::YCSB_READ_MODIFY_WRITE
-                            }
-                            OpKind::Scan(op) => {
-                                client.invoke(op).await;
-                                WorkloadName::YCSB_SCAN
-                            }
-                            OpKind::Insert(op) => {
-                                client.invoke(op).await;
-                                WorkloadName::YCSB_INSERT
-                            }
-                        }
-                    };
                     select! {
-                        row = invoke.fuse() => {
+                        row = invoke_ycsb(&mut client, op).fuse() => {
                             if status.load(Ordering::SeqCst) == Status::Run as _ {
                                 latency[row] += measure;
                                 latency[WorkloadName::ALL] += measure;
@@ -452,3 +532,203 @@ fn spawn_client<C: Receiver<Transport> + Invoke + Send + 'static>(
     });
     (handle, shutdown_tx)
 }
+
+// return latency row of op
+async fn invoke_ycsb(client: &mut impl Invoke, op: OpKind) -> usize {
+    let (row, op, next_op) = split_ycsb(op);
+    client.invoke(op).await;
+    if let Some(op) = next_op {
+        client.invoke(op).await;
+    }
+    row
+}
+
+// latency row of op, the first request and the following one if any
+fn split_ycsb(op: OpKind) -> (usize, Opaque, Option<Opaque>) {
+    match op {
+        OpKind::Read(op) => (WorkloadName::YCSB_READ, op, None),
+        OpKind::Update(op) => (WorkloadName::YCSB_UPDATE, op, None),
+        OpKind::ReadModifyWrite(read_op, update_op) => (
+            WorkloadName::YCSB_READ_MODIFY_WRITE,
+            read_op,
+            Some(update_op),
+        ),
+        OpKind::Scan(op) => (WorkloadName::YCSB_SCAN, op, None),
+        OpKind::Insert(op) => (WorkloadName::YCSB_INSERT, op, None),
+    }
+}
+
+// pipeline over a client that can only invoke, so it has one request
+// outstanding and the rest are queued
+// the invoking owns the client, so it survives dropped `complete` futures
+struct Serial<C> {
+    address: <Transport as facade::Transport>::Address,
+    client: Option<C>,
+    request_number: RequestNumber,
+    queue: VecDeque<(RequestNumber, Opaque)>,
+    #[allow(clippy::type_complexity)]
+    invoking: Option<Pin<Box<dyn Future<Output = (C, Opaque)> + Send>>>,
+}
+
+impl<C: Receiver<Transport>> Serial<C> {
+    fn new(client: C) -> Self {
+        Self {
+            address: client.get_address().clone(),
+            client: Some(client),
+            request_number: 0,
+            queue: VecDeque::new(),
+            invoking: None,
+        }
+    }
+}
+
+impl<C> Receiver<Transport> for Serial<C> {
+    fn get_address(&self) -> &<Transport as facade::Transport>::Address {
+        &self.address
+    }
+}
+
+#[async_trait]
+impl<C: Invoke + Send + 'static> Invoke for Serial<C> {
+    async fn invoke(&mut self, op: Opaque) -> Opaque {
+        self.client.as_mut().unwrap().invoke(op).await
+    }
+}
+
+#[async_trait]
+impl<C: Invoke + Send + 'static> Pipeline for Serial<C> {
+    fn submit(&mut self, op: Opaque) -> RequestNumber {
+        self.request_number += 1;
+        self.queue.push_back((self.request_number, op));
+        self.request_number
+    }
+
+    async fn complete(&mut self) -> (RequestNumber, Opaque) {
+        if self.invoking.is_none() {
+            let op = if let Some((_, op)) = self.queue.front() {
+                op.clone()
+            } else {
+                return pending().await;
+            };
+            let mut client = self.client.take().unwrap();
+            self.invoking = Some(Box::pin(async move {
+                let result = client.invoke(op).await;
+                (client, result)
+            }));
+        }
+        let (client, result) = self.invoking.as_mut().unwrap().await;
+        self.invoking = None;
+        self.client = Some(client);
+        (self.queue.pop_front().unwrap().0, result)
+    }
+}
+
+// open loop counterpart of `spawn_client`
+// the client schedules arrivals at `rate`, and submits each one through
+// pipeline if it has less than `n_outstanding` requests outstanding, or the
+// arrival waits in backlog until one completes. since latency is measured
+// from the scheduled time instead of sending time, the waiting is counted,
+// i.e. no coordinated omission
+#[allow(clippy::too_many_arguments)]
+fn spawn_open_loop<C: Receiver<Transport> + Pipeline + Send + 'static>(
+    mut client: C,
+    rate: f64,
+    arrival: Arrival,
+    n_outstanding: usize,
+    count: Arc<AtomicU32>,
+    status: Arc<AtomicU32>,
+    mut latency: Vec<LocalLatency>,
+    workload: WorkloadName,
+    ycsb_workload: Arc<Workload>,
+) -> (
+    <AsyncEcosystem as facade::AsyncEcosystem<()>>::JoinHandle,
+    oneshot::Sender<()>,
+) {
+    assert!(n_outstanding > 0);
+    let (shutdown_tx, mut shutdown) = oneshot::channel();
+    let handle = AsyncEcosystem::spawn(async move {
+        debug!("{}", client.get_address());
+        let limit = match workload {
+            WorkloadName::Null => u32::MAX,
+            WorkloadName::YCSB => {
+                if ycsb_workload.property.do_transaction {
+                    ycsb_workload.property.operation_count as _
+                } else {
+                    ycsb_workload.property.record_count as _
+                }
+            }
+        };
+        let interval = Duration::from_secs_f64(1. / rate);
+        // thread rng is not send
+        let mut rng = StdRng::from_entropy();
+        let next_arrival = |rng: &mut StdRng| match arrival {
+            Arrival::Constant => interval,
+            // exponential inter-arrival by inverse transform
+            Arrival::Poisson => interval.mul_f64(-(1. - rng.gen::<f64>()).ln()),
+        };
+        let base = MeasureClock::default().measure();
+        let start = Instant::now();
+        let mut offset = next_arrival(&mut rng);
+        let mut arriving = true;
+        let mut backlog = VecDeque::new();
+        // request number => (measure, latency row, following op, post action)
+        let mut pending_table = HashMap::new();
+        loop {
+            while pending_table.len() < n_outstanding {
+                let measure = if let Some(measure) = backlog.pop_front() {
+                    measure
+                } else {
+                    break;
+                };
+                let (row, op, next_op, post_action) = match workload {
+                    WorkloadName::Null => (WorkloadName::ALL, Opaque::default(), None, None),
+                    WorkloadName::YCSB => {
+                        let (op, post_action) = ycsb_workload.one_op();
+                        let (row, op, next_op) = split_ycsb(op);
+                        (row, op, next_op, Some(post_action))
+                    }
+                };
+                pending_table.insert(client.submit(op), (measure, row, next_op, post_action));
+            }
+
+            let deadline = if arriving {
+                start + offset
+            } else {
+                start + Duration::from_secs(1000000)
+            };
+            select! {
+                _ = <AsyncEcosystem as facade::AsyncEcosystem<()>>::sleep_until(deadline)
+                    .fuse() => {
+                    if status.load(Ordering::SeqCst) == Status::WarmUp as _
+                        || count.fetch_add(1, Ordering::SeqCst) < limit
+                    {
+                        backlog.push_back(base.schedule(offset));
+                        offset += next_arrival(&mut rng);
+                    } else {
+                        arriving = false;
+                    }
+                }
+                (request_number, _) = client.complete().fuse() => {
+                    let (measure, row, next_op, post_action) =
+                        pending_table.remove(&request_number).unwrap();
+                    // read modify write holds its slot for the update
+                    if let Some(op) = next_op {
+                        pending_table.insert(client.submit(op), (measure, row, None, post_action));
+                        continue;
+                    }
+                    if status.load(Ordering::SeqCst) == Status::Run as _ {
+                        if row != WorkloadName::ALL {
+                            latency[row] += measure;
+                        }
+                        latency[WorkloadName::ALL] += measure;
+                    }
+                    if let Some(post_action) = post_action {
+                        post_action(&*ycsb_workload);
+                    }
+                }
+                _ = shutdown => return,
+            }
+        }
+    });
+    (handle, shutdown_tx)
+}
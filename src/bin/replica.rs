@@ -1,12 +1,14 @@
 use std::{
     ffi::c_void,
-    fs,
+    fs::{self, File},
     path::PathBuf,
     process,
     sync::{
         atomic::{AtomicBool, Ordering},
         Arc,
     },
+    thread,
+    time::Duration,
 };
 
 use clap::{ArgEnum, Parser};
@@ -17,11 +19,14 @@ use oskr::{
         rte_eal_mp_remote_launch, rte_eal_mp_wait_lcore, rte_eth_dev_socket_id,
         rte_rmt_call_main_t, rte_socket_id,
     },
-    facade::{self, App},
+    facade::{self, App, AsyncEcosystem as _},
     framework::{
-        dpdk::Transport,
+        busy_poll,
+        dpdk::{RxSteering, Transport},
         memory_database,
-        sqlite::Database,
+        metrics::Metrics,
+        sqlite::{self, Database},
+        trace,
         ycsb_workload::{Property, Workload},
     },
     protocol::{hotstuff, pbft, unreplicated, zyzzyva},
@@ -31,7 +36,7 @@ use tracing::{debug, info, warn};
 
 struct NullApp;
 impl App for NullApp {
-    fn execute(&mut self, _op_number: OpNumber, _op: Opaque) -> Opaque {
+    fn execute(&mut self, _op_number: OpNumber, _op: &[u8]) -> Opaque {
         Opaque::default()
     }
 }
@@ -60,6 +65,14 @@ fn main() {
         YCSBMemory,
     }
 
+    #[derive(Debug, Clone, Copy, PartialEq, Eq, ArgEnum)]
+    enum Synchronous {
+        Off,
+        Normal,
+        Full,
+        Extra,
+    }
+
     #[derive(Debug, Clone, Copy, PartialEq, Eq, ArgEnum)]
     enum MulticastKey {
         HMAC,
@@ -77,6 +90,9 @@ fn main() {
         config: PathBuf,
         #[clap(short = 'i')]
         replica_id: ReplicaId,
+        // group (shard) this replica belongs to, replica id is numbered in group
+        #[clap(short, long, default_value_t = 0)]
+        group: usize,
         #[clap(long, default_value = "000000ff")]
         mask: String,
         #[clap(long = "port", default_value_t = 0)]
@@ -85,33 +101,78 @@ fn main() {
         n_worker: usize,
         #[clap(long = "tx", default_value_t = 1)]
         n_tx: u16,
+        #[clap(long = "rx", default_value_t = 1)]
+        n_rx: u16,
         #[clap(short, long, default_value_t = 1)]
         batch_size: usize,
         #[clap(long)]
         adaptive: bool,
+        // max number of in-flight batches on PBFT primary, 0 for estimation
+        // based on worker number
+        #[clap(long = "pipeline", default_value_t = 0)]
+        pipeline_window: usize,
+        // close a partial PBFT batch after waiting this long, in microseconds
+        #[clap(long = "batch-timeout")]
+        batch_timeout: Option<u64>,
+        // rotate HotStuff leader every view
+        #[clap(long = "rotate")]
+        rotate_leader: bool,
+        // HotStuff pacemaker interval, in milliseconds
+        #[clap(long)]
+        pacemaker: Option<u64>,
         #[clap(short)]
         property_list: Vec<String>,
         #[clap(long = "db")]
         database_file: Option<PathBuf>,
+        // commit YCSB database once per batch in WAL journal, with this
+        // synchronous level
+        #[clap(long, arg_enum)]
+        synchronous: Option<Synchronous>,
         #[clap(long = "check-eq")]
         check_equivocation: bool,
         #[clap(long = "multi-key", arg_enum, default_value_t = MulticastKey::HMAC)]
         multicast_key: MulticastKey,
         #[clap(long = "k256")]
         use_k256: bool,
+        // MAC authenticator among replicas, only for PBFT and Zyzzyva
+        #[clap(long)]
+        authenticator: bool,
+        // BLS keys among replicas so QC is aggregated, only for HotStuff
+        #[clap(long)]
+        bls: bool,
         #[clap(long = "drop", default_value_t = 0.)]
         drop_rate: f32,
+        // trace per-phase latency of one in every this many events, PBFT only
+        #[clap(long = "trace", default_value_t = 0)]
+        trace_interval: u32,
+        // write a metrics snapshot line into this file periodically
+        #[clap(long = "metrics")]
+        metrics_file: Option<PathBuf>,
+        // in milliseconds
+        #[clap(long, default_value_t = 1000)]
+        metrics_interval: u64,
     }
     let args = Args::parse();
+    trace::set_sample_interval(args.trace_interval);
     let core_mask = u128::from_str_radix(&args.mask, 16).unwrap();
     info!("initialize with {} cores", core_mask.count_ones());
-    assert!(core_mask.count_ones() > args.n_worker as u32); // strictly greater-than to preserve one rx core
+    // strictly greater-than to preserve one rx core, and every extra rx queue
+    // takes one more core
+    assert!(core_mask.count_ones() > (args.n_worker + args.n_rx as usize - 1) as u32);
 
     let prefix = args.config.file_name().unwrap().to_str().unwrap();
     let config = args.config.with_file_name(format!("{}.config", prefix));
     let mut config: facade::Config<_> = fs::read_to_string(config).unwrap().parse().unwrap();
     config.collect_signing_key(&args.config, !args.use_k256);
-    let config = Config::for_shard(config, 0); // TODO
+    let mut config = Config::for_shard(config, args.group);
+    if args.authenticator {
+        assert!(matches!(args.mode, Mode::PBFT | Mode::Zyzzyva));
+        config.use_authenticator(args.replica_id);
+    }
+    if args.bls {
+        assert_eq!(args.mode, Mode::HotStuff);
+        config.use_bls();
+    }
 
     let mut property = Property::default();
     // TODO property file
@@ -135,13 +196,20 @@ fn main() {
     })
     .unwrap();
 
-    let mut transport = Transport::setup(core_mask, args.port_id, 1, args.n_tx);
+    let mut transport = Transport::setup(
+        core_mask,
+        args.port_id,
+        args.n_rx,
+        args.n_tx,
+        RxSteering::Source,
+    );
     if let Some(address) = config.multicast {
         transport.set_multicast_address(address);
     }
     transport.set_drop_rate(args.drop_rate);
 
     struct WorkerData<Replica: State> {
+        transport: *const Transport,
         replica: Arc<Handle<Replica>>,
         args: Arc<Args>,
         shutdown: Arc<AtomicBool>,
@@ -153,26 +221,51 @@ fn main() {
             let args = worker_data.args.clone();
             let shutdown = worker_data.shutdown.clone();
 
-            if Transport::worker_id() < args.n_worker {
+            let worker_id = Transport::worker_id();
+            if (args.n_worker..args.n_worker + args.n_rx as usize - 1).contains(&worker_id) {
+                let transport = unsafe { &*worker_data.transport };
+                let queue_id = (worker_id - args.n_worker + 1) as u16;
+                debug!("start rx worker {} on queue {}", worker_id, queue_id);
+                transport.run1(queue_id, || shutdown.load(Ordering::SeqCst));
+            }
+            if worker_id < args.n_worker {
                 if unsafe { rte_socket_id() == rte_eth_dev_socket_id(args.port_id) } {
-                    replica.run_worker(|| shutdown.load(Ordering::SeqCst));
+                    replica.run_worker_with_hooks(
+                        || shutdown.load(Ordering::SeqCst),
+                        Transport::flush_tx,
+                        Transport::flush_tx_expired,
+                    );
                 } else {
                     debug!(
                         "start stateless worker {} on remote socket",
                         Transport::worker_id()
                     );
-                    replica.run_stateless_worker(|| shutdown.load(Ordering::SeqCst));
+                    replica.run_stateless_worker_with_hooks(
+                        || shutdown.load(Ordering::SeqCst),
+                        Transport::flush_tx,
+                        Transport::flush_tx_expired,
+                    );
                 }
+                // the last task may have sent without idling after it
+                Transport::flush_tx();
             }
             0
         }
 
-        fn launch(replica: Handle<R>, args: Args, shutdown: Arc<AtomicBool>) -> Box<dyn FnOnce()>
+        fn launch(
+            replica: Handle<R>,
+            transport: &Transport,
+            args: Args,
+            shutdown: Arc<AtomicBool>,
+        ) -> (Box<dyn FnOnce()>, Metrics<'static>)
         where
             R: 'static,
         {
+            let mut metrics = Metrics::default();
+            replica.export_metrics(&mut metrics);
             let replica = Arc::new(replica);
             let data = Self {
+                transport,
                 replica: replica.clone(),
                 args: Arc::new(args),
                 shutdown,
@@ -184,7 +277,7 @@ fn main() {
                     rte_rmt_call_main_t::SKIP_MAIN,
                 );
             }
-            Box::new(move || replica.unpark_all())
+            (Box::new(move || replica.unpark_all()), metrics)
         }
     }
 
@@ -194,42 +287,84 @@ fn main() {
         config: Config<Transport>,
         transport: &mut Transport,
         shutdown: Arc<AtomicBool>,
-    ) -> impl FnOnce() {
+    ) -> (Box<dyn FnOnce()>, Metrics<'static>) {
         match args.mode {
             Mode::Unreplicated => WorkerData::launch(
                 unreplicated::Replica::register_new(config, transport, args.replica_id, app, false),
+                transport,
                 args,
                 shutdown.clone(),
             ),
             Mode::UnreplicatedSigned => WorkerData::launch(
                 unreplicated::Replica::register_new(config, transport, args.replica_id, app, true),
+                transport,
                 args,
                 shutdown.clone(),
             ),
-            Mode::PBFT => WorkerData::launch(
-                pbft::Replica::register_new(
+            Mode::PBFT => {
+                let replica = pbft::Replica::register_new(
                     config,
                     transport,
                     args.replica_id,
                     app,
                     args.batch_size,
                     args.adaptive,
-                ),
-                args,
-                shutdown.clone(),
-            ),
-            Mode::HotStuff => WorkerData::launch(
-                hotstuff::Replica::register_new(
+                );
+                let mut batch_timer = None;
+                replica.with_stateful(|replica| {
+                    replica.set_pipeline(
+                        args.pipeline_window,
+                        args.batch_timeout.map(Duration::from_micros),
+                    );
+                    if args.batch_timeout.is_some() {
+                        batch_timer = Some(replica.batch_timer::<busy_poll::AsyncEcosystem>());
+                    }
+                });
+                if let Some(batch_timer) = batch_timer {
+                    // on a spare thread, which inherits affinity of main lcore
+                    // that runs rx, so it parks between deadlines instead of
+                    // spinning
+                    let shutdown = shutdown.clone();
+                    thread::spawn(move || {
+                        let _batch_timer = busy_poll::AsyncEcosystem::spawn(batch_timer);
+                        busy_poll::AsyncEcosystem::park_until(
+                            || shutdown.load(Ordering::SeqCst),
+                            Duration::from_millis(100),
+                        );
+                    });
+                }
+                WorkerData::launch(replica, transport, args, shutdown.clone())
+            }
+            Mode::HotStuff => {
+                let replica = hotstuff::Replica::register_new(
                     config,
                     transport,
                     args.replica_id,
                     NullApp,
                     args.batch_size,
                     args.adaptive,
-                ),
-                args,
-                shutdown.clone(),
-            ),
+                );
+                let mut pacemaker = None;
+                replica.with_stateful(|replica| {
+                    replica.set_rotate_leader(args.rotate_leader);
+                    pacemaker = args.pacemaker.map(|interval| {
+                        replica
+                            .pacemaker::<busy_poll::AsyncEcosystem>(Duration::from_millis(interval))
+                    });
+                });
+                if let Some(pacemaker) = pacemaker {
+                    // parking on a spare thread, same as PBFT batch timer
+                    let shutdown = shutdown.clone();
+                    thread::spawn(move || {
+                        let _pacemaker = busy_poll::AsyncEcosystem::spawn(pacemaker);
+                        busy_poll::AsyncEcosystem::park_until(
+                            || shutdown.load(Ordering::SeqCst),
+                            Duration::from_millis(100),
+                        );
+                    });
+                }
+                WorkerData::launch(replica, transport, args, shutdown.clone())
+            }
             Mode::Zyzzyva => WorkerData::launch(
                 zyzzyva::Replica::register_new(
                     config,
@@ -238,31 +373,35 @@ fn main() {
                     app,
                     args.batch_size,
                 ),
+                transport,
                 args,
                 shutdown.clone(),
             ),
         }
     }
 
-    let unpark: Box<dyn FnOnce()> = match args.app {
-        AppName::Null => Box::new(launch_app(
-            NullApp,
-            args,
-            config,
-            &mut transport,
-            shutdown.clone(),
-        )),
+    let (metrics_file, metrics_interval) = (args.metrics_file.clone(), args.metrics_interval);
+    let (unpark, mut metrics) = match args.app {
+        AppName::Null => launch_app(NullApp, args, config, &mut transport, shutdown.clone()),
         AppName::YCSB => {
             let create_table = args
                 .database_file
                 .as_ref()
                 .map(|db| !db.exists())
                 .unwrap_or(true);
-            let app = if let Some(db) = args.database_file.as_ref() {
+            let mut app = if let Some(db) = args.database_file.as_ref() {
                 Database::open(db)
             } else {
                 Database::default()
             };
+            if let Some(synchronous) = args.synchronous {
+                app = app.with_batch_commit(match synchronous {
+                    Synchronous::Off => sqlite::Synchronous::Off,
+                    Synchronous::Normal => sqlite::Synchronous::Normal,
+                    Synchronous::Full => sqlite::Synchronous::Full,
+                    Synchronous::Extra => sqlite::Synchronous::Extra,
+                });
+            }
             if create_table {
                 app.create_table(
                     &property.table,
@@ -275,16 +414,14 @@ fn main() {
                         .collect::<Vec<_>>(),
                 );
             }
-            Box::new(launch_app(
-                app,
-                args,
-                config,
-                &mut transport,
-                shutdown.clone(),
-            ))
+            launch_app(app, args, config, &mut transport, shutdown.clone())
         }
         AppName::YCSBMemory => {
-            let mut app = memory_database::Database::default();
+            let mut app = if args.mode == Mode::Zyzzyva {
+                memory_database::Database::speculative()
+            } else {
+                memory_database::Database::default()
+            };
             // TODO more real setup
             property.do_transaction = false;
             let table = property.table.clone();
@@ -294,25 +431,49 @@ fn main() {
                 let (key, mut value_table) = workload.next_insert_entry();
                 // overwrite values to make replication has matching database
                 for value in value_table.values_mut() {
-                    for (i, b) in value.iter_mut().enumerate() {
-                        *b = i.to_le_bytes()[0];
-                    }
+                    *value = (0..value.len()).map(|i| i.to_le_bytes()[0]).collect();
                 }
                 app.insert(table.clone(), key, value_table).unwrap();
             }
             info!("finish building database");
 
-            Box::new(launch_app(
-                app,
-                args,
-                config,
-                &mut transport,
-                shutdown.clone(),
-            ))
+            launch_app(app, args, config, &mut transport, shutdown.clone())
         }
     };
-    transport.run1(|| shutdown.load(Ordering::SeqCst));
+    let transport = &transport;
+    metrics.counter("rx", || transport.rx_stat().0);
+    metrics.counter("rx_drop", || transport.rx_stat().1);
+    metrics.gauge("mbuf_in_use", || transport.mbuf_in_use() as _);
+    metrics.counter("tx_burst", || transport.tx_burst_occupancy().iter().sum());
+    metrics.counter("tx_drop", || transport.tx_drop());
+    metrics.counter("tx_packet", || {
+        let occupancy = transport.tx_burst_occupancy().into_iter().enumerate();
+        occupancy.map(|(size, count)| size as u64 * count).sum()
+    });
+    crossbeam::scope(|scope| {
+        if let Some(metrics_file) = metrics_file {
+            let shutdown = shutdown.clone();
+            // not an lcore, only reads counters
+            scope.spawn(move |_| {
+                metrics.run(
+                    File::create(metrics_file).unwrap(),
+                    Duration::from_millis(metrics_interval),
+                    || shutdown.load(Ordering::SeqCst),
+                )
+            });
+        }
+        transport.run1(0, || shutdown.load(Ordering::SeqCst));
+    })
+    .unwrap();
     unpark();
     unsafe { rte_eal_mp_wait_lcore() };
+    trace::print();
+    let occupancy = transport.tx_burst_occupancy();
+    if !occupancy.is_empty() {
+        println!("tx burst occupancy {:?}", occupancy);
+    }
+    if transport.tx_drop() > 0 {
+        println!("tx drop {}", transport.tx_drop());
+    }
     info!("gracefully shutdown");
 }
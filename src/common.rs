@@ -8,13 +8,19 @@ use std::{
 
 use bincode::Options;
 use rand::{distributions::Alphanumeric, thread_rng, Rng};
-use serde::{de::DeserializeOwned, Serialize};
+use serde::{de::DeserializeOwned, Deserialize, Serialize};
 use tracing::debug;
 
 pub mod config;
 pub use config::Config;
+pub mod opaque;
+pub use opaque::Opaque;
+pub mod pipeline;
+pub use pipeline::PendingTable;
 pub mod signed;
-pub use signed::{SignedMessage, SigningKey, VerifyingKey};
+pub use signed::{AggregatedMessage, SignedMessage, SignedView, SigningKey, VerifyingKey};
+pub mod window;
+pub use window::{ReplicaSet, Window};
 
 pub type ReplicaId = i8;
 pub type ClientId = [u8; 4];
@@ -29,9 +35,8 @@ pub fn generate_id() -> ClientId {
 }
 
 pub type RequestNumber = u32;
-pub type ViewNumber = u8;
+pub type ViewNumber = u32;
 pub type OpNumber = u32;
-pub type Opaque = Vec<u8>;
 pub type Digest = [u8; 32];
 
 #[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
@@ -55,6 +60,41 @@ pub fn deserialize<M: DeserializeOwned>(reader: impl Read) -> Result<M, Malforme
         })
 }
 
+/// Deserialize a message that borrows from `buffer`, e.g. contains
+/// `SignedView`, and return it with the remaining part of buffer.
+pub fn deserialize_view<'a, M: Deserialize<'a> + Serialize>(
+    buffer: &'a [u8],
+) -> Result<(M, &'a [u8]), MalformedMessage> {
+    let options = bincode::DefaultOptions::new().allow_trailing_bytes();
+    let message: M = options.deserialize(buffer).map_err(|err| {
+        debug!("deserailize error: {}", err);
+        MalformedMessage
+    })?;
+    let length = options.serialized_size(&message).unwrap() as usize;
+    Ok((message, &buffer[length..]))
+}
+
+/// Deserialize a message from shared buffer, where every `Opaque` in
+/// message points into `buffer` instead of owning a copy.
+pub fn deserialize_shared<M: DeserializeOwned>(buffer: &Opaque) -> Result<M, MalformedMessage> {
+    opaque::with_source(buffer, || {
+        bincode::DefaultOptions::new()
+            .allow_trailing_bytes()
+            .deserialize(buffer)
+            .map_err(|err| {
+                debug!("deserailize error: {}", err);
+                MalformedMessage
+            })
+    })
+}
+
+/// Shared counterpart of `deserialize_view`.
+pub fn deserialize_view_shared<'a, M: Deserialize<'a> + Serialize>(
+    buffer: &'a Opaque,
+) -> Result<(M, &'a [u8]), MalformedMessage> {
+    opaque::with_source(buffer, || deserialize_view(buffer))
+}
+
 pub fn serialize<M: Serialize, T: ?Sized>(message: M) -> impl FnOnce(&mut T) -> u16
 where
     for<'a> Cursor<&'a mut T>: Write,
@@ -94,6 +94,8 @@ impl<T: Transport> Config<T> {
         if config.group.is_empty() {
             // classical
             assert_eq!(group_id, 0);
+        } else {
+            assert!(group_id < config.group.len());
         }
         Self {
             verifying_key: config
@@ -116,6 +118,22 @@ impl<T: Transport> Config<T> {
         }
     }
 
+    /// Number of groups, i.e. shards. Classical config has one group of all
+    /// replicas.
+    pub fn n_group(&self) -> usize {
+        self.group.len().max(1)
+    }
+
+    /// Config of group `group_id`, derived from a global config which serves
+    /// as the directory of shards.
+    pub fn shard(&self, group_id: usize) -> Self {
+        if let ConfigInner::Global(config) = &self.inner {
+            Self::for_shard(config.clone(), group_id)
+        } else {
+            panic!("shard from a config that is not global")
+        }
+    }
+
     pub fn signing_key(&self, receiver: &impl Receiver<T>) -> &SigningKey {
         &match &self.inner {
             ConfigInner::Shard(config, _) => config,
@@ -128,6 +146,69 @@ impl<T: Transport> Config<T> {
         .1
     }
 
+    /// Switch to MAC authenticator for messages among replicas.
+    ///
+    /// Local signing key and the verifying keys of replicas are replaced with
+    /// pairwise symmetric keys, derived from local signing key and remote
+    /// verifying keys. Only replica `replica_id` itself should use the
+    /// converted config. Replies signed with authenticator cannot be verified
+    /// by clients, so the protocol must not require that.
+    pub fn use_authenticator(&mut self, replica_id: ReplicaId) {
+        let address = self.replica(replica_id).clone();
+        let replica_list = self.replica(..).to_vec();
+        let key_list: Vec<_> = {
+            let signing_key = &self
+                .signing_key
+                .iter()
+                .find(|(remote, _)| *remote == address)
+                .unwrap()
+                .1;
+            replica_list
+                .iter()
+                .map(|remote| signing_key.shared_key(self.verifying_key(remote).unwrap()))
+                .collect()
+        };
+        for (remote, key) in &mut self.verifying_key {
+            if let Some(i) = replica_list.iter().position(|replica| replica == remote) {
+                *key = VerifyingKey::Authenticator {
+                    key: key_list[i],
+                    index: replica_id as usize,
+                };
+            }
+        }
+        match &mut self.inner {
+            ConfigInner::Shard(config, _) => config,
+            ConfigInner::Global(config) => config,
+        }
+        .signing_key
+        .iter_mut()
+        .find(|(remote, _)| *remote == address)
+        .unwrap()
+        .1 = SigningKey::Authenticator(key_list);
+    }
+
+    /// Switch replicas to BLS keys, see [`SigningKey::use_bls`].
+    ///
+    /// Signatures of replicas become aggregatable. Every node that verifies
+    /// replica signatures should use the converted config as well.
+    pub fn use_bls(&mut self) {
+        let replica_list = self.replica(..).to_vec();
+        let config = match &mut self.inner {
+            ConfigInner::Shard(config, _) => config,
+            ConfigInner::Global(config) => config,
+        };
+        for (address, key) in &mut config.signing_key {
+            if replica_list.contains(address) {
+                *key = key.clone().use_bls();
+            }
+        }
+        self.verifying_key = config
+            .signing_key
+            .iter()
+            .map(|(address, key)| (address.clone(), key.verifying_key()))
+            .collect();
+    }
+
     pub fn verifying_key(&self, remote: &T::Address) -> Option<&VerifyingKey> {
         self.verifying_key
             .iter()
@@ -135,6 +216,14 @@ impl<T: Transport> Config<T> {
             .map(|(_, key)| key)
     }
 
+    /// Replica id of `remote` in current group, if it is a replica.
+    pub fn replica_id(&self, remote: &T::Address) -> Option<ReplicaId> {
+        self.replica(..)
+            .iter()
+            .position(|replica| replica == remote)
+            .map(|id| id as _)
+    }
+
     pub fn replica<I: ReplicaIndex<T>>(&self, at: I) -> &I::Output {
         I::index(
             match &self.inner {
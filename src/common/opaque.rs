@@ -0,0 +1,224 @@
+//! Shared byte payload.
+//!
+//! Operations and results travel through several layers: receiving buffer,
+//! request message, batch and log, and finally app. [`Opaque`] is a reference
+//! counted slice, so every layer holds the same bytes instead of its own
+//! copy, and a message deserialized with [`deserialize_shared`] keeps its
+//! payloads pointing into receiving buffer.
+//!
+//! A payload pointing into receiving buffer keeps the whole buffer alive, e.g.
+//! a DPDK mbuf from a limited pool, so anything kept beyond processing the
+//! message, like requests in replica's log, should be [`detach`]ed first.
+//!
+//! [`detach`]: Opaque::detach
+//!
+//! [`deserialize_shared`]: super::deserialize_shared
+
+use std::{
+    cell::RefCell,
+    fmt::{self, Debug, Formatter},
+    iter::FromIterator,
+    ops::Deref,
+};
+
+use bytes::Bytes;
+use serde::{
+    de::{self, SeqAccess, Visitor},
+    Deserialize, Deserializer, Serialize, Serializer,
+};
+
+#[derive(Clone, Default, PartialEq, Eq, PartialOrd, Ord, Hash)]
+pub struct Opaque(Bytes);
+
+impl Opaque {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn copy_from_slice(data: &[u8]) -> Self {
+        Self(Bytes::copy_from_slice(data))
+    }
+
+    /// Take ownership of a buffer, e.g. a transport's `RxBuffer`, which is
+    /// released after the last payload pointing into it is dropped.
+    pub fn share(buffer: impl AsRef<[u8]> + Send + 'static) -> Self {
+        Self(Bytes::from_owner(buffer))
+    }
+
+    /// Return the part of `self` that `subset` points to, without copying.
+    /// Panic if `subset` is not inside `self`.
+    pub fn slice_ref(&self, subset: &[u8]) -> Self {
+        Self(self.0.slice_ref(subset))
+    }
+
+    /// Copy into owned storage, so the buffer `self` may point into can be
+    /// released.
+    pub fn detach(&self) -> Self {
+        Self::copy_from_slice(&self.0)
+    }
+
+    fn contains(&self, data: &[u8]) -> bool {
+        let range = self.0.as_ptr_range();
+        let data = data.as_ptr_range();
+        range.start <= data.start && data.end <= range.end
+    }
+}
+
+impl Debug for Opaque {
+    fn fmt(&self, f: &mut Formatter<'_>) -> fmt::Result {
+        self.0.fmt(f)
+    }
+}
+
+impl Deref for Opaque {
+    type Target = [u8];
+    fn deref(&self) -> &Self::Target {
+        &self.0
+    }
+}
+
+impl AsRef<[u8]> for Opaque {
+    fn as_ref(&self) -> &[u8] {
+        &self.0
+    }
+}
+
+impl From<Vec<u8>> for Opaque {
+    fn from(data: Vec<u8>) -> Self {
+        Self(data.into())
+    }
+}
+
+impl From<String> for Opaque {
+    fn from(data: String) -> Self {
+        Self(data.into())
+    }
+}
+
+impl From<&'static [u8]> for Opaque {
+    fn from(data: &'static [u8]) -> Self {
+        Self(Bytes::from_static(data))
+    }
+}
+
+impl FromIterator<u8> for Opaque {
+    fn from_iter<I: IntoIterator<Item = u8>>(iter: I) -> Self {
+        Self(iter.into_iter().collect())
+    }
+}
+
+impl PartialEq<[u8]> for Opaque {
+    fn eq(&self, other: &[u8]) -> bool {
+        *self.0 == *other
+    }
+}
+
+impl PartialEq<&[u8]> for Opaque {
+    fn eq(&self, other: &&[u8]) -> bool {
+        *self.0 == **other
+    }
+}
+
+impl PartialEq<Vec<u8>> for Opaque {
+    fn eq(&self, other: &Vec<u8>) -> bool {
+        *self.0 == **other
+    }
+}
+
+// serialized form is identical to `Vec<u8>` in bincode: a length followed by
+// raw bytes, but written with one copy instead of byte by byte
+impl Serialize for Opaque {
+    fn serialize<S: Serializer>(&self, serializer: S) -> Result<S::Ok, S::Error> {
+        serializer.serialize_bytes(&self.0)
+    }
+}
+
+thread_local! {
+    static SOURCE: RefCell<Option<Opaque>> = RefCell::new(None);
+}
+
+/// Run `f` with `source` as the shared buffer of current thread. Any `Opaque`
+/// deserialized in `f` from bytes borrowed from `source` points into it.
+pub(super) fn with_source<R>(source: &Opaque, f: impl FnOnce() -> R) -> R {
+    let previous = SOURCE.with(|current| current.replace(Some(source.clone())));
+    let result = f();
+    SOURCE.with(|current| *current.borrow_mut() = previous);
+    result
+}
+
+struct OpaqueVisitor;
+impl<'de> Visitor<'de> for OpaqueVisitor {
+    type Value = Opaque;
+
+    fn expecting(&self, formatter: &mut Formatter) -> fmt::Result {
+        formatter.write_str("byte array")
+    }
+
+    fn visit_borrowed_bytes<E: de::Error>(self, v: &'de [u8]) -> Result<Self::Value, E> {
+        Ok(SOURCE.with(|source| match &*source.borrow() {
+            Some(source) if source.contains(v) => source.slice_ref(v),
+            _ => Opaque::copy_from_slice(v),
+        }))
+    }
+
+    fn visit_bytes<E: de::Error>(self, v: &[u8]) -> Result<Self::Value, E> {
+        Ok(Opaque::copy_from_slice(v))
+    }
+
+    fn visit_byte_buf<E: de::Error>(self, v: Vec<u8>) -> Result<Self::Value, E> {
+        Ok(v.into())
+    }
+
+    fn visit_seq<A: SeqAccess<'de>>(self, mut seq: A) -> Result<Self::Value, A::Error> {
+        let mut data = Vec::with_capacity(seq.size_hint().unwrap_or(0));
+        while let Some(byte) = seq.next_element()? {
+            data.push(byte);
+        }
+        Ok(data.into())
+    }
+}
+
+impl<'de> Deserialize<'de> for Opaque {
+    fn deserialize<D: Deserializer<'de>>(deserializer: D) -> Result<Self, D::Error> {
+        deserializer.deserialize_bytes(OpaqueVisitor)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use bincode::Options;
+
+    use crate::common::{deserialize, deserialize_shared, serialize};
+
+    use super::*;
+
+    #[test]
+    fn same_form_as_vec() {
+        let mut buffer = [0; 64];
+        let length = serialize(Opaque::from(b"hello".to_vec()))(&mut buffer[..]) as usize;
+        let expected = bincode::DefaultOptions::new()
+            .serialize(&b"hello".to_vec())
+            .unwrap();
+        assert_eq!(buffer[..length], expected[..]);
+        let opaque: Opaque = deserialize(&buffer[..length]).unwrap();
+        assert_eq!(opaque, b"hello".to_vec());
+    }
+
+    #[test]
+    fn shared() {
+        let buffer = bincode::DefaultOptions::new()
+            .serialize(&(1u32, Opaque::from(b"hello".to_vec())))
+            .unwrap();
+        let buffer = Opaque::share(buffer);
+        let (_, opaque): (u32, Opaque) = deserialize_shared(&buffer).unwrap();
+        assert_eq!(opaque, b"hello".to_vec());
+        assert!(buffer.contains(&opaque));
+        let detached = opaque.detach();
+        assert_eq!(detached, opaque);
+        assert!(!buffer.contains(&detached));
+
+        // not shared without source
+        let (_, opaque): (u32, Opaque) = deserialize(&*buffer).unwrap();
+        assert!(!buffer.contains(&opaque));
+    }
+}
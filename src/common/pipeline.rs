@@ -0,0 +1,121 @@
+//! Outstanding requests of pipelined clients.
+//!
+//! Every [`Pipeline`](crate::facade::Pipeline) client keeps the same
+//! bookkeeping regardless of protocol: a lane per outstanding request, a
+//! resend timer per request, and the replies collected so far. [`PendingTable`]
+//! owns all of them, so a client only builds, sends and parses its messages.
+
+use std::{
+    collections::HashMap,
+    time::{Duration, Instant},
+};
+
+use super::{generate_id, ClientId, Opaque, ReplicaId, RequestNumber};
+
+pub struct PendingTable<M> {
+    pending_table: HashMap<RequestNumber, Pending<M>>,
+    lane_list: Vec<ClientId>,
+}
+
+struct Pending<M> {
+    lane: ClientId,
+    request: M,
+    result_table: HashMap<ReplicaId, Opaque>,
+    timeout: Instant,
+    // no request has been sent on the lane before this one
+    fresh: bool,
+}
+
+impl<M> Default for PendingTable<M> {
+    fn default() -> Self {
+        Self {
+            pending_table: HashMap::new(),
+            lane_list: Vec::new(),
+        }
+    }
+}
+
+impl<M: Clone> PendingTable<M> {
+    const RESEND_INTERVAL: Duration = Duration::from_millis(1000);
+
+    /// Insert request `request_number`, which is built by `request` on the
+    /// lane assigned to it. Return a copy of the request for sending.
+    pub fn insert(
+        &mut self,
+        request_number: RequestNumber,
+        request: impl FnOnce(ClientId) -> M,
+    ) -> M {
+        let (lane, fresh) = if let Some(lane) = self.lane_list.pop() {
+            (lane, false)
+        } else {
+            (generate_id(), true)
+        };
+        self.pending_table
+            .entry(request_number)
+            .or_insert(Pending {
+                lane,
+                request: request(lane),
+                result_table: HashMap::new(),
+                timeout: Instant::now() + Self::RESEND_INTERVAL,
+                fresh,
+            })
+            .request
+            .clone()
+    }
+
+    /// The earliest resend timeout, or far future if nothing is outstanding.
+    pub fn timeout(&self) -> Instant {
+        self.pending_table
+            .values()
+            .map(|pending| pending.timeout)
+            .min()
+            .unwrap_or_else(|| Instant::now() + Duration::from_secs(1000000))
+    }
+
+    /// Record `result` of request `request_number` from `replica_id`. Once
+    /// `n_matched` replicas reply the same result, the request completes and
+    /// its lane is released, and `true` is returned. Replies of requests that
+    /// are not outstanding are ignored.
+    pub fn receive(
+        &mut self,
+        request_number: RequestNumber,
+        replica_id: ReplicaId,
+        result: &Opaque,
+        n_matched: usize,
+    ) -> bool {
+        let pending = if let Some(pending) = self.pending_table.get_mut(&request_number) {
+            pending
+        } else {
+            return false;
+        };
+        pending.result_table.insert(replica_id, result.clone());
+        if pending
+            .result_table
+            .values()
+            .filter(|matched| *matched == result)
+            .count()
+            < n_matched
+        {
+            return false;
+        }
+        let pending = self.pending_table.remove(&request_number).unwrap();
+        self.lane_list.push(pending.lane);
+        true
+    }
+
+    /// Requests whose resend timeout has passed, with their timeout restarted.
+    /// Each one comes with whether it is the first resending on a fresh lane,
+    /// which is expected rather than a sign of trouble, because replicas learn
+    /// the address of a new lane from it.
+    pub fn expired(&mut self) -> Vec<(M, bool)> {
+        let now = Instant::now();
+        self.pending_table
+            .values_mut()
+            .filter(|pending| pending.timeout <= now)
+            .map(|pending| {
+                pending.timeout = now + Self::RESEND_INTERVAL;
+                (pending.request.clone(), std::mem::take(&mut pending.fresh))
+            })
+            .collect()
+    }
+}
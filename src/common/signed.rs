@@ -19,8 +19,28 @@
 //! # Choose Rust Crypto or libsecp256k1
 //!
 //! Work in progress.
+//!
+//! # Authenticator
+//!
+//! Besides ECDSA, a message can be authenticated with a vector of MACs, one
+//! for each replica, as in the original PBFT paper. The MAC keys are pairwise
+//! symmetric keys derived from the ECDSA keys with ECDH, see
+//! [`Config::use_authenticator`](crate::common::Config::use_authenticator).
+//! Authenticated messages are not transferable to non-replica, so it only
+//! works for protocols which never forward replica's signature to someone
+//! outside of replica group.
+//!
+//! # Aggregate signature
+//!
+//! With BLS keys (see [`Config::use_bls`](crate::common::Config::use_bls)),
+//! signed messages with identical content from different signers can be
+//! aggregated into one [`AggregatedMessage`], which has the size of one
+//! signature and is verified with one pairing check, no matter how many
+//! signers there are. Signers' verifying keys are still required for
+//! verification, so the aggregation does not hide who signed it.
 
 use std::{
+    cell::Cell,
     error::Error,
     fmt::{self, Display, Formatter},
     marker::PhantomData,
@@ -28,10 +48,12 @@ use std::{
 };
 
 use bincode::Options;
+use blst::{blst_scalar, min_pk as bls, BLST_ERROR};
 use k256::ecdsa::{
     signature::{Signer, Verifier},
     Signature,
 };
+use rand::{thread_rng, Rng};
 use secp256k1::{Message, Secp256k1};
 use serde::{de::DeserializeOwned, Serialize};
 use serde_derive::{Deserialize, Serialize};
@@ -41,14 +63,31 @@ use sha2::{Digest as _, Sha256};
 pub enum SigningKey {
     K256(k256::ecdsa::SigningKey),
     Secp256k1(secp256k1::SecretKey),
+    /// Pairwise keys shared with each replica, indexed by replica id.
+    Authenticator(Vec<[u8; 32]>),
+    Bls(bls::SecretKey),
 }
 
 #[derive(Debug, Clone)]
 pub enum VerifyingKey {
     K256(k256::ecdsa::VerifyingKey),
     Secp256k1(secp256k1::PublicKey),
+    /// Key shared with remote, and the index of local replica in remote's
+    /// MAC vector.
+    Authenticator {
+        key: [u8; 32],
+        index: usize,
+    },
+    Bls(bls::PublicKey),
 }
 
+// domain separation tag of the ciphersuite, as in BLS signature draft
+// aggregates are verified with `fast_aggregate_verify`, which is only sound
+// against rogue key attack under proof of possession scheme. verifying keys are
+// distributed with config instead of registered by their owners, which stands
+// for the proof of possession here
+const BLS_DST: &[u8] = b"BLS_SIG_BLS12381G2_XMD:SHA-256_SSWU_RO_POP_";
+
 impl SigningKey {
     pub fn verifying_key(&self) -> VerifyingKey {
         let secp = Secp256k1::new();
@@ -57,9 +96,30 @@ impl SigningKey {
             Self::Secp256k1(key) => {
                 VerifyingKey::Secp256k1(secp256k1::PublicKey::from_secret_key(&secp, key))
             }
+            // depends on verifying side
+            Self::Authenticator(_) => unreachable!(),
+            Self::Bls(key) => VerifyingKey::Bls(key.sk_to_pk()),
         }
     }
 
+    /// Derive the symmetric key shared with the owner of `remote`. Both sides
+    /// of the pair derive the same key.
+    pub fn shared_key(&self, remote: &VerifyingKey) -> [u8; 32] {
+        let secret = match self {
+            Self::K256(key) => secp256k1::SecretKey::from_slice(&*key.to_bytes()).unwrap(),
+            Self::Secp256k1(key) => *key,
+            Self::Authenticator(_) | Self::Bls(_) => unreachable!(),
+        };
+        let public = match remote {
+            VerifyingKey::K256(key) => secp256k1::PublicKey::from_slice(&key.to_bytes()).unwrap(),
+            VerifyingKey::Secp256k1(key) => *key,
+            VerifyingKey::Authenticator { .. } | VerifyingKey::Bls(_) => unreachable!(),
+        };
+        let mut key = [0; 32];
+        key.copy_from_slice(secp256k1::ecdh::SharedSecret::new(&public, &secret).as_ref());
+        key
+    }
+
     pub fn use_secp256k1(self) -> Self {
         if let Self::K256(key) = self {
             Self::Secp256k1(secp256k1::SecretKey::from_slice(&*key.to_bytes()).unwrap())
@@ -67,6 +127,16 @@ impl SigningKey {
             unreachable!()
         }
     }
+
+    /// Derive a BLS key from ECDSA secret, so no extra key file is required.
+    pub fn use_bls(self) -> Self {
+        let secret = match self {
+            Self::K256(key) => key.to_bytes().to_vec(),
+            Self::Secp256k1(key) => key.secret_bytes().to_vec(),
+            Self::Authenticator(_) | Self::Bls(_) => unreachable!(),
+        };
+        Self::Bls(bls::SecretKey::key_gen(&secret, &[]).unwrap())
+    }
 }
 
 #[derive(Debug, Clone, Serialize, Deserialize)]
@@ -75,10 +145,47 @@ pub struct SignedMessage<M> {
     // it seems like `Signature` has a buggy serde implementation, which cannot
     // work well with bincode's `deserialize_from`
     // signature: Signature, // do I want to generalize signing algorithm?
-    signature: ([u8; 32], [u8; 32]), // serde not support [u8; 64] yet
+    signature: SignatureData,
     _marker: PhantomData<M>,
 }
 
+#[derive(Debug, Clone, Serialize, Deserialize)]
+enum SignatureData {
+    Ecdsa([u8; 32], [u8; 32]), // serde not support [u8; 64] yet
+    // one MAC for each replica, indexed by replica id
+    Authenticator(Vec<[u8; 16]>),
+    Bls([u8; 32], [u8; 32], [u8; 32]), // compressed G2 point
+}
+
+impl SignatureData {
+    fn bls(signature: &bls::Signature) -> Self {
+        let data = signature.compress();
+        Self::Bls(
+            data[..32].try_into().unwrap(),
+            data[32..64].try_into().unwrap(),
+            data[64..].try_into().unwrap(),
+        )
+    }
+}
+
+// HMAC-SHA256 truncated to 128 bits
+fn authenticate(key: &[u8; 32], data: &[u8]) -> [u8; 16] {
+    let (mut inner_pad, mut outer_pad) = ([0x36; 64], [0x5c; 64]);
+    for i in 0..key.len() {
+        inner_pad[i] ^= key[i];
+        outer_pad[i] ^= key[i];
+    }
+    let inner = Sha256::new()
+        .chain_update(inner_pad)
+        .chain_update(data)
+        .finalize();
+    let outer = Sha256::new()
+        .chain_update(outer_pad)
+        .chain_update(inner)
+        .finalize();
+    outer[..16].try_into().unwrap()
+}
+
 #[derive(Debug, Clone, Copy, PartialEq, Eq, Default)]
 pub struct InauthenticMessage;
 
@@ -105,6 +212,129 @@ impl<M> DerefMut for VerifiedMessage<M> {
     }
 }
 
+// signature parsed against the kind of verifying key
+enum ParsedSignature {
+    K256(Signature),
+    Secp256k1(secp256k1::ecdsa::Signature),
+    Authenticator([u8; 16]),
+    Bls(bls::Signature),
+}
+
+fn parse_bls(sig_a: &[u8; 32], sig_b: &[u8; 32], sig_c: &[u8; 32]) -> Option<bls::Signature> {
+    bls::Signature::uncompress(&[*sig_a, *sig_b, *sig_c].concat()).ok()
+}
+
+fn parse_signature(
+    signature: &SignatureData,
+    key: &VerifyingKey,
+) -> Result<ParsedSignature, InauthenticMessage> {
+    match (key, signature) {
+        (VerifyingKey::K256(_), SignatureData::Ecdsa(sig_a, sig_b)) => {
+            [*sig_a, *sig_b].concat()[..]
+                .try_into()
+                .map(ParsedSignature::K256)
+                .map_err(|_| InauthenticMessage)
+        }
+        (VerifyingKey::Secp256k1(_), SignatureData::Ecdsa(sig_a, sig_b)) => {
+            secp256k1::ecdsa::Signature::from_compact(&[*sig_a, *sig_b].concat())
+                .map(ParsedSignature::Secp256k1)
+                .map_err(|_| InauthenticMessage)
+        }
+        (VerifyingKey::Authenticator { index, .. }, SignatureData::Authenticator(mac_list)) => {
+            mac_list
+                .get(*index)
+                .copied()
+                .map(ParsedSignature::Authenticator)
+                .ok_or(InauthenticMessage)
+        }
+        (VerifyingKey::Bls(_), SignatureData::Bls(sig_a, sig_b, sig_c)) => {
+            parse_bls(sig_a, sig_b, sig_c)
+                .map(ParsedSignature::Bls)
+                .ok_or(InauthenticMessage)
+        }
+        _ => Err(InauthenticMessage),
+    }
+}
+
+/// Crypto operation observed by the hook of [`set_hook`].
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Operation {
+    Sign,
+    /// One signature check, which counts once for an aggregated signature.
+    Verify,
+}
+
+thread_local! {
+    static HOOK: Cell<Option<fn(Operation)>> = Cell::new(None);
+}
+
+/// Call `hook` on every crypto operation performed by current thread, e.g. to
+/// account its cost in a simulation. `None` to remove.
+pub fn set_hook(hook: Option<fn(Operation)>) {
+    HOOK.with(|current| current.set(hook));
+}
+
+fn observe(operation: Operation) {
+    if let Some(hook) = HOOK.with(Cell::get) {
+        hook(operation);
+    }
+}
+
+fn verify_signature(
+    inner: &[u8],
+    key: &VerifyingKey,
+    signature: &ParsedSignature,
+    secp: &Secp256k1<secp256k1::All>,
+) -> bool {
+    observe(Operation::Verify);
+    match (key, signature) {
+        (VerifyingKey::K256(key), ParsedSignature::K256(signature)) => {
+            key.verify(inner, signature).is_ok()
+        }
+        (VerifyingKey::Secp256k1(key), ParsedSignature::Secp256k1(signature)) => {
+            let message = Message::from_slice(&*Sha256::digest(inner)).unwrap();
+            secp.verify_ecdsa(&message, signature, key).is_ok()
+        }
+        (VerifyingKey::Authenticator { key, .. }, ParsedSignature::Authenticator(mac)) => {
+            authenticate(key, inner) == *mac
+        }
+        (VerifyingKey::Bls(key), ParsedSignature::Bls(signature)) => {
+            signature.verify(true, inner, BLS_DST, &[], key, false) == BLST_ERROR::BLST_SUCCESS
+        }
+        _ => unreachable!(),
+    }
+}
+
+// 64 random bits per signature, as suggested by blst, so a forged signature
+// passes a batch with probability 2^-64
+fn verify_bls_batch(batch: &[(&[u8], &bls::PublicKey, &bls::Signature)]) -> bool {
+    for _ in batch {
+        observe(Operation::Verify);
+    }
+    let mut rng = thread_rng();
+    let rand_list: Vec<_> = batch
+        .iter()
+        .map(|_| {
+            let mut scalar = blst_scalar::default();
+            scalar.b[..8].copy_from_slice(&rng.gen::<u64>().to_le_bytes());
+            scalar
+        })
+        .collect();
+    let message_list: Vec<_> = batch.iter().map(|(message, _, _)| *message).collect();
+    let key_list: Vec<_> = batch.iter().map(|(_, key, _)| *key).collect();
+    let signature_list: Vec<_> = batch.iter().map(|(_, _, signature)| *signature).collect();
+    bls::Signature::verify_multiple_aggregate_signatures(
+        &message_list,
+        BLS_DST,
+        &key_list,
+        false,
+        &signature_list,
+        true,
+        &rand_list,
+        64,
+    ) == BLST_ERROR::BLST_SUCCESS
+}
+
 thread_local! {
     pub static SECP: Secp256k1<secp256k1::All> = Secp256k1::new();
 }
@@ -112,7 +342,7 @@ impl<M> SignedMessage<M> {
     pub fn from_data(inner: Vec<u8>, signature: [u8; 64]) -> Self {
         Self {
             inner,
-            signature: (
+            signature: SignatureData::Ecdsa(
                 signature[..32].try_into().unwrap(),
                 signature[32..].try_into().unwrap(),
             ),
@@ -124,6 +354,7 @@ impl<M> SignedMessage<M> {
     where
         M: Serialize,
     {
+        observe(Operation::Sign);
         let inner = bincode::DefaultOptions::new().serialize(&message).unwrap();
         match key {
             SigningKey::K256(key) => {
@@ -137,6 +368,21 @@ impl<M> SignedMessage<M> {
                     SECP.with(|secp| secp.sign_ecdsa(&message, key).serialize_compact());
                 Self::from_data(inner, signature)
             }
+            SigningKey::Authenticator(key_list) => Self {
+                signature: SignatureData::Authenticator(
+                    key_list
+                        .iter()
+                        .map(|key| authenticate(key, &inner))
+                        .collect(),
+                ),
+                inner,
+                _marker: PhantomData,
+            },
+            SigningKey::Bls(key) => Self {
+                signature: SignatureData::bls(&key.sign(&inner, BLS_DST, &[])),
+                inner,
+                _marker: PhantomData,
+            },
         }
     }
 
@@ -144,38 +390,165 @@ impl<M> SignedMessage<M> {
     where
         M: DeserializeOwned,
     {
-        let (sig_a, sig_b) = self.signature;
-        let verified = match key {
-            VerifyingKey::K256(key) => {
-                let signature: Signature =
-                    if let Ok(signature) = [sig_a, sig_b].concat()[..].try_into() {
-                        signature
-                    } else {
-                        return Err(InauthenticMessage);
-                    };
-                key.verify(&self.inner, &signature).is_ok()
+        let signature = parse_signature(&self.signature, key)?;
+        if SECP.with(|secp| verify_signature(&self.inner, key, &signature, secp)) {
+            self.into_verified()
+        } else {
+            Err(InauthenticMessage)
+        }
+    }
+
+    /// Verify a group of messages, e.g. a quorum certification, which is
+    /// authentic only if every message in it is authentic.
+    ///
+    /// When the whole group is BLS signed, signatures are checked together
+    /// with random linear combination, which shares one final exponentiation
+    /// among all pairings, and costs about half of verifying one by one.
+    ///
+    /// ECDSA has no real batch verification, so the group is verified one by
+    /// one, and the saving is only on the surrounding work: all signatures are
+    /// parsed before any curve operation so a malformed group is rejected
+    /// cheaply, and no message is deserialized before all signatures pass.
+    pub fn verify_batch<'a>(
+        batch: impl IntoIterator<Item = (Self, &'a VerifyingKey)>,
+    ) -> Result<Vec<VerifiedMessage<M>>, InauthenticMessage>
+    where
+        M: DeserializeOwned,
+    {
+        let batch: Vec<_> = batch.into_iter().collect();
+        let signature_list = batch
+            .iter()
+            .map(|(message, key)| parse_signature(&message.signature, key))
+            .collect::<Result<Vec<_>, _>>()?;
+        let bls_list: Option<Vec<_>> = batch
+            .iter()
+            .zip(&signature_list)
+            .map(|((message, key), signature)| match (key, signature) {
+                (VerifyingKey::Bls(key), ParsedSignature::Bls(signature)) => {
+                    Some((&*message.inner, key, signature))
+                }
+                _ => None,
+            })
+            .collect();
+        let verified = match bls_list {
+            Some(bls_list) if bls_list.len() > 1 => verify_bls_batch(&bls_list),
+            _ => SECP.with(|secp| {
+                batch
+                    .iter()
+                    .zip(&signature_list)
+                    .all(|((message, key), signature)| {
+                        verify_signature(&message.inner, key, signature, secp)
+                    })
+            }),
+        };
+        if !verified {
+            return Err(InauthenticMessage);
+        }
+        batch
+            .into_iter()
+            .map(|(message, _)| message.into_verified())
+            .collect()
+    }
+
+    fn into_verified(self) -> Result<VerifiedMessage<M>, InauthenticMessage>
+    where
+        M: DeserializeOwned,
+    {
+        if let Ok(message) = bincode::DefaultOptions::new().deserialize(&self.inner) {
+            Ok(VerifiedMessage(message, self))
+        } else {
+            Err(InauthenticMessage)
+        }
+    }
+
+    // upgrade to VerifiedMessage as well?
+    pub fn assume_verified(&self) -> M
+    where
+        M: DeserializeOwned,
+    {
+        bincode::DefaultOptions::new()
+            .deserialize(&self.inner)
+            .unwrap()
+    }
+}
+
+/// Signatures of multiple signers on identical message, aggregated into one.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct AggregatedMessage<M> {
+    inner: Vec<u8>,
+    signature: SignatureData,
+    _marker: PhantomData<M>,
+}
+
+impl<M> AggregatedMessage<M> {
+    /// Aggregate signed messages. Return `None` if they are not all BLS
+    /// signed, or have different content.
+    ///
+    /// Signatures are not checked here, which suppose to be done when the
+    /// signed messages are received.
+    pub fn aggregate<'a>(
+        message_list: impl IntoIterator<Item = &'a SignedMessage<M>>,
+    ) -> Option<Self>
+    where
+        M: 'a,
+    {
+        let mut message_list = message_list.into_iter().peekable();
+        let inner = message_list.peek()?.inner.clone();
+        let mut signature_list = Vec::new();
+        for message in message_list {
+            if message.inner != inner {
+                return None;
             }
-            VerifyingKey::Secp256k1(key) => {
-                let signature = if let Ok(signature) =
-                    secp256k1::ecdsa::Signature::from_compact(&[sig_a, sig_b].concat())
-                {
-                    signature
-                } else {
-                    return Err(InauthenticMessage);
-                };
-                let message = Message::from_slice(&*Sha256::digest(&*self.inner)).unwrap();
-                SECP.with(|secp| secp.verify_ecdsa(&message, &signature, key).is_ok())
+            if let SignatureData::Bls(sig_a, sig_b, sig_c) = &message.signature {
+                signature_list.push(parse_bls(sig_a, sig_b, sig_c)?);
+            } else {
+                return None;
             }
+        }
+        let signature =
+            bls::AggregateSignature::aggregate(&signature_list.iter().collect::<Vec<_>>(), false)
+                .ok()?
+                .to_signature();
+        Some(Self {
+            inner,
+            signature: SignatureData::bls(&signature),
+            _marker: PhantomData,
+        })
+    }
+
+    /// Verify against the keys of all signers, in any order.
+    pub fn verify<'a>(
+        &self,
+        key_list: impl IntoIterator<Item = &'a VerifyingKey>,
+    ) -> Result<M, InauthenticMessage>
+    where
+        M: DeserializeOwned,
+    {
+        let key_list = key_list
+            .into_iter()
+            .map(|key| match key {
+                VerifyingKey::Bls(key) => Ok(key),
+                _ => Err(InauthenticMessage),
+            })
+            .collect::<Result<Vec<_>, _>>()?;
+        let signature = if let SignatureData::Bls(sig_a, sig_b, sig_c) = &self.signature {
+            parse_bls(sig_a, sig_b, sig_c).ok_or(InauthenticMessage)?
+        } else {
+            return Err(InauthenticMessage);
         };
-        if verified {
-            if let Ok(message) = bincode::DefaultOptions::new().deserialize(&self.inner) {
-                return Ok(VerifiedMessage(message, self));
-            }
+        // one pairing check regardless of the number of signers
+        observe(Operation::Verify);
+        if key_list.is_empty()
+            || signature.fast_aggregate_verify(true, &self.inner, BLS_DST, &key_list)
+                != BLST_ERROR::BLST_SUCCESS
+        {
+            return Err(InauthenticMessage);
         }
-        Err(InauthenticMessage)
+        bincode::DefaultOptions::new()
+            .deserialize(&self.inner)
+            .map_err(|_| InauthenticMessage)
     }
 
-    // upgrade to VerifiedMessage as well?
     pub fn assume_verified(&self) -> M
     where
         M: DeserializeOwned,
@@ -186,8 +559,168 @@ impl<M> SignedMessage<M> {
     }
 }
 
+/// Borrowed counterpart of `SignedMessage`, which has identical serialized
+/// form but points into receiving buffer instead of owning a copy of message.
+///
+/// Deserializing a `SignedMessage` copies message out of buffer, and verifying
+/// deserializes message again from the copy. A view is checked against buffer
+/// directly, and message is deserialized only once. The owned
+/// `SignedMessage` is only constructed after verification passed, since
+/// protocols keep it for certification.
+#[derive(Debug, Serialize, Deserialize)]
+pub struct SignedView<'a, M> {
+    inner: &'a [u8],
+    signature: SignatureData,
+    _marker: PhantomData<M>,
+}
+
+impl<'a, M> SignedView<'a, M> {
+    pub fn verify(self, key: &VerifyingKey) -> Result<VerifiedMessage<M>, InauthenticMessage>
+    where
+        M: DeserializeOwned,
+    {
+        let signature = parse_signature(&self.signature, key)?;
+        if !SECP.with(|secp| verify_signature(self.inner, key, &signature, secp)) {
+            return Err(InauthenticMessage);
+        }
+        if let Ok(message) = bincode::DefaultOptions::new().deserialize(self.inner) {
+            Ok(VerifiedMessage(
+                message,
+                SignedMessage {
+                    inner: self.inner.to_vec(),
+                    signature: self.signature,
+                    _marker: PhantomData,
+                },
+            ))
+        } else {
+            Err(InauthenticMessage)
+        }
+    }
+}
+
 impl<M> VerifiedMessage<M> {
     pub fn signed_message(&self) -> &SignedMessage<M> {
         &self.1
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn verify_batch() {
+        let key_list: Vec<_> = (1..=4)
+            .map(|i| SigningKey::K256(k256::ecdsa::SigningKey::from_bytes(&[i; 32]).unwrap()))
+            .collect();
+        let verifying_key: Vec<_> = key_list.iter().map(SigningKey::verifying_key).collect();
+        let batch: Vec<_> = key_list
+            .iter()
+            .enumerate()
+            .map(|(i, key)| SignedMessage::sign(i as u32, key))
+            .collect();
+
+        let verified =
+            SignedMessage::verify_batch(batch.iter().cloned().zip(&verifying_key)).unwrap();
+        assert_eq!(
+            verified.iter().map(|m| **m).collect::<Vec<_>>(),
+            [0, 1, 2, 3]
+        );
+        // one mismatched key fails the whole batch
+        assert!(
+            SignedMessage::verify_batch(batch.into_iter().zip(verifying_key.iter().rev())).is_err()
+        );
+
+        // BLS batch goes through multi-pairing
+        let key_list: Vec<_> = key_list.into_iter().map(SigningKey::use_bls).collect();
+        let verifying_key: Vec<_> = key_list.iter().map(SigningKey::verifying_key).collect();
+        let batch: Vec<_> = key_list
+            .iter()
+            .enumerate()
+            .map(|(i, key)| SignedMessage::sign(i as u32, key))
+            .collect();
+        let verified =
+            SignedMessage::verify_batch(batch.iter().cloned().zip(&verifying_key)).unwrap();
+        assert_eq!(
+            verified.iter().map(|m| **m).collect::<Vec<_>>(),
+            [0, 1, 2, 3]
+        );
+        assert!(
+            SignedMessage::verify_batch(batch.into_iter().zip(verifying_key.iter().rev())).is_err()
+        );
+    }
+
+    #[test]
+    fn authenticator() {
+        let key_list: Vec<_> = (1..=4)
+            .map(|i| SigningKey::K256(k256::ecdsa::SigningKey::from_bytes(&[i; 32]).unwrap()))
+            .collect();
+        let verifying_key: Vec<_> = key_list.iter().map(SigningKey::verifying_key).collect();
+        let authenticator = SigningKey::Authenticator(
+            verifying_key
+                .iter()
+                .map(|remote| key_list[0].shared_key(remote))
+                .collect(),
+        );
+        let message = SignedMessage::sign(42u32, &authenticator);
+        for j in 0..4 {
+            let key = VerifyingKey::Authenticator {
+                key: key_list[j].shared_key(&verifying_key[0]),
+                index: j,
+            };
+            assert_eq!(*message.clone().verify(&key).unwrap(), 42);
+        }
+        // wrong index
+        let key = VerifyingKey::Authenticator {
+            key: key_list[1].shared_key(&verifying_key[0]),
+            index: 2,
+        };
+        assert!(message.clone().verify(&key).is_err());
+        // ECDSA verifying key never accepts authenticator
+        assert!(message.verify(&verifying_key[0]).is_err());
+    }
+
+    #[test]
+    fn signed_view() {
+        let key = SigningKey::K256(k256::ecdsa::SigningKey::from_bytes(&[1; 32]).unwrap());
+        let buffer = bincode::DefaultOptions::new()
+            .serialize(&(SignedMessage::sign(42u32, &key), 43u32))
+            .unwrap();
+        let (view, remain): (SignedView<u32>, _) =
+            crate::common::deserialize_view(&buffer).unwrap();
+        let verified = view.verify(&key.verifying_key()).unwrap();
+        assert_eq!(*verified, 42);
+        assert_eq!(crate::common::deserialize::<u32>(remain).unwrap(), 43);
+    }
+
+    #[test]
+    fn aggregate() {
+        let key_list: Vec<_> = (1..=4)
+            .map(|i| {
+                SigningKey::K256(k256::ecdsa::SigningKey::from_bytes(&[i; 32]).unwrap()).use_bls()
+            })
+            .collect();
+        let verifying_key: Vec<_> = key_list.iter().map(SigningKey::verifying_key).collect();
+        let message_list: Vec<_> = key_list
+            .iter()
+            .map(|key| SignedMessage::sign(42u32, key))
+            .collect();
+        // individual BLS signature works as usual
+        assert_eq!(
+            *message_list[0].clone().verify(&verifying_key[0]).unwrap(),
+            42
+        );
+
+        let aggregated = AggregatedMessage::aggregate(&message_list[..3]).unwrap();
+        assert_eq!(
+            aggregated.verify(verifying_key[..3].iter().rev()).unwrap(),
+            42
+        );
+        assert!(aggregated.verify(&verifying_key[1..]).is_err());
+        assert!(aggregated.verify(&verifying_key[..2]).is_err());
+
+        // content mismatch
+        let other = SignedMessage::sign(43u32, &key_list[3]);
+        assert!(AggregatedMessage::aggregate([&message_list[0], &other]).is_none());
+    }
+}
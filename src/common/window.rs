@@ -0,0 +1,175 @@
+//! Op number keyed tables.
+//!
+//! Protocols keep several per-op tables (reorder buffers, quorum sets) whose
+//! keys are dense inside a small window above the latest garbage collected op
+//! number. [`Window`] stores them in a ring buffer indexed by offset from the
+//! window base, so a lookup is a subtraction and a bound check instead of a
+//! hash, and [`ReplicaSet`] is a fixed size bitmap for quorum counting.
+
+use std::collections::VecDeque;
+
+use super::{OpNumber, ReplicaId};
+
+#[derive(Debug, Clone)]
+pub struct Window<T> {
+    base: OpNumber,
+    limit: usize,
+    slot_list: VecDeque<Option<T>>,
+}
+
+impl<T> Window<T> {
+    /// Create an empty window that accepts op number in
+    /// `base..base + limit`.
+    pub fn new(base: OpNumber, limit: usize) -> Self {
+        Self {
+            base,
+            limit,
+            slot_list: VecDeque::new(),
+        }
+    }
+
+    /// The lowest op number accepted by window.
+    pub fn base(&self) -> OpNumber {
+        self.base
+    }
+
+    fn index(&self, op_number: OpNumber) -> Option<usize> {
+        if op_number < self.base {
+            return None;
+        }
+        let index = (op_number - self.base) as usize;
+        if index < self.limit {
+            Some(index)
+        } else {
+            None
+        }
+    }
+
+    pub fn get(&self, op_number: OpNumber) -> Option<&T> {
+        self.slot_list.get(self.index(op_number)?)?.as_ref()
+    }
+
+    pub fn get_mut(&mut self, op_number: OpNumber) -> Option<&mut T> {
+        let index = self.index(op_number)?;
+        self.slot_list.get_mut(index)?.as_mut()
+    }
+
+    /// Get value of op number, insert `f()` first if the slot is empty.
+    /// Return `None` if op number is out of window.
+    pub fn get_or_insert_with(
+        &mut self,
+        op_number: OpNumber,
+        f: impl FnOnce() -> T,
+    ) -> Option<&mut T> {
+        let index = self.index(op_number)?;
+        if index >= self.slot_list.len() {
+            self.slot_list.resize_with(index + 1, || None);
+        }
+        Some(self.slot_list[index].get_or_insert_with(f))
+    }
+
+    /// Insert value of op number, replacing the previous one. Return `false`
+    /// and drop value if op number is out of window.
+    pub fn insert(&mut self, op_number: OpNumber, value: T) -> bool {
+        let index = if let Some(index) = self.index(op_number) {
+            index
+        } else {
+            return false;
+        };
+        if index >= self.slot_list.len() {
+            self.slot_list.resize_with(index + 1, || None);
+        }
+        self.slot_list[index] = Some(value);
+        true
+    }
+
+    pub fn remove(&mut self, op_number: OpNumber) -> Option<T> {
+        let index = self.index(op_number)?;
+        self.slot_list.get_mut(index)?.take()
+    }
+
+    /// Move window base forward to `base`, dropping everything below it.
+    pub fn advance(&mut self, base: OpNumber) {
+        if base <= self.base {
+            return;
+        }
+        let n_drop = ((base - self.base) as usize).min(self.slot_list.len());
+        self.slot_list.drain(..n_drop);
+        self.base = base;
+    }
+}
+
+/// Set of replica ids backed by a bitmap. Replica id is `i8`, so 128 bits
+/// cover every possible non-negative id.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct ReplicaSet(u128);
+
+impl ReplicaSet {
+    fn mask(replica_id: ReplicaId) -> u128 {
+        assert!(replica_id >= 0);
+        1 << replica_id as u32
+    }
+
+    /// Return whether the replica is newly inserted.
+    pub fn insert(&mut self, replica_id: ReplicaId) -> bool {
+        let mask = Self::mask(replica_id);
+        let inserted = self.0 & mask == 0;
+        self.0 |= mask;
+        inserted
+    }
+
+    pub fn contains(&self, replica_id: ReplicaId) -> bool {
+        self.0 & Self::mask(replica_id) != 0
+    }
+
+    pub fn len(&self) -> usize {
+        self.0.count_ones() as usize
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.0 == 0
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn window() {
+        let mut window = Window::new(1, 4);
+        assert!(window.insert(2, "two"));
+        assert!(!window.insert(5, "five"));
+        assert!(!window.insert(0, "zero"));
+        assert_eq!(window.get(1), None);
+        assert_eq!(window.get(2), Some(&"two"));
+        *window.get_or_insert_with(3, || "three").unwrap() = "three!";
+        assert_eq!(window.get(3), Some(&"three!"));
+
+        window.advance(3);
+        assert_eq!(window.base(), 3);
+        assert_eq!(window.get(2), None);
+        assert_eq!(window.get(3), Some(&"three!"));
+        assert!(window.insert(6, "six"));
+        assert_eq!(window.remove(3), Some("three!"));
+        assert_eq!(window.remove(3), None);
+
+        // advance beyond all slots
+        window.advance(10);
+        assert_eq!(window.get(6), None);
+        assert!(window.insert(10, "ten"));
+        assert_eq!(window.get(10), Some(&"ten"));
+    }
+
+    #[test]
+    fn replica_set() {
+        let mut set = ReplicaSet::default();
+        assert!(set.is_empty());
+        assert!(set.insert(0));
+        assert!(set.insert(127));
+        assert!(!set.insert(0));
+        assert!(set.contains(127));
+        assert!(!set.contains(1));
+        assert_eq!(set.len(), 2);
+    }
+}
@@ -1,5 +1,6 @@
 #include <rte_mbuf.h>
 #include <rte_ethdev.h>
+#include <rte_flow.h>
 
 uint8_t *mbuf_get_data(struct rte_mbuf *mbuf)
 {
@@ -40,6 +41,21 @@ void oskr_pktmbuf_free(struct rte_mbuf *m)
     rte_pktmbuf_free(m);
 }
 
+struct rte_mbuf *oskr_pktmbuf_clone(struct rte_mbuf *md, struct rte_mempool *mp)
+{
+    return rte_pktmbuf_clone(md, mp);
+}
+
+int oskr_pktmbuf_chain(struct rte_mbuf *head, struct rte_mbuf *tail)
+{
+    return rte_pktmbuf_chain(head, tail);
+}
+
+char *oskr_pktmbuf_adj(struct rte_mbuf *m, uint16_t len)
+{
+    return rte_pktmbuf_adj(m, len);
+}
+
 uint16_t oskr_mbuf_default_buf_size()
 {
     return RTE_MBUF_DEFAULT_BUF_SIZE;
@@ -50,7 +66,67 @@ unsigned oskr_lcore_id()
     return rte_lcore_id();
 }
 
-int setup_port(uint16_t port_id, uint16_t n_rx, uint16_t n_tx, struct rte_mempool *pktmpool)
+// steer packets into rx queues by one byte of address header, selected by
+// `steering_offset`, i.e. destination id (14) or source id (15)
+// only lower 7 bits are matched, the highest bit is extension flag
+// 128 rules in total, each one matches a value and maps it to one queue
+static int setup_rx_flow(uint16_t port_id, uint16_t n_rx, uint16_t steering_offset)
+{
+    struct rte_flow_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.ingress = 1;
+
+    struct rte_flow_item_eth eth_spec, eth_mask;
+    memset(&eth_spec, 0, sizeof(eth_spec));
+    memset(&eth_mask, 0, sizeof(eth_mask));
+    eth_spec.type = RTE_BE16(0x88d5);
+    eth_mask.type = RTE_BE16(0xffff);
+
+    for (int i = 0; i < 128; i += 1)
+    {
+        uint8_t raw_pattern = i, raw_pattern_mask = 0x7f;
+        struct rte_flow_item_raw raw_spec, raw_mask = rte_flow_item_raw_mask;
+        memset(&raw_spec, 0, sizeof(raw_spec));
+        raw_spec.offset = steering_offset; // relative to packet start
+        raw_spec.length = 1;
+        raw_spec.pattern = &raw_pattern;
+        raw_mask.pattern = &raw_pattern_mask;
+
+        struct rte_flow_item pattern[] = {
+            {.type = RTE_FLOW_ITEM_TYPE_ETH, .spec = &eth_spec, .mask = &eth_mask},
+            {.type = RTE_FLOW_ITEM_TYPE_RAW, .spec = &raw_spec, .mask = &raw_mask},
+            {.type = RTE_FLOW_ITEM_TYPE_END},
+        };
+        struct rte_flow_action_queue queue = {.index = i % n_rx};
+        struct rte_flow_action action[] = {
+            {.type = RTE_FLOW_ACTION_TYPE_QUEUE, .conf = &queue},
+            {.type = RTE_FLOW_ACTION_TYPE_END},
+        };
+
+        struct rte_flow_error error;
+        if (rte_flow_validate(port_id, &attr, pattern, action, &error) != 0 ||
+            rte_flow_create(port_id, &attr, pattern, action, &error) == NULL)
+        {
+            printf("setup_port: flow rule not installed: %s\n",
+                   error.message ? error.message : "(no message)");
+            rte_flow_flush(port_id, &error);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int oskr_eth_tx_multi_seg(uint16_t port_id)
+{
+    struct rte_eth_conf conf;
+    if (rte_eth_dev_conf_get(port_id, &conf) != 0)
+        return 0;
+    return (conf.txmode.offloads & RTE_ETH_TX_OFFLOAD_MULTI_SEGS) != 0;
+}
+
+int setup_port(
+    uint16_t port_id, uint16_t n_rx, uint16_t n_tx, struct rte_mempool *pktmpool,
+    uint16_t steering_offset)
 {
     struct rte_eth_conf port_conf;
     memset(&port_conf, 0, sizeof(port_conf));
@@ -59,7 +135,24 @@ int setup_port(uint16_t port_id, uint16_t n_rx, uint16_t n_tx, struct rte_mempoo
     if (rte_eth_dev_info_get(port_id, &dev_info) != 0)
         return -1;
 
-    if (dev_info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE)
+    // fallback in case flow rules are not supported, some NICs can hash on
+    // layer 2 payload so packets are at least spread across queues
+    uint64_t rss_hf = RTE_ETH_RSS_L2_PAYLOAD & dev_info.flow_type_rss_offloads;
+    if (n_rx > 1 && rss_hf)
+    {
+        port_conf.rxmode.mq_mode = RTE_ETH_MQ_RX_RSS;
+        port_conf.rx_adv_conf.rss_conf.rss_hf = rss_hf;
+    }
+
+    // multi-segment enables zero copy broadcast, which sends one shared
+    // payload through indirect mbufs, and that conflicts with fast free
+    // (which requires reference count of every mbuf to be 1)
+    if (dev_info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_MULTI_SEGS)
+    {
+        port_conf.txmode.offloads |= RTE_ETH_TX_OFFLOAD_MULTI_SEGS;
+        printf("setup_port: tx multi-segment\n");
+    }
+    else if (dev_info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE)
         port_conf.txmode.offloads |= RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE;
     if (dev_info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_MT_LOCKFREE)
         printf("setup_port: tx multithread lockfree\n");
@@ -97,6 +190,11 @@ int setup_port(uint16_t port_id, uint16_t n_rx, uint16_t n_tx, struct rte_mempoo
     if (rte_eth_promiscuous_enable(port_id) != 0)
         return -1;
 
-    // add flow rules when necessary
+    if (n_rx > 1 && setup_rx_flow(port_id, n_rx, steering_offset) != 0)
+    {
+        if (!rss_hf)
+            return -1;
+        printf("setup_port: fallback to rss on l2 payload\n");
+    }
     return 0;
 }
@@ -47,6 +47,7 @@ extern "C" {
     pub fn rte_eal_mp_wait_lcore();
     pub fn rte_socket_id() -> c_int;
     pub fn rte_lcore_index(lcore_id: c_int) -> c_int;
+    pub fn rte_lcore_count() -> c_uint;
     pub fn rte_pktmbuf_pool_create(
         name: NonNull<c_char>,
         n: c_uint,
@@ -55,6 +56,7 @@ extern "C" {
         data_room_size: u16,
         socket_id: c_int,
     ) -> *mut rte_mempool;
+    pub fn rte_mempool_in_use_count(mp: NonNull<rte_mempool>) -> c_uint;
     pub fn rte_eth_dev_socket_id(port_id: u16) -> c_int;
     pub fn rte_eth_macaddr_get(port_id: u16, mac_addr: NonNull<rte_ether_addr>) -> c_int;
 
@@ -68,6 +70,9 @@ extern "C" {
         count: c_uint,
     ) -> c_int;
     pub fn oskr_pktmbuf_free(m: NonNull<rte_mbuf>);
+    pub fn oskr_pktmbuf_clone(md: NonNull<rte_mbuf>, mp: NonNull<rte_mempool>) -> *mut rte_mbuf;
+    pub fn oskr_pktmbuf_chain(head: NonNull<rte_mbuf>, tail: NonNull<rte_mbuf>) -> c_int;
+    pub fn oskr_pktmbuf_adj(m: NonNull<rte_mbuf>, len: u16) -> *mut c_char;
     pub fn oskr_eth_rx_burst(
         port_id: u16,
         queue_id: u16,
@@ -91,8 +96,17 @@ extern "C" {
     fn mbuf_get_packet_length(mbuf: NonNull<rte_mbuf>) -> u16;
     fn mbuf_set_packet_length(mbuf: NonNull<rte_mbuf>, length: u16);
 
+    // whether tx multi-segment offload is enabled by `setup_port`
+    pub fn oskr_eth_tx_multi_seg(port_id: u16) -> c_int;
+
     // one interface to hide all setup detail
-    pub fn setup_port(port_id: u16, n_rx: u16, n_tx: u16, pktmpool: NonNull<rte_mempool>) -> c_int;
+    pub fn setup_port(
+        port_id: u16,
+        n_rx: u16,
+        n_tx: u16,
+        pktmpool: NonNull<rte_mempool>,
+        steering_offset: u16,
+    ) -> c_int;
 }
 
 pub struct RxBuffer {
@@ -5,7 +5,7 @@ use std::{
 use async_trait::async_trait;
 use futures::Future;
 
-use crate::common::{OpNumber, Opaque, SigningKey};
+use crate::common::{OpNumber, Opaque, RequestNumber, SigningKey};
 
 /// Asynchronized invoking interface.
 ///
@@ -31,6 +31,31 @@ pub trait Invoke {
     async fn invoke(&mut self, op: Opaque) -> Opaque;
 }
 
+/// Pipelined invoking interface, which allows multiple outstanding requests
+/// from one client address.
+///
+/// Every outstanding request is sent on its own lane, i.e. a client id
+/// generated on demand and reused after the request completes, so replica
+/// side per client state, which expects one request at a time, is not
+/// affected. Results are matched by request number.
+///
+/// Replies are consumed by `complete` only, so do not `invoke` on the same
+/// client while there is outstanding pipelined request, or their replies get
+/// dropped.
+///
+/// Zyzzyva client does not implement it. Its speculative responses,
+/// commit certificate and local commits are collected for the one request in
+/// flight, and moving them into per lane state is left out for now.
+#[async_trait]
+pub trait Pipeline {
+    /// Send `op` without waiting for result. Return the request number which
+    /// is paired with result by `complete` later.
+    fn submit(&mut self, op: Opaque) -> RequestNumber;
+    /// Wait until any outstanding request completes. Pending forever if
+    /// nothing was submitted.
+    async fn complete(&mut self) -> (RequestNumber, Opaque);
+}
+
 /// State machine application which may support speculative execution and
 /// rollback.
 ///
@@ -51,7 +76,10 @@ pub trait App {
     ///
     /// It is unspecified whether protocol allows to reuse op number after
     /// rollback, but I think they do not.
-    fn execute(&mut self, op_number: OpNumber, op: Opaque) -> Opaque;
+    ///
+    /// The op is borrowed from protocol's log, so app should only copy the
+    /// part it keeps.
+    fn execute(&mut self, op_number: OpNumber, op: &[u8]) -> Opaque;
     fn rollback(
         &mut self,
         current: OpNumber,
@@ -61,6 +89,9 @@ pub trait App {
         unimplemented!()
     }
     fn commit(&mut self, op_number: OpNumber) {}
+    /// Protocol finished executing a batch of ops. App that make writes
+    /// durable in groups, e.g. one transaction per batch, does it here.
+    fn flush(&mut self) {}
 }
 
 /// Abstraction for async ecosystem.
@@ -115,7 +146,7 @@ where
     Self: 'static,
 {
     type Address: Clone + Eq + Send + Sync;
-    type RxBuffer: AsRef<[u8]> + Send;
+    type RxBuffer: AsRef<[u8]> + Send + 'static;
     // TxAgent has to be Sync for now, because it may show up in stage's shared
     // state and be accessed concurrently from multiple threads
     // this may be bad for two reason: it was designed as Send + !Sync in mind
@@ -123,19 +154,25 @@ where
     // which promise there is at most one TxAgent instance per thread, then it
     // may cache worker id and become !Sync for real
     // (or maybe just put it into thread local data?)
+    // dpdk transport ends up with the thread local approach: when configured
+    // with one tx queue per lcore, worker caches its queue in thread local and
+    // the TxAgent instance itself stays shareable
     type TxAgent: TxAgent<Transport = Self> + Clone + Send + Sync;
 
     fn tx_agent(&self) -> Self::TxAgent;
 
+    // rx agent has to be Sync, because one receiver may get packets from more
+    // than one rx thread, e.g. multiple rx queues of dpdk transport
+    // this is fine since rx agent should be lightweight and only dispatch
     fn register(
         &mut self,
         receiver: &impl Receiver<Self>,
-        rx_agent: impl Fn(Self::Address, Self::RxBuffer) + 'static + Send,
+        rx_agent: impl Fn(Self::Address, Self::RxBuffer) + 'static + Send + Sync,
     ) where
         Self: Sized;
     fn register_multicast(
         &mut self,
-        rx_agent: impl Fn(Self::Address, Self::RxBuffer) + 'static + Send,
+        rx_agent: impl Fn(Self::Address, Self::RxBuffer) + 'static + Send + Sync,
     );
 
     fn ephemeral_address(&self) -> Self::Address;
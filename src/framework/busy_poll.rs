@@ -1,45 +1,139 @@
 use std::{
-    cell::RefCell,
+    cell::{Cell, RefCell},
     collections::HashMap,
     pin::Pin,
-    sync::atomic::{AtomicU32, Ordering},
-    task::{Context, Poll},
-    time::Instant,
+    sync::{
+        atomic::{AtomicBool, AtomicU32, Ordering},
+        Arc,
+    },
+    task::{Context, Poll, Waker},
+    thread::{self, Thread},
+    time::{Duration, Instant},
 };
 
-use futures::{channel::oneshot, future::BoxFuture, task::noop_waker_ref, Future};
+use crossbeam::queue::SegQueue;
+use futures::{
+    channel::oneshot,
+    future::BoxFuture,
+    task::{waker, ArcWake},
+    Future,
+};
 
-use crate::facade;
+use crate::{
+    facade,
+    framework::timer_wheel::{TimerKey, TimerWheel},
+};
 
+// the executor is still busy polling, but only tasks that are woken since last
+// pass are polled. wakers may be called from other threads, e.g. rx dispatch
+// sending into a client's channel, so ready task ids go through a lock free
+// queue owned by the thread which spawns the task
+//
+// a thread that has nothing else to do may park instead with `park_until`, to
+// not take a core from busy polling ones, so wakers also unpark the owner
 pub struct AsyncEcosystem;
+
+struct Task {
+    future: BoxFuture<'static, ()>,
+    waker: Waker,
+    notify: Arc<Notify>,
+}
+
+struct Notify {
+    id: u32,
+    // dedup wakes between two polls
+    scheduled: AtomicBool,
+    ready_queue: Arc<SegQueue<u32>>,
+    // of the executor, unparking it costs one atomic swap if not parked
+    thread: Thread,
+}
+
+impl ArcWake for Notify {
+    fn wake_by_ref(arc_self: &Arc<Self>) {
+        if !arc_self.scheduled.swap(true, Ordering::AcqRel) {
+            arc_self.ready_queue.push(arc_self.id);
+            arc_self.thread.unpark();
+        }
+    }
+}
+
 impl AsyncEcosystem {
     thread_local! {
-        static TASK_TABLE: RefCell<HashMap<u32, BoxFuture<'static, ()>>> = RefCell::new(HashMap::new());
+        static TASK_TABLE: RefCell<HashMap<u32, Task>> = RefCell::new(HashMap::new());
         static TASK_NUMBER: AtomicU32 = AtomicU32::new(0);
+        static READY_QUEUE: Arc<SegQueue<u32>> = Arc::new(SegQueue::new());
+        // task id of pending sleeps
+        static TIMER_WHEEL: RefCell<TimerWheel<u32>> =
+            RefCell::new(TimerWheel::new(Duration::from_micros(100)));
+        static CURRENT: Cell<Option<u32>> = Cell::new(None);
     }
 
     fn poll_once() {
-        let snapshot_list: Vec<_> =
-            Self::TASK_TABLE.with(|task_table| task_table.borrow().keys().cloned().collect());
-        for id in snapshot_list {
-            if let Some(mut task) =
+        Self::TIMER_WHEEL.with(|timer_wheel| {
+            let mut timer_wheel = timer_wheel.borrow_mut();
+            if !timer_wheel.is_empty() {
+                timer_wheel.advance(Instant::now(), Self::wake);
+            }
+        });
+
+        // only tasks ready at the beginning of this pass, the ones woken during
+        // polling are left to the next pass, same as the snapshot before
+        let ready_queue = Self::READY_QUEUE.with(Clone::clone);
+        for _ in 0..ready_queue.len() {
+            let id = ready_queue.pop().unwrap();
+            // cancelled or finished task may still have stale wakes
+            let mut task = if let Some(task) =
                 Self::TASK_TABLE.with(|task_table| task_table.borrow_mut().remove(&id))
             {
-                let poll = Pin::new(&mut task).poll(&mut Context::from_waker(noop_waker_ref()));
-                if poll.is_pending() {
-                    Self::TASK_TABLE
-                        .with(move |task_table| task_table.borrow_mut().insert(id, task));
-                }
+                task
+            } else {
+                continue;
+            };
+            task.notify.scheduled.store(false, Ordering::Release);
+            Self::CURRENT.with(|current| current.set(Some(id)));
+            let poll = task
+                .future
+                .as_mut()
+                .poll(&mut Context::from_waker(&task.waker));
+            Self::CURRENT.with(|current| current.set(None));
+            if poll.is_pending() {
+                Self::TASK_TABLE.with(move |task_table| task_table.borrow_mut().insert(id, task));
             }
         }
     }
 
+    fn wake(id: u32) {
+        let notify = Self::TASK_TABLE
+            .with(|task_table| task_table.borrow().get(&id).map(|task| task.notify.clone()));
+        if let Some(notify) = notify {
+            ArcWake::wake_by_ref(&notify);
+        }
+    }
+
     pub fn poll_until(predict: impl Fn() -> bool) {
         while !predict() {
             Self::poll_once();
         }
     }
 
+    /// Same as `poll_until`, but park the thread when no task is ready, until
+    /// a task is woken or the next timer expires. `predict` is checked at
+    /// least every `interval`.
+    pub fn park_until(predict: impl Fn() -> bool, interval: Duration) {
+        while !predict() {
+            Self::poll_once();
+            if Self::READY_QUEUE.with(|ready_queue| !ready_queue.is_empty()) {
+                continue;
+            }
+            let now = Instant::now();
+            let deadline = Self::TIMER_WHEEL
+                .with(|timer_wheel| timer_wheel.borrow().next_expiry())
+                .map(|expiry| expiry.min(now + interval))
+                .unwrap_or(now + interval);
+            thread::park_timeout(deadline.saturating_duration_since(now));
+        }
+    }
+
     pub fn poll_all() {
         while Self::TASK_TABLE.with(|task_list| task_list.borrow().len()) > 0 {
             Self::poll_once();
@@ -47,18 +141,48 @@ impl AsyncEcosystem {
     }
 
     fn cancel(id: u32) {
-        Self::TASK_TABLE.with(|task_table| task_table.borrow_mut().remove(&id));
+        // drop the task after releasing table, since it may own join handles,
+        // and tolerate dropping during thread local destruction
+        let task = Self::TASK_TABLE
+            .try_with(|task_table| task_table.borrow_mut().remove(&id))
+            .ok()
+            .flatten();
+        drop(task);
     }
 }
 
-pub struct Sleep(quanta::Instant);
+// std instant instead of quanta's, because clock is only read once per pass to
+// advance timer wheel
+pub struct Sleep(Instant, Option<TimerKey>);
 impl Future for Sleep {
     type Output = ();
-    fn poll(self: Pin<&mut Self>, _cx: &mut Context<'_>) -> Poll<Self::Output> {
-        if quanta::Instant::now() >= self.0 {
-            Poll::Ready(())
+    fn poll(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        let now = Instant::now();
+        if now >= self.0 {
+            return Poll::Ready(());
+        }
+        if let Some(id) = AsyncEcosystem::CURRENT.with(Cell::get) {
+            let deadline = self.0;
+            let key = &mut self.1;
+            AsyncEcosystem::TIMER_WHEEL.with(|timer_wheel| {
+                let mut timer_wheel = timer_wheel.borrow_mut();
+                // woken for other reason, or expired early at the end of wheel
+                if !key.map(|key| timer_wheel.contains(key)).unwrap_or(false) {
+                    *key = Some(timer_wheel.insert(now, deadline, id));
+                }
+            });
         } else {
-            Poll::Pending
+            // not polled by this executor, fallback to be polled again
+            cx.waker().wake_by_ref();
+        }
+        Poll::Pending
+    }
+}
+impl Drop for Sleep {
+    fn drop(&mut self) {
+        if let Some(key) = self.1 {
+            let _ = AsyncEcosystem::TIMER_WHEEL
+                .try_with(|timer_wheel| timer_wheel.borrow_mut().cancel(key));
         }
     }
 }
@@ -85,10 +209,22 @@ impl<T: Send + 'static> facade::AsyncEcosystem<T> for AsyncEcosystem {
         let id =
             Self::TASK_NUMBER.with(|task_number| task_number.fetch_add(1, Ordering::SeqCst)) + 1;
         let (tx, rx) = oneshot::channel();
-        let task =
+        let future =
             Box::pin(async move { tx.send(task.await).map_err(|_| unreachable!()).unwrap() });
 
+        let notify = Arc::new(Notify {
+            id,
+            scheduled: AtomicBool::new(false),
+            ready_queue: Self::READY_QUEUE.with(Clone::clone),
+            thread: thread::current(),
+        });
+        let task = Task {
+            future,
+            waker: waker(notify.clone()),
+            notify,
+        };
         Self::TASK_TABLE.with(|task_table| task_table.borrow_mut().insert(id, task));
+        Self::wake(id);
         JoinHandle(id, rx)
     }
 
@@ -97,10 +233,95 @@ impl<T: Send + 'static> facade::AsyncEcosystem<T> for AsyncEcosystem {
     }
 
     fn sleep_until(instant: Instant) -> Self::Sleep {
-        if Instant::now() >= instant {
-            return Sleep(quanta::Instant::now());
-        }
-        // so shit...
-        Sleep(quanta::Instant::now() + (instant - Instant::now()))
+        Sleep(instant, None)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::{
+        sync::{
+            atomic::{AtomicBool, Ordering},
+            Arc,
+        },
+        thread,
+        time::{Duration, Instant},
+    };
+
+    use futures::channel::oneshot;
+
+    use crate::facade::AsyncEcosystem as _;
+
+    use super::AsyncEcosystem;
+
+    #[test]
+    fn wake_from_other_thread() {
+        let (tx, rx) = oneshot::channel();
+        let done = Arc::new(AtomicBool::new(false));
+        let _task = AsyncEcosystem::spawn({
+            let done = done.clone();
+            async move {
+                assert_eq!(rx.await.unwrap(), 42);
+                done.store(true, Ordering::SeqCst);
+            }
+        });
+        let sender = thread::spawn(move || tx.send(42).unwrap());
+        AsyncEcosystem::poll_until(|| done.load(Ordering::SeqCst));
+        sender.join().unwrap();
+    }
+
+    #[test]
+    fn sleep() {
+        let start = Instant::now();
+        let done = Arc::new(AtomicBool::new(false));
+        let _task = AsyncEcosystem::spawn({
+            let done = done.clone();
+            async move {
+                <AsyncEcosystem as crate::facade::AsyncEcosystem<()>>::sleep_until(
+                    start + Duration::from_millis(10),
+                )
+                .await;
+                done.store(true, Ordering::SeqCst);
+            }
+        });
+        AsyncEcosystem::poll_until(|| done.load(Ordering::SeqCst));
+        assert!(Instant::now() >= start + Duration::from_millis(10));
+    }
+
+    #[test]
+    fn park() {
+        let (tx, rx) = oneshot::channel();
+        let start = Instant::now();
+        let done = Arc::new(AtomicBool::new(false));
+        let _task = AsyncEcosystem::spawn({
+            let done = done.clone();
+            async move {
+                <AsyncEcosystem as crate::facade::AsyncEcosystem<()>>::sleep_until(
+                    start + Duration::from_millis(10),
+                )
+                .await;
+                assert_eq!(rx.await.unwrap(), 42);
+                done.store(true, Ordering::SeqCst);
+            }
+        });
+        let sender = thread::spawn(move || {
+            thread::sleep(Duration::from_millis(20));
+            tx.send(42).unwrap()
+        });
+        // neither sleeping nor waking from other thread waits for interval
+        AsyncEcosystem::park_until(|| done.load(Ordering::SeqCst), Duration::from_secs(10));
+        assert!(Instant::now() < start + Duration::from_secs(1));
+        sender.join().unwrap();
+    }
+
+    #[test]
+    fn cancel() {
+        let (_tx, rx) = oneshot::channel::<()>();
+        let task = AsyncEcosystem::spawn(async move {
+            rx.await.unwrap();
+        });
+        drop(task);
+        // nothing left to poll
+        AsyncEcosystem::poll_all();
     }
 }
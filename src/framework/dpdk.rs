@@ -1,25 +1,30 @@
 use std::{
+    cell::RefCell,
     collections::HashMap,
     env,
     ffi::CString,
     mem::MaybeUninit,
     os::raw::{c_char, c_int, c_uint},
-    ptr::NonNull,
+    ptr::{null_mut, NonNull},
     sync::{
-        atomic::{AtomicU32, Ordering},
+        atomic::{AtomicU32, AtomicU64, Ordering},
         Arc,
     },
+    time::Duration,
 };
 
-use crossbeam::utils::Backoff;
+use crossbeam::utils::{Backoff, CachePadded};
+use quanta::Instant;
 use rand::random;
 
 use crate::{
     dpdk_shim::{
-        oskr_eth_rx_burst, oskr_eth_tx_burst, oskr_lcore_id, oskr_mbuf_default_buf_size,
-        oskr_pktmbuf_alloc, oskr_pktmbuf_alloc_bulk, rte_eal_init, rte_eth_dev_socket_id,
-        rte_eth_macaddr_get, rte_lcore_index, rte_mbuf, rte_mempool, rte_pktmbuf_pool_create,
-        rte_socket_id, setup_port, Address, RxBuffer,
+        oskr_eth_rx_burst, oskr_eth_tx_burst, oskr_eth_tx_multi_seg, oskr_lcore_id,
+        oskr_mbuf_default_buf_size, oskr_pktmbuf_adj, oskr_pktmbuf_alloc, oskr_pktmbuf_alloc_bulk,
+        oskr_pktmbuf_chain, oskr_pktmbuf_clone, oskr_pktmbuf_free, rte_eal_init,
+        rte_eth_dev_socket_id, rte_eth_macaddr_get, rte_lcore_count, rte_lcore_index, rte_mbuf,
+        rte_mempool, rte_mempool_in_use_count, rte_pktmbuf_pool_create, rte_socket_id, setup_port,
+        Address, RxBuffer,
     },
     facade::{self, Receiver},
 };
@@ -28,29 +33,154 @@ use crate::{
 pub struct TxAgent {
     mbuf_pool: NonNull<rte_mempool>,
     port_id: u16,
-    rr: Arc<RoundRobin>,
+    queue: TxQueue,
+    multi_seg: bool,
 }
 
-struct RoundRobin {
+#[derive(Clone)]
+enum TxQueue {
+    // there is at least one tx queue per lcore, and every lcore owns the queue
+    // with the same index as its lcore index, so no synchronization at all
+    // packets are buffered per lcore and sent in burst
+    PerLcore(Arc<BurstOccupancy>),
+    // less tx queue than lcore, take turns
+    Shared(Arc<RoundRobin>),
+}
+
+const TX_BURST: usize = 32;
+// below this length, copying payload for every destination is cheaper than
+// allocating additional indirect mbuf for it
+const ZERO_COPY_LENGTH: u16 = 512;
+// buffered packets are sent after waiting about this long at most, checked on
+// sending and after every stage task, and the rest is flushed when worker idles
+const TX_FLUSH_INTERVAL: Duration = Duration::from_micros(10);
+// number of tx bursts in a row that send nothing before giving up flushing,
+// e.g. the link is down, then the rest of buffered packets are dropped
+const TX_RETRY: usize = 1 << 16;
+
+struct TxBuffer {
+    port_id: u16,
+    queue_id: Option<u16>,
+    burst: Vec<NonNull<rte_mbuf>>,
+    start: Instant,
+    occupancy: Option<Arc<BurstOccupancy>>,
+}
+
+thread_local! {
+    static TX_BUFFER: RefCell<TxBuffer> = RefCell::new(TxBuffer {
+        port_id: 0,
+        queue_id: None,
+        burst: Vec::with_capacity(TX_BURST),
+        start: Instant::now(),
+        occupancy: None,
+    });
+}
+
+impl TxBuffer {
+    fn push(&mut self, port_id: u16, occupancy: &Arc<BurstOccupancy>, mbuf: NonNull<rte_mbuf>) {
+        if self.queue_id.is_none() {
+            let index = unsafe { rte_lcore_index(oskr_lcore_id() as c_int) };
+            // non-EAL thread has no queue to own
+            assert!(index >= 0, "per-lcore tx queue on non-EAL thread");
+            self.queue_id = Some(index as u16);
+            self.port_id = port_id;
+            self.occupancy = Some(occupancy.clone());
+        }
+
+        if self.burst.is_empty() {
+            self.start = Instant::now();
+        }
+        self.burst.push(mbuf);
+        if self.burst.len() == TX_BURST {
+            self.flush();
+        }
+    }
+
+    fn flush_expired(&mut self) {
+        if !self.burst.is_empty() && Instant::now() - self.start >= TX_FLUSH_INTERVAL {
+            self.flush();
+        }
+    }
+
+    fn flush(&mut self) {
+        if self.burst.is_empty() {
+            return;
+        }
+        let queue_id = self.queue_id.unwrap();
+        let mut sent = 0;
+        let mut retry = 0;
+        // the queue is owned, so just wait for NIC when it is full
+        while sent < self.burst.len() && retry < TX_RETRY {
+            let n = unsafe {
+                oskr_eth_tx_burst(
+                    self.port_id,
+                    queue_id,
+                    (&mut self.burst[sent]).into(),
+                    (self.burst.len() - sent) as u16,
+                )
+            } as usize;
+            retry = if n == 0 { retry + 1 } else { 0 };
+            sent += n;
+        }
+        let occupancy = self.occupancy.as_ref().unwrap();
+        occupancy.record(queue_id, self.burst.len());
+        if sent < self.burst.len() {
+            occupancy.record_drop(queue_id, self.burst.len() - sent);
+            for mbuf in &self.burst[sent..] {
+                unsafe { oskr_pktmbuf_free(*mbuf) };
+            }
+        }
+        self.burst.clear();
+    }
+}
+
+// burst size histogram per tx queue, followed by the number of packets that
+// are given up, each one only written by its owner lcore
+struct BurstOccupancy(Box<[CachePadded<[AtomicU64; TX_BURST + 2]>]>);
+
+impl BurstOccupancy {
+    fn new(n: u16) -> Self {
+        Self(
+            (0..n)
+                .map(|_| CachePadded::new([(); TX_BURST + 2].map(|_| AtomicU64::new(0))))
+                .collect(),
+        )
+    }
+
+    fn record(&self, queue_id: u16, burst_size: usize) {
+        Self::add(&self.0[queue_id as usize][burst_size], 1);
+    }
+
+    fn record_drop(&self, queue_id: u16, n_packet: usize) {
+        Self::add(&self.0[queue_id as usize][TX_BURST + 1], n_packet as _);
+    }
+
+    fn add(counter: &AtomicU64, n: u64) {
+        // single writer, no read-modify-write necessary
+        counter.store(counter.load(Ordering::Relaxed) + n, Ordering::Relaxed);
+    }
+}
+
+/// Ticket lock over `n` shared tx queues. Queues are handed out in turn, and
+/// a queue is acquired again only after its previous holder releases it.
+///
+/// Public only for benchmarking.
+pub struct RoundRobin {
     sequence: AtomicU32,
-    counter: [AtomicU32; 32], // 32 tx queue should be maximum expectation right?
+    counter: Box<[AtomicU32]>,
     n: u32,
 }
 
 impl RoundRobin {
-    fn new(n: u32) -> Self {
+    pub fn new(n: u32) -> Self {
         Self {
             sequence: AtomicU32::new(0),
-            counter: (0..32)
-                .map(|_| AtomicU32::new(0))
-                .collect::<Vec<_>>()
-                .try_into()
-                .unwrap(),
+            counter: (0..n).map(|_| AtomicU32::new(0)).collect(),
             n,
         }
     }
 
-    fn acquire(&self) -> u32 {
+    pub fn acquire(&self) -> u32 {
         let sequence = self.sequence.fetch_add(1, Ordering::SeqCst);
         let (i, c) = (sequence % self.n, sequence / self.n);
         let backoff = Backoff::new();
@@ -60,11 +190,38 @@ impl RoundRobin {
         i
     }
 
-    fn release(&self, i: u32) {
+    pub fn release(&self, i: u32) {
         self.counter[i as usize].fetch_add(1, Ordering::SeqCst);
     }
 }
 
+impl TxAgent {
+    fn transmit(&self, mbuf_list: &mut [NonNull<rte_mbuf>]) {
+        match &self.queue {
+            TxQueue::PerLcore(occupancy) => TX_BUFFER.with(|buffer| {
+                let mut buffer = buffer.borrow_mut();
+                for mbuf in mbuf_list {
+                    buffer.push(self.port_id, occupancy, *mbuf);
+                }
+                buffer.flush_expired();
+            }),
+            TxQueue::Shared(rr) => {
+                let queue_id = rr.acquire();
+                let ret = unsafe {
+                    oskr_eth_tx_burst(
+                        self.port_id,
+                        queue_id as u16,
+                        mbuf_list.first_mut().unwrap().into(),
+                        mbuf_list.len() as u16,
+                    )
+                };
+                assert_eq!(ret, mbuf_list.len() as u16);
+                rr.release(queue_id);
+            }
+        }
+    }
+}
+
 unsafe impl Send for TxAgent {}
 unsafe impl Sync for TxAgent {}
 
@@ -77,19 +234,16 @@ impl facade::TxAgent for TxAgent {
         dest: &<Self::Transport as facade::Transport>::Address,
         message: impl FnOnce(&mut [u8]) -> u16,
     ) {
-        unsafe {
-            let mut mbuf = NonNull::new(oskr_pktmbuf_alloc(self.mbuf_pool)).unwrap();
+        let mbuf = unsafe {
+            let mbuf = NonNull::new(oskr_pktmbuf_alloc(self.mbuf_pool)).unwrap();
             let data = rte_mbuf::get_data(mbuf);
             rte_mbuf::set_source(data, source.get_address());
             rte_mbuf::set_dest(data, dest);
             let length = message(rte_mbuf::get_tx_buffer(data));
             rte_mbuf::set_buffer_length(mbuf, length);
-
-            let queue_id = self.rr.acquire();
-            let ret = oskr_eth_tx_burst(self.port_id, queue_id as u16, (&mut mbuf).into(), 1);
-            assert_eq!(ret, 1);
-            self.rr.release(queue_id);
-        }
+            mbuf
+        };
+        self.transmit(&mut [mbuf]);
     }
 
     fn send_message_to_all(
@@ -105,54 +259,63 @@ impl facade::TxAgent for TxAgent {
         if dest_list.is_empty() {
             return;
         }
-        assert!(dest_list.len() <= 32); // TODO
 
-        let mbuf_list = unsafe {
-            let mut mbuf_list: MaybeUninit<[*mut rte_mbuf; 32]> = MaybeUninit::uninit();
-            let ret = oskr_pktmbuf_alloc_bulk(
+        let mut mbuf_list = vec![null_mut(); dest_list.len()];
+        let ret = unsafe {
+            oskr_pktmbuf_alloc_bulk(
                 self.mbuf_pool,
-                NonNull::new(mbuf_list.as_mut_ptr() as *mut _).unwrap(),
-                dest_list.len() as c_uint,
-            );
-            assert_eq!(ret, 0);
-            &mbuf_list.assume_init()[..dest_list.len()]
+                NonNull::new(mbuf_list.as_mut_ptr()).unwrap(),
+                mbuf_list.len() as c_uint,
+            )
         };
+        assert_eq!(ret, 0);
+        let mut mbuf_list: Vec<_> = mbuf_list
+            .into_iter()
+            .map(|mbuf| NonNull::new(mbuf).unwrap())
+            .collect();
 
-        let sample_mbuf = NonNull::new(mbuf_list[0]).unwrap();
+        let sample_mbuf = mbuf_list[0];
         let sample_data = unsafe { rte_mbuf::get_data(sample_mbuf) };
         let length = message(unsafe { rte_mbuf::get_tx_buffer(sample_data) });
+        unsafe { rte_mbuf::set_source(sample_data, source.get_address()) };
 
-        let mut mbuf_list: Vec<_> = mbuf_list
-            .iter()
-            .zip(dest_list)
-            .enumerate()
-            .map(|(i, (mbuf, dest))| unsafe {
-                let (mbuf, data) = if i == 0 {
-                    rte_mbuf::set_source(sample_data, source.get_address());
-                    (sample_mbuf, sample_data)
-                } else {
-                    let mbuf = NonNull::new(*mbuf).unwrap();
-                    let data = rte_mbuf::get_data(mbuf);
-                    rte_mbuf::copy_data(sample_data, data, length);
-                    (mbuf, data)
-                };
-                rte_mbuf::set_dest(data, dest);
-                rte_mbuf::set_buffer_length(mbuf, length);
-                mbuf
-            })
-            .collect();
-
-        let queue_id = self.rr.acquire();
-        let ret = unsafe {
-            oskr_eth_tx_burst(
-                self.port_id,
-                queue_id as u16,
-                mbuf_list.first_mut().unwrap().into(),
-                mbuf_list.len() as u16,
-            )
-        };
-        assert_eq!(ret, mbuf_list.len() as u16);
-        self.rr.release(queue_id);
+        if self.multi_seg && mbuf_list.len() > 1 && length >= ZERO_COPY_LENGTH {
+            unsafe {
+                // sample mbuf becomes the payload shared by everyone, and
+                // every packet is a header mbuf chained with an indirect one
+                // that is attached to payload
+                rte_mbuf::set_buffer_length(sample_mbuf, length);
+                oskr_pktmbuf_adj(sample_mbuf, 17);
+                mbuf_list[0] = NonNull::new(oskr_pktmbuf_alloc(self.mbuf_pool)).unwrap();
+                for (mbuf, dest) in mbuf_list.iter().zip(dest_list) {
+                    let data = rte_mbuf::get_data(*mbuf);
+                    rte_mbuf::set_source(data, source.get_address());
+                    rte_mbuf::set_dest(data, dest);
+                    rte_mbuf::set_buffer_length(*mbuf, 0);
+                    let payload =
+                        NonNull::new(oskr_pktmbuf_clone(sample_mbuf, self.mbuf_pool)).unwrap();
+                    let ret = oskr_pktmbuf_chain(*mbuf, payload);
+                    assert_eq!(ret, 0);
+                }
+                // payload is released after the last indirect mbuf is sent
+                oskr_pktmbuf_free(sample_mbuf);
+            }
+        } else {
+            for (i, (mbuf, dest)) in mbuf_list.iter().zip(dest_list).enumerate() {
+                unsafe {
+                    let data = if i == 0 {
+                        sample_data
+                    } else {
+                        let data = rte_mbuf::get_data(*mbuf);
+                        rte_mbuf::copy_data(sample_data, data, length);
+                        data
+                    };
+                    rte_mbuf::set_dest(data, dest);
+                    rte_mbuf::set_buffer_length(*mbuf, length);
+                }
+            }
+        }
+        self.transmit(&mut mbuf_list);
     }
 }
 
@@ -161,13 +324,29 @@ pub struct Transport {
     port_id: u16,
     recv_table: RecvTable,
     multicast_address: Option<Address>,
-    multicast_recv: Box<dyn Fn(Address, RxBuffer) + Send>,
-    rr: Arc<RoundRobin>,
+    multicast_recv: Box<dyn Fn(Address, RxBuffer) + Send + Sync>,
+    tx_queue: TxQueue,
+    multi_seg: bool,
     drop_rate: f32,
+    // (received, dropped) packet number per rx queue, only written by the
+    // lcore polling that queue
+    rx_stat: Box<[CachePadded<[AtomicU64; 2]>]>,
 }
-type RecvTable = HashMap<Address, Box<dyn Fn(Address, RxBuffer) + Send>>;
+type RecvTable = HashMap<Address, Box<dyn Fn(Address, RxBuffer) + Send + Sync>>;
 
 unsafe impl Send for Transport {}
+// multiple rx queues are polled concurrently through shared reference, and
+// mbuf pool is thread safe
+unsafe impl Sync for Transport {}
+
+/// Which address id rx queue is selected by, when there are multiple rx
+/// queues. Steer by destination when there are many local receivers, e.g.
+/// clients, or by source when there is only one, e.g. replica.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum RxSteering {
+    Source,
+    Dest,
+}
 
 impl facade::Transport for Transport {
     type Address = Address;
@@ -178,14 +357,15 @@ impl facade::Transport for Transport {
         Self::TxAgent {
             mbuf_pool: self.mbuf_pool,
             port_id: self.port_id,
-            rr: self.rr.clone(),
+            queue: self.tx_queue.clone(),
+            multi_seg: self.multi_seg,
         }
     }
 
     fn register(
         &mut self,
         receiver: &impl Receiver<Self>,
-        rx_agent: impl Fn(Self::Address, Self::RxBuffer) + 'static + Send,
+        rx_agent: impl Fn(Self::Address, Self::RxBuffer) + 'static + Send + Sync,
     ) {
         if *receiver.get_address() == Self::null_address() {
             return;
@@ -207,7 +387,7 @@ impl facade::Transport for Transport {
 
     fn register_multicast(
         &mut self,
-        rx_agent: impl Fn(Self::Address, Self::RxBuffer) + 'static + Send,
+        rx_agent: impl Fn(Self::Address, Self::RxBuffer) + 'static + Send + Sync,
     ) {
         self.multicast_recv = Box::new(rx_agent);
     }
@@ -228,7 +408,13 @@ impl facade::Transport for Transport {
 }
 
 impl Transport {
-    pub fn setup(core_mask: u128, port_id: u16, n_rx: u16, n_tx: u16) -> Self {
+    pub fn setup(
+        core_mask: u128,
+        port_id: u16,
+        n_rx: u16,
+        n_tx: u16,
+        rx_steering: RxSteering,
+    ) -> Self {
         let args = [
             env::args().next().unwrap(),
             "-c".to_string(),
@@ -262,17 +448,35 @@ impl Transport {
             );
             let mbuf_pool = NonNull::new(pktmpool).unwrap();
 
-            let ret = setup_port(port_id, n_rx, n_tx, mbuf_pool);
+            // offset in header, see `rte_mbuf::set_dest` and `set_source`
+            let steering_offset = match rx_steering {
+                RxSteering::Dest => 14,
+                RxSteering::Source => 15,
+            };
+            let ret = setup_port(port_id, n_rx, n_tx, mbuf_pool, steering_offset);
             assert_eq!(ret, 0);
 
+            // main lcore sends as well, e.g. unreplicated replica replies in rx
+            // thread, so it counts
+            let tx_queue = if n_tx as u32 >= rte_lcore_count() {
+                println!("setup: per-lcore tx queue");
+                TxQueue::PerLcore(Arc::new(BurstOccupancy::new(n_tx)))
+            } else {
+                TxQueue::Shared(Arc::new(RoundRobin::new(n_tx as u32)))
+            };
+
             Self {
                 port_id,
                 mbuf_pool,
                 recv_table: HashMap::new(),
                 multicast_address: None,
                 multicast_recv: Box::new(|_, _| {}),
-                rr: Arc::new(RoundRobin::new(n_tx as u32)),
+                tx_queue,
+                multi_seg: oskr_eth_tx_multi_seg(port_id) != 0,
                 drop_rate: 0.,
+                rx_stat: (0..n_rx)
+                    .map(|_| CachePadded::new([AtomicU64::new(0), AtomicU64::new(0)]))
+                    .collect(),
             }
         }
     }
@@ -285,6 +489,69 @@ impl Transport {
         self.drop_rate = drop_rate;
     }
 
+    /// Send packets buffered by current lcore. Call this when current lcore
+    /// has nothing else to do, or buffered packets wait for
+    /// `TX_FLUSH_INTERVAL` until next sending or `flush_tx_expired`.
+    pub fn flush_tx() {
+        TX_BUFFER.with(|buffer| buffer.borrow_mut().flush());
+    }
+
+    /// Send packets buffered by current lcore if they have waited for
+    /// `TX_FLUSH_INTERVAL`. Call this between tasks of a busy lcore, which may
+    /// not send anything for a while.
+    pub fn flush_tx_expired() {
+        TX_BUFFER.with(|buffer| buffer.borrow_mut().flush_expired());
+    }
+
+    /// Number of flushed tx bursts indexed by burst size, summed across all
+    /// tx queues. Empty if tx queues are not per-lcore, which never buffers.
+    pub fn tx_burst_occupancy(&self) -> Vec<u64> {
+        if let TxQueue::PerLcore(occupancy) = &self.tx_queue {
+            let mut count = vec![0; TX_BURST + 1];
+            for queue in &*occupancy.0 {
+                // zip stops before the drop counter
+                for (count, counter) in count.iter_mut().zip(queue.iter()) {
+                    *count += counter.load(Ordering::Relaxed);
+                }
+            }
+            count
+        } else {
+            Vec::new()
+        }
+    }
+
+    /// Number of buffered packets that are dropped because tx queue stays full
+    /// for too long, summed across all tx queues. Always zero if tx queues are
+    /// not per-lcore.
+    pub fn tx_drop(&self) -> u64 {
+        if let TxQueue::PerLcore(occupancy) = &self.tx_queue {
+            occupancy
+                .0
+                .iter()
+                .map(|queue| queue[TX_BURST + 1].load(Ordering::Relaxed))
+                .sum()
+        } else {
+            0
+        }
+    }
+
+    /// Number of (received, dropped) packets summed across all rx queues,
+    /// where dropped ones are received and then dropped by `drop_rate`.
+    pub fn rx_stat(&self) -> (u64, u64) {
+        self.rx_stat
+            .iter()
+            .fold((0, 0), |(received, dropped), stat| {
+                (
+                    received + stat[0].load(Ordering::Relaxed),
+                    dropped + stat[1].load(Ordering::Relaxed),
+                )
+            })
+    }
+
+    pub fn mbuf_in_use(&self) -> u32 {
+        unsafe { rte_mempool_in_use_count(self.mbuf_pool) }
+    }
+
     pub fn worker_id() -> usize {
         (unsafe { rte_lcore_index(oskr_lcore_id() as c_int) }) as usize - 1
     }
@@ -313,8 +580,14 @@ impl Transport {
             );
             &(burst.assume_init())[..burst_size as usize]
         };
+        // single writer, no read-modify-write necessary
+        let stat = &self.rx_stat[queue_id as usize];
+        let received = stat[0].load(Ordering::Relaxed);
+        stat[0].store(received + burst.len() as u64, Ordering::Relaxed);
         for mbuf in burst {
             if self.drop_rate > 0. && random::<f32>() < self.drop_rate {
+                let dropped = stat[1].load(Ordering::Relaxed);
+                stat[1].store(dropped + 1, Ordering::Relaxed);
                 continue;
             }
             let mbuf = NonNull::new(*mbuf).unwrap();
@@ -326,6 +599,8 @@ impl Transport {
                 }
             }
         }
+        // rx agent may send as well
+        Self::flush_tx();
     }
 
     pub fn poll(&self, queue_id: u16) {
@@ -350,11 +625,11 @@ impl Transport {
         }
     }
 
-    pub fn run1(&self, mut shutdown: impl FnMut() -> bool) {
+    pub fn run1(&self, queue_id: u16, mut shutdown: impl FnMut() -> bool) {
         assert_eq!(self.recv_table.len(), 1);
         let (address, rx_agent) = self.recv_table.iter().next().unwrap();
         while !shutdown() {
-            self.run_internal(0, |source, dest, buffer| {
+            self.run_internal(queue_id, |source, dest, buffer| {
                 if dest == *address {
                     rx_agent(source, buffer);
                     true
@@ -33,6 +33,22 @@ impl Latency {
     pub fn refresh(&mut self) {
         self.hist.refresh();
     }
+
+    pub fn refresh_timeout(&mut self, timeout: Duration) {
+        self.hist.refresh_timeout(timeout);
+    }
+
+    pub fn len(&self) -> u64 {
+        self.hist.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.hist.is_empty()
+    }
+
+    pub fn quantile(&self, quantile: f64) -> Duration {
+        Duration::from_nanos(self.hist.value_at_quantile(quantile))
+    }
 }
 
 impl From<Latency> for SyncHistogram<u32> {
@@ -51,17 +67,33 @@ impl Latency {
     }
 }
 
+// start time point and an offset to it
 #[derive(Debug, Clone, Copy)]
-pub struct Measure(u64);
+pub struct Measure(u64, Duration);
 impl MeasureClock {
     pub fn measure(&self) -> Measure {
-        Measure(self.0.start())
+        Measure(self.0.start(), Duration::ZERO)
+    }
+}
+
+impl Measure {
+    /// Measure from `offset` after this measure's start instead, e.g. from
+    /// the scheduled sending time of an open loop request.
+    pub fn schedule(self, offset: Duration) -> Self {
+        Self(self.0, self.1 + offset)
     }
 }
 
 impl AddAssign<Measure> for LocalLatency {
     fn add_assign(&mut self, measure: Measure) {
-        self.recorder += self.clock.delta(measure.0, self.clock.end()).as_nanos() as u64;
+        let delta = self.clock.delta(measure.0, self.clock.end());
+        self.recorder += delta.saturating_sub(measure.1).as_nanos() as u64;
+    }
+}
+
+impl AddAssign<Duration> for LocalLatency {
+    fn add_assign(&mut self, delta: Duration) {
+        self.recorder += delta.as_nanos() as u64;
     }
 }
 
@@ -1,16 +1,179 @@
-use std::collections::{BTreeMap, HashMap, HashSet};
+use std::{
+    collections::{BTreeMap, HashMap, HashSet, VecDeque},
+    mem::take,
+};
 
 use crate::{
-    app::ycsb::{self, DatabaseResult, Error},
-    common::Opaque,
+    app::ycsb::{self, CompactOp, DatabaseResult, Error},
+    common::{OpNumber, Opaque},
 };
 
+// field id => value, with length of field count when row is stored
+type Row = Vec<Option<Opaque>>;
+
+/// In memory YCSB database.
+///
+/// Field names are interned into field ids, and all rows live in one slab with
+/// a slot of field count values for each row, so reading a row is a slice of
+/// the slab and touches no allocation except for the result. Schema is
+/// extended (with a relayout of slab) when first seeing a field, which for
+/// YCSB only happens for the first insert.
 #[derive(Debug, Clone, Default)]
 pub struct Database {
-    // outer level B-Tree for supporting scan operation
-    // inner level using B-Tree instead of hashed, because the database
-    // interface is using B-Tree as well
-    storage: BTreeMap<String, BTreeMap<String, Opaque>>,
+    field_list: Vec<String>,
+    field_table: HashMap<String, usize>,
+    // field id => field index of `CompactOp`, and the reverse
+    field_index_list: Vec<Option<usize>>,
+    compact_field_list: Vec<Option<usize>>,
+    // B-Tree for supporting scan operation
+    // key => slot
+    key_table: BTreeMap<String, usize>,
+    slab: Vec<Option<Opaque>>,
+    free_list: Vec<usize>,
+    // op number => previous version of every row it touched, in touching
+    // order, only for ops that write
+    // disabled if none, because without commit it grows forever
+    undo_log: Option<VecDeque<(OpNumber, Vec<(String, Option<Row>)>)>>,
+    op_number: OpNumber,
+}
+
+impl Database {
+    /// Create a database that keeps undo log for uncommitted ops, so it can
+    /// be rolled back. Only use it with protocols that commit, e.g. Zyzzyva.
+    pub fn speculative() -> Self {
+        Self {
+            undo_log: Some(VecDeque::new()),
+            ..Self::default()
+        }
+    }
+
+    fn field_id(&mut self, field: &str) -> usize {
+        if let Some(id) = self.field_table.get(field) {
+            return *id;
+        }
+        let n_field = self.field_list.len();
+        let n_slot = self.key_table.len() + self.free_list.len();
+        // relayout slab into slots of one more field
+        let mut slab = Vec::with_capacity(n_slot * (n_field + 1));
+        let mut value_iter = take(&mut self.slab).into_iter();
+        for _ in 0..n_slot {
+            slab.extend(value_iter.by_ref().take(n_field));
+            slab.push(None);
+        }
+        self.slab = slab;
+        self.field_list.push(field.to_string());
+        self.field_table.insert(field.to_string(), n_field);
+        let index = CompactOp::field_index(field);
+        if let Some(index) = index {
+            if index >= self.compact_field_list.len() {
+                self.compact_field_list.resize(index + 1, None);
+            }
+            self.compact_field_list[index] = Some(n_field);
+        }
+        self.field_index_list.push(index);
+        n_field
+    }
+
+    fn compact_field_id(&mut self, index: usize) -> usize {
+        if let Some(Some(id)) = self.compact_field_list.get(index) {
+            *id
+        } else {
+            self.field_id(&CompactOp::field_name(index))
+        }
+    }
+
+    // compact counterpart of `project`
+    fn project_compact(&self, slot: usize, mask: u64) -> (u64, Vec<Opaque>) {
+        let row = self.row(slot);
+        let mut value_list: Vec<_> = row
+            .iter()
+            .zip(&self.field_index_list)
+            .filter_map(|(value, index)| Some((index.as_ref()?, value.as_ref()?)))
+            .filter(|(index, _)| mask == 0 || mask & 1u64 << **index != 0)
+            .collect();
+        value_list.sort_unstable_by_key(|(index, _)| **index);
+        (
+            CompactOp::field_mask(value_list.iter().map(|(index, _)| **index)),
+            value_list
+                .into_iter()
+                .map(|(_, value)| value.clone())
+                .collect(),
+        )
+    }
+
+    // intern before getting slot, which may relayout slab
+    fn compact_value_list(&mut self, mask: u64, value_list: Vec<Opaque>) -> Vec<(usize, Opaque)> {
+        (0..64)
+            .filter(|index| mask & 1u64 << index != 0)
+            .zip(value_list)
+            .map(|(index, value)| (self.compact_field_id(index), value))
+            .collect()
+    }
+
+    fn row(&self, slot: usize) -> &[Option<Opaque>] {
+        let n_field = self.field_list.len();
+        &self.slab[slot * n_field..(slot + 1) * n_field]
+    }
+
+    fn row_mut(&mut self, slot: usize) -> &mut [Option<Opaque>] {
+        let n_field = self.field_list.len();
+        &mut self.slab[slot * n_field..(slot + 1) * n_field]
+    }
+
+    fn project(&self, slot: usize, field_set: &HashSet<String>) -> BTreeMap<String, Opaque> {
+        let row = self.row(slot);
+        if field_set.is_empty() {
+            row.iter()
+                .enumerate()
+                .filter_map(|(id, value)| Some((self.field_list[id].clone(), value.clone()?)))
+                .collect()
+        } else {
+            field_set
+                .iter()
+                .filter_map(|field| {
+                    let value = row[*self.field_table.get(field)?].clone()?;
+                    Some((field.clone(), value))
+                })
+                .collect()
+        }
+    }
+
+    // get slot of key, allocate an empty one if not exist
+    fn slot(&mut self, key: &str) -> usize {
+        if let Some(slot) = self.key_table.get(key) {
+            return *slot;
+        }
+        let slot = if let Some(slot) = self.free_list.pop() {
+            slot
+        } else {
+            let n_field = self.field_list.len();
+            self.slab.resize(self.slab.len() + n_field, None);
+            // no free slot, so every slot is taken by a key
+            self.key_table.len()
+        };
+        self.key_table.insert(key.to_string(), slot);
+        slot
+    }
+
+    fn remove_row(&mut self, key: &str) {
+        if let Some(slot) = self.key_table.remove(key) {
+            self.row_mut(slot).fill(None);
+            self.free_list.push(slot);
+        }
+    }
+
+    fn record_undo(&mut self, key: &str) {
+        if self.undo_log.is_none() {
+            return;
+        }
+        // values are shared so copying row is cheap
+        let row = self.key_table.get(key).map(|slot| self.row(*slot).to_vec());
+        let undo_log = self.undo_log.as_mut().unwrap();
+        if !matches!(undo_log.back(), Some((op_number, _)) if *op_number == self.op_number) {
+            undo_log.push_back((self.op_number, Vec::new()));
+        }
+        undo_log.back_mut().unwrap().1.push((key.to_string(), row));
+    }
 }
 
 impl ycsb::Database for Database {
@@ -21,15 +184,8 @@ impl ycsb::Database for Database {
         field_set: HashSet<String>,
         result: &mut BTreeMap<String, Opaque>,
     ) -> DatabaseResult {
-        if let Some(row) = self.storage.get(&key) {
-            *result = if field_set.is_empty() {
-                row.clone()
-            } else {
-                row.iter()
-                    .filter(|(column, _)| field_set.contains(*column))
-                    .map(|(k, v)| (k.clone(), v.clone()))
-                    .collect()
-            };
+        if let Some(slot) = self.key_table.get(&key) {
+            *result = self.project(*slot, &field_set);
             Ok(())
         } else {
             Err(Error::NotFound)
@@ -44,19 +200,10 @@ impl ycsb::Database for Database {
         result: &mut Vec<BTreeMap<String, Opaque>>,
     ) -> DatabaseResult {
         *result = self
-            .storage
+            .key_table
             .range(start_key..)
             .take(record_count)
-            .map(|(_, row)| {
-                if field_set.is_empty() {
-                    row.clone()
-                } else {
-                    row.iter()
-                        .filter(|(column, _)| field_set.contains(*column))
-                        .map(|(k, v)| (k.clone(), v.clone()))
-                        .collect()
-                }
-            })
+            .map(|(_, slot)| self.project(*slot, &field_set))
             .collect();
         Ok(())
     }
@@ -66,12 +213,21 @@ impl ycsb::Database for Database {
         key: String,
         value_table: HashMap<String, Opaque>,
     ) -> DatabaseResult {
-        if let Some(row) = self.storage.get_mut(&key) {
-            row.extend(value_table);
-            Ok(())
-        } else {
-            Err(Error::NotFound)
+        if !self.key_table.contains_key(&key) {
+            return Err(Error::NotFound);
         }
+        self.record_undo(&key);
+        // intern first, which may relayout slab
+        let value_list: Vec<_> = value_table
+            .into_iter()
+            .map(|(field, value)| (self.field_id(&field), value))
+            .collect();
+        let slot = self.key_table[&key];
+        let row = self.row_mut(slot);
+        for (id, value) in value_list {
+            row[id] = Some(value);
+        }
+        Ok(())
     }
     fn insert(
         &mut self,
@@ -79,11 +235,225 @@ impl ycsb::Database for Database {
         key: String,
         value_table: HashMap<String, Opaque>,
     ) -> DatabaseResult {
-        self.storage.insert(key, value_table.into_iter().collect());
+        self.record_undo(&key);
+        let value_list: Vec<_> = value_table
+            .into_iter()
+            .map(|(field, value)| (self.field_id(&field), value))
+            .collect();
+        let slot = self.slot(&key);
+        let row = self.row_mut(slot);
+        row.fill(None);
+        for (id, value) in value_list {
+            row[id] = Some(value);
+        }
         Ok(())
     }
     fn delete(&mut self, _table: String, key: String) -> DatabaseResult {
-        self.storage.remove(&key);
+        self.record_undo(&key);
+        self.remove_row(&key);
         Ok(())
     }
+
+    fn execute_compact(&mut self, op: CompactOp) -> ycsb::Result {
+        match op {
+            CompactOp::Read(key, mask) => {
+                if let Some(slot) = self.key_table.get(&CompactOp::key_name(key)) {
+                    let (mask, value_list) = self.project_compact(*slot, mask);
+                    ycsb::Result::CompactReadOk(mask, value_list)
+                } else {
+                    ycsb::Result::Error(Error::NotFound)
+                }
+            }
+            CompactOp::Scan(start_key, record_count, mask) => ycsb::Result::CompactScanOk(
+                self.key_table
+                    .range(CompactOp::key_name(start_key)..)
+                    .take(record_count)
+                    .map(|(_, slot)| self.project_compact(*slot, mask))
+                    .collect(),
+            ),
+            CompactOp::Update(key, mask, value_list) => {
+                let key = CompactOp::key_name(key);
+                if !self.key_table.contains_key(&key) {
+                    return ycsb::Result::Error(Error::NotFound);
+                }
+                self.record_undo(&key);
+                let value_list = self.compact_value_list(mask, value_list);
+                let slot = self.key_table[&key];
+                let row = self.row_mut(slot);
+                for (id, value) in value_list {
+                    row[id] = Some(value);
+                }
+                ycsb::Result::UpdateOk
+            }
+            CompactOp::Insert(key, mask, value_list) => {
+                let key = CompactOp::key_name(key);
+                self.record_undo(&key);
+                let value_list = self.compact_value_list(mask, value_list);
+                let slot = self.slot(&key);
+                let row = self.row_mut(slot);
+                row.fill(None);
+                for (id, value) in value_list {
+                    row[id] = Some(value);
+                }
+                ycsb::Result::InsertOk
+            }
+            CompactOp::Delete(key) => {
+                let key = CompactOp::key_name(key);
+                self.record_undo(&key);
+                self.remove_row(&key);
+                ycsb::Result::DeleteOk
+            }
+        }
+    }
+
+    fn begin(&mut self, op_number: OpNumber) {
+        self.op_number = op_number;
+    }
+    fn rollback(&mut self, op_number: OpNumber) {
+        let mut undo_log = self.undo_log.take().expect("rollback without undo log");
+        while matches!(undo_log.back(), Some((undo_op, _)) if *undo_op > op_number) {
+            let (_, row_list) = undo_log.pop_back().unwrap();
+            for (key, row) in row_list.into_iter().rev() {
+                if let Some(row) = row {
+                    let slot = self.slot(&key);
+                    let slot_row = self.row_mut(slot);
+                    slot_row.fill(None);
+                    // schema may grow after the version is recorded
+                    for (value, saved) in slot_row.iter_mut().zip(row) {
+                        *value = saved;
+                    }
+                } else {
+                    self.remove_row(&key);
+                }
+            }
+        }
+        self.undo_log = Some(undo_log);
+    }
+    fn commit(&mut self, op_number: OpNumber) {
+        if let Some(undo_log) = &mut self.undo_log {
+            while matches!(undo_log.front(), Some((undo_op, _)) if *undo_op <= op_number) {
+                undo_log.pop_front();
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::app::ycsb::Database as _;
+
+    use super::*;
+
+    fn value_table(value: &'static str) -> HashMap<String, Opaque> {
+        [("A".to_string(), value.as_bytes().into())]
+            .into_iter()
+            .collect()
+    }
+
+    fn read(db: &mut Database, key: &str) -> Option<Opaque> {
+        let mut result = BTreeMap::new();
+        db.read(
+            "usertable".to_string(),
+            key.to_string(),
+            HashSet::new(),
+            &mut result,
+        )
+        .ok()?;
+        result.remove("A")
+    }
+
+    #[test]
+    fn rollback() {
+        let mut db = Database::speculative();
+        db.begin(1);
+        db.insert(
+            "usertable".to_string(),
+            "id-0".to_string(),
+            value_table("a-0"),
+        )
+        .unwrap();
+        db.begin(2);
+        db.update(
+            "usertable".to_string(),
+            "id-0".to_string(),
+            value_table("a-1"),
+        )
+        .unwrap();
+        db.begin(3);
+        db.insert(
+            "usertable".to_string(),
+            "id-1".to_string(),
+            value_table("b-0"),
+        )
+        .unwrap();
+        db.delete("usertable".to_string(), "id-0".to_string())
+            .unwrap();
+
+        db.rollback(2);
+        assert_eq!(read(&mut db, "id-0").unwrap(), "a-1".as_bytes());
+        assert_eq!(read(&mut db, "id-1"), None);
+        db.rollback(0);
+        assert_eq!(read(&mut db, "id-0"), None);
+    }
+
+    #[test]
+    fn compact() {
+        let mut db = Database::default();
+        db.insert(
+            "usertable".to_string(),
+            "user1".to_string(),
+            [
+                ("field0".to_string(), "a".as_bytes().into()),
+                ("field2".to_string(), "c".as_bytes().into()),
+            ]
+            .into_iter()
+            .collect(),
+        )
+        .unwrap();
+        assert!(matches!(
+            db.execute_compact(CompactOp::Update(
+                1,
+                0b11,
+                vec!["a!".as_bytes().into(), "b".as_bytes().into()]
+            )),
+            ycsb::Result::UpdateOk
+        ));
+        if let ycsb::Result::CompactReadOk(mask, value_list) =
+            db.execute_compact(CompactOp::Read(1, 0b110))
+        {
+            assert_eq!(mask, 0b110);
+            assert_eq!(value_list, ["b".as_bytes(), "c".as_bytes()]);
+        } else {
+            unreachable!()
+        }
+        // named form sees compact write
+        let mut result = BTreeMap::new();
+        db.read(
+            "usertable".to_string(),
+            "user1".to_string(),
+            HashSet::new(),
+            &mut result,
+        )
+        .unwrap();
+        assert_eq!(result["field0"], "a!".as_bytes());
+    }
+
+    #[test]
+    fn commit() {
+        let mut db = Database::speculative();
+        for op_number in 1..=10 {
+            db.begin(op_number);
+            db.insert(
+                "usertable".to_string(),
+                "id-0".to_string(),
+                value_table("a-0"),
+            )
+            .unwrap();
+        }
+        db.commit(8);
+        assert_eq!(db.undo_log.as_ref().unwrap().len(), 2);
+        db.rollback(0);
+        // committed op survives
+        assert_eq!(read(&mut db, "id-0").unwrap(), "a-0".as_bytes());
+    }
 }
@@ -0,0 +1,134 @@
+//! Periodic metrics snapshot.
+//!
+//! Sources are registered into [`Metrics`] as closures reading counters that
+//! their owners already maintain, e.g. queue lengths or per-lcore counters
+//! written by single writer, so taking a snapshot never writes to anything
+//! touched on data path. Latency histograms are refreshed with timeout, so a
+//! recorder on a busy lcore hands over its samples on its next recording, and
+//! an idle one is skipped instead of being waited for.
+//!
+//! [`Metrics::run`] is intended to run on a dedicated non-lcore thread, which
+//! writes one line per interval:
+//!
+//! ```text
+//! <elapsed seconds> <name>=<value> <name>=<value>/s ...
+//! ```
+
+use std::{
+    fmt::Write as _,
+    io::Write,
+    sync::{Arc, Mutex},
+    thread,
+    time::{Duration, Instant},
+};
+
+use crate::framework::latency::Latency;
+
+enum Source<'a> {
+    Gauge(Box<dyn Fn() -> u64 + Send + 'a>),
+    // monotonic, reported as rate since last snapshot
+    Counter(Box<dyn Fn() -> u64 + Send + 'a>, u64),
+    Latency(Arc<Mutex<Latency>>),
+}
+
+#[derive(Default)]
+pub struct Metrics<'a> {
+    source_list: Vec<(String, Source<'a>)>,
+}
+
+impl<'a> Metrics<'a> {
+    pub fn gauge(&mut self, name: &str, gauge: impl Fn() -> u64 + Send + 'a) {
+        self.source_list
+            .push((name.to_string(), Source::Gauge(Box::new(gauge))));
+    }
+
+    pub fn counter(&mut self, name: &str, counter: impl Fn() -> u64 + Send + 'a) {
+        self.source_list
+            .push((name.to_string(), Source::Counter(Box::new(counter), 0)));
+    }
+
+    pub fn latency(&mut self, name: &str, latency: Arc<Mutex<Latency>>) {
+        self.source_list
+            .push((name.to_string(), Source::Latency(latency)));
+    }
+
+    // one line of all sources, without trailing newline
+    fn snapshot(&mut self, interval: Duration, timeout: Duration) -> String {
+        let mut line = String::new();
+        for (name, source) in &mut self.source_list {
+            match source {
+                Source::Gauge(gauge) => write!(line, " {}={}", name, gauge()).unwrap(),
+                Source::Counter(counter, prev) => {
+                    let count = counter();
+                    let rate = (count - *prev) as f64 / interval.as_secs_f64();
+                    *prev = count;
+                    write!(line, " {}={:.0}/s", name, rate).unwrap();
+                }
+                Source::Latency(latency) => {
+                    let mut latency = latency.lock().unwrap();
+                    latency.refresh_timeout(timeout);
+                    write!(
+                        line,
+                        " {}.n={} {}.p50={:?} {}.p99={:?}",
+                        name,
+                        latency.len(),
+                        name,
+                        latency.quantile(0.5),
+                        name,
+                        latency.quantile(0.99)
+                    )
+                    .unwrap();
+                }
+            }
+        }
+        line
+    }
+
+    /// Write a snapshot every `interval` until `shutdown` returns `true`.
+    pub fn run(mut self, mut writer: impl Write, interval: Duration, shutdown: impl Fn() -> bool) {
+        let start = Instant::now();
+        let mut next = start + interval;
+        let mut prev = start;
+        while !shutdown() {
+            let now = Instant::now();
+            if now < next {
+                // check shutdown at least every 100ms
+                thread::sleep((next - now).min(Duration::from_millis(100)));
+                continue;
+            }
+            let line = self.snapshot(now - prev, interval / 10);
+            prev = now;
+            next += interval;
+            writeln!(writer, "{:.1}{}", (now - start).as_secs_f64(), line).unwrap();
+            writer.flush().unwrap();
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::sync::atomic::{AtomicU64, Ordering};
+
+    use super::*;
+
+    #[test]
+    fn snapshot() {
+        let count = AtomicU64::new(0);
+        let latency = Arc::new(Mutex::new(Latency::new("latency")));
+        let mut local = latency.lock().unwrap().local();
+        let mut metrics = Metrics::default();
+        metrics.gauge("depth", || 3);
+        metrics.counter("count", || count.load(Ordering::Relaxed));
+        metrics.latency("latency", latency.clone());
+
+        count.store(200, Ordering::Relaxed);
+        local += Duration::from_micros(10);
+        drop(local);
+        let line = metrics.snapshot(Duration::from_secs(2), Duration::from_millis(100));
+        assert!(line.starts_with(" depth=3 count=100/s latency.n=1 latency.p50="));
+        assert_eq!(
+            metrics.snapshot(Duration::from_secs(1), Duration::from_millis(100)),
+            line.replace("count=100/s", "count=0/s")
+        );
+    }
+}
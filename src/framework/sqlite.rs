@@ -4,31 +4,167 @@ use std::{
     path::Path,
 };
 
-use rusqlite::{params, Connection, ToSql};
+use rusqlite::{
+    params,
+    types::{FromSql, FromSqlResult, ToSqlOutput, ValueRef},
+    Connection, ToSql,
+};
 
 use crate::{
     app::ycsb::{self, DatabaseResult, Error},
     common::Opaque,
 };
 
+impl ToSql for Opaque {
+    fn to_sql(&self) -> rusqlite::Result<ToSqlOutput<'_>> {
+        Ok(ToSqlOutput::Borrowed(ValueRef::Blob(self)))
+    }
+}
+
+impl FromSql for Opaque {
+    fn column_result(value: ValueRef<'_>) -> FromSqlResult<Self> {
+        value.as_blob().map(Opaque::copy_from_slice)
+    }
+}
+
+/// SQLite `synchronous` pragma level.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Synchronous {
+    Off,
+    Normal,
+    Full,
+    Extra,
+}
+
 #[derive(Debug)]
-pub struct Database(Connection);
+pub struct Database {
+    connection: Connection,
+    schema_table: HashMap<String, Schema>,
+    // commit once per flush instead of once per op
+    batched: bool,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+enum StmtKind {
+    Read,
+    Scan,
+    Update,
+    Insert,
+    Delete,
+}
+
+// field name is interned into bit of mask, so a statement is looked up with
+// (kind, field mask) without building its text
+// rusqlite's statement cache is keyed by text, so text has to be stable for
+// the same field set (i.e. not depend on hash map order) to be a cache hit
+#[derive(Debug, Default)]
+struct Schema {
+    field_list: Vec<String>,
+    field_table: HashMap<String, usize>,
+    stmt_table: HashMap<(StmtKind, u64), String>,
+}
+
+impl Schema {
+    fn field_id(&mut self, field: &str) -> usize {
+        if let Some(id) = self.field_table.get(field) {
+            return *id;
+        }
+        let id = self.field_list.len();
+        assert!(id < 64, "too many fields");
+        self.field_list.push(field.to_string());
+        self.field_table.insert(field.to_string(), id);
+        id
+    }
+
+    fn statement(&mut self, table: &str, kind: StmtKind, mask: u64) -> &str {
+        let field_list = &self.field_list;
+        self.stmt_table.entry((kind, mask)).or_insert_with(|| {
+            let field_iter = field_list
+                .iter()
+                .enumerate()
+                .filter(|(id, _)| mask & (1u64 << id) != 0)
+                .map(|(_, field)| &**field);
+            match kind {
+                StmtKind::Read => format!("SELECT * FROM {} WHERE YCSB_KEY = ?", table),
+                StmtKind::Scan => format!(
+                    "SELECT * FROM {} WHERE YCSB_KEY >= ? ORDER BY YCSB_KEY LIMIT ?",
+                    table
+                ),
+                StmtKind::Update => format!(
+                    "UPDATE {} SET {} WHERE YCSB_KEY = ?",
+                    table,
+                    field_iter
+                        .map(|field| format!("{}=?", field))
+                        .collect::<Vec<_>>()
+                        .join(", ")
+                ),
+                StmtKind::Insert => format!(
+                    "INSERT INTO {} (YCSB_KEY, {}) VALUES(?, {})",
+                    table,
+                    field_iter.collect::<Vec<_>>().join(", "),
+                    repeat("?")
+                        .take(mask.count_ones() as usize)
+                        .collect::<Vec<_>>()
+                        .join(", ")
+                ),
+                StmtKind::Delete => format!("DELETE FROM {} WHERE YCSB_KEY = ?", table),
+            }
+        })
+    }
+}
+
 impl Default for Database {
     fn default() -> Self {
-        Self(Connection::open_in_memory().unwrap())
+        Self::new(Connection::open_in_memory().unwrap())
     }
 }
 
 impl Database {
+    // enough for every (kind, field set) of a YCSB table, which is single
+    // field or all fields
+    const STMT_CACHE_CAPACITY: usize = 64;
+
+    fn new(connection: Connection) -> Self {
+        connection.set_prepared_statement_cache_capacity(Self::STMT_CACHE_CAPACITY);
+        Self {
+            connection,
+            schema_table: HashMap::new(),
+            batched: false,
+        }
+    }
+
     pub fn open(path: impl AsRef<Path>) -> Self {
-        Self(Connection::open(path).unwrap())
+        Self::new(Connection::open(path).unwrap())
+    }
+
+    /// Wrap all ops between two `flush` into one transaction, i.e. one commit
+    /// per protocol batch, and switch journal to WAL with `synchronous` level.
+    pub fn with_batch_commit(self, synchronous: Synchronous) -> Self {
+        // journal mode pragma returns the resulted mode, which is `memory` for
+        // in memory database
+        self.connection
+            .query_row("PRAGMA journal_mode = WAL", [], |_| Ok(()))
+            .unwrap();
+        let synchronous = match synchronous {
+            Synchronous::Off => "OFF",
+            Synchronous::Normal => "NORMAL",
+            Synchronous::Full => "FULL",
+            Synchronous::Extra => "EXTRA",
+        };
+        self.connection
+            .execute_batch(&format!("PRAGMA synchronous = {}", synchronous))
+            .unwrap();
+        Self {
+            batched: true,
+            ..self
+        }
     }
 
     pub fn create_table(&self, table: &str, field_set: &[&str]) {
-        self.0
+        self.connection
             .execute(&format!("DROP TABLE IF EXISTS {};", table), [])
             .unwrap(); // not very necessary here
-        self.0
+        self.connection
             .execute(
                 &format!(
                     "CREATE TABLE {} (YCSB_KEY VARCHAR PRIMARY KEY, {});",
@@ -55,24 +191,41 @@ impl Database {
                 .collect()
         }
     }
-    fn split_value_table(
-        value_table: &HashMap<String, Opaque>,
-        update: bool, // not a very good style
-    ) -> (String, Vec<&dyn ToSql>) {
-        let (stmt_list, param_list): (Vec<_>, Vec<_>) = value_table
+
+    // take the table instead of self, so the statement borrowed from schema
+    // does not prevent using connection
+    fn schema<'a>(schema_table: &'a mut HashMap<String, Schema>, table: &str) -> &'a mut Schema {
+        if !schema_table.contains_key(table) {
+            schema_table.insert(table.to_string(), Schema::default());
+        }
+        schema_table.get_mut(table).unwrap()
+    }
+
+    // return field mask and values in field id order, which matches the order
+    // in statement
+    fn split_value_table<'a>(
+        schema: &mut Schema,
+        value_table: &'a HashMap<String, Opaque>,
+    ) -> (u64, Vec<&'a dyn ToSql>) {
+        let mut value_list: Vec<_> = value_table
             .iter()
-            .map(|(field, value)| {
-                (
-                    if update {
-                        format!("{}=?", field)
-                    } else {
-                        field.clone()
-                    },
-                    value as &dyn ToSql,
-                )
-            })
-            .unzip();
-        (stmt_list.join(", "), param_list)
+            .map(|(field, value)| (schema.field_id(field), value))
+            .collect();
+        value_list.sort_unstable_by_key(|(id, _)| *id);
+        let mask = value_list.iter().fold(0, |mask, (id, _)| mask | 1u64 << id);
+        (
+            mask,
+            value_list
+                .into_iter()
+                .map(|(_, value)| value as &dyn ToSql)
+                .collect(),
+        )
+    }
+
+    fn begin_write(&self) {
+        if self.batched && self.connection.is_autocommit() {
+            self.connection.execute_batch("BEGIN").unwrap();
+        }
     }
 }
 
@@ -84,10 +237,8 @@ impl ycsb::Database for Database {
         field_set: HashSet<String>,
         result: &mut BTreeMap<String, Opaque>,
     ) -> DatabaseResult {
-        let mut stmt = self
-            .0
-            .prepare_cached(&format!("SELECT * FROM {} WHERE YCSB_KEY = ?", table))
-            .unwrap();
+        let sql = Self::schema(&mut self.schema_table, &table).statement(&table, StmtKind::Read, 0);
+        let mut stmt = self.connection.prepare_cached(sql).unwrap();
         let field_list = Self::queried_field(field_set, stmt.column_names());
         let mut row_list = stmt.query([key]).unwrap();
         if let Some(row) = row_list.next().unwrap() {
@@ -107,13 +258,8 @@ impl ycsb::Database for Database {
         field_set: HashSet<String>,
         result: &mut Vec<BTreeMap<String, Opaque>>,
     ) -> DatabaseResult {
-        let mut stmt = self
-            .0
-            .prepare_cached(&format!(
-                "SELECT * FROM {} WHERE YCSB_KEY >= ? ORDER BY YCSB_KEY LIMIT ?",
-                table
-            ))
-            .unwrap();
+        let sql = Self::schema(&mut self.schema_table, &table).statement(&table, StmtKind::Scan, 0);
+        let mut stmt = self.connection.prepare_cached(sql).unwrap();
         let field_list = Self::queried_field(field_set, stmt.column_names());
         let mut row_list = stmt.query(params![start_key, record_count]).unwrap();
         while let Some(row) = row_list.next().unwrap() {
@@ -134,14 +280,14 @@ impl ycsb::Database for Database {
         key: String,
         value_table: HashMap<String, Opaque>,
     ) -> DatabaseResult {
-        let (stmt_field, mut param_list) = Self::split_value_table(&value_table, true);
+        self.begin_write();
+        let schema = Self::schema(&mut self.schema_table, &table);
+        let (mask, mut param_list) = Self::split_value_table(schema, &value_table);
         param_list.push(&key as &dyn ToSql);
+        let sql = schema.statement(&table, StmtKind::Update, mask);
         let result = self
-            .0
-            .prepare_cached(&format!(
-                "UPDATE {} SET {} WHERE YCSB_KEY = ?",
-                table, stmt_field,
-            ))
+            .connection
+            .prepare_cached(sql)
             .unwrap()
             .execute(&*param_list)
             .unwrap();
@@ -159,19 +305,14 @@ impl ycsb::Database for Database {
     ) -> DatabaseResult {
         // i did not see a real batch statement (i.e. merger) in rusqlite,
         // so just skip implementing batching
-        let (stmt_field, mut param_list) = Self::split_value_table(&value_table, false);
+        self.begin_write();
+        let schema = Self::schema(&mut self.schema_table, &table);
+        let (mask, mut param_list) = Self::split_value_table(schema, &value_table);
         param_list.insert(0, &key as &dyn ToSql);
+        let sql = schema.statement(&table, StmtKind::Insert, mask);
         let result = self
-            .0
-            .prepare_cached(&format!(
-                "INSERT INTO {} (YCSB_KEY, {}) VALUES(?, {})",
-                table,
-                stmt_field,
-                repeat("?")
-                    .take(value_table.len())
-                    .collect::<Vec<_>>()
-                    .join(", ")
-            ))
+            .connection
+            .prepare_cached(sql)
             .unwrap()
             .execute(&*param_list)
             .unwrap();
@@ -182,9 +323,12 @@ impl ycsb::Database for Database {
         }
     }
     fn delete(&mut self, table: String, key: String) -> DatabaseResult {
+        self.begin_write();
+        let sql =
+            Self::schema(&mut self.schema_table, &table).statement(&table, StmtKind::Delete, 0);
         let result = self
-            .0
-            .prepare_cached(&format!("DELETE FROM {} WHERE YCSB_KEY = ?", table))
+            .connection
+            .prepare_cached(sql)
             .unwrap()
             .execute([key])
             .unwrap();
@@ -194,6 +338,12 @@ impl ycsb::Database for Database {
             Err(Error::UnexpectedState)
         }
     }
+
+    fn flush(&mut self) {
+        if !self.connection.is_autocommit() {
+            self.connection.execute_batch("COMMIT").unwrap();
+        }
+    }
 }
 
 #[cfg(test)]
@@ -216,9 +366,9 @@ mod tests {
             "usertable".to_string(),
             "id-0".to_string(),
             [
-                ("A".to_string(), "a-0".as_bytes().to_vec()),
-                ("B".to_string(), "b-0".as_bytes().to_vec()),
-                ("C".to_string(), "c-0".as_bytes().to_vec()),
+                ("A".to_string(), "a-0".as_bytes().into()),
+                ("B".to_string(), "b-0".as_bytes().into()),
+                ("C".to_string(), "c-0".as_bytes().into()),
             ]
             .into_iter()
             .collect(),
@@ -245,9 +395,9 @@ mod tests {
             "usertable".to_string(),
             "id-0".to_string(),
             [
-                ("A".to_string(), "a-0".as_bytes().to_vec()),
-                ("B".to_string(), "b-0".as_bytes().to_vec()),
-                ("C".to_string(), "c-0".as_bytes().to_vec()),
+                ("A".to_string(), "a-0".as_bytes().into()),
+                ("B".to_string(), "b-0".as_bytes().into()),
+                ("C".to_string(), "c-0".as_bytes().into()),
             ]
             .into_iter()
             .collect(),
@@ -257,9 +407,9 @@ mod tests {
             "usertable".to_string(),
             "id-0".to_string(),
             [
-                ("A".to_string(), "a-1".as_bytes().to_vec()),
-                ("B".to_string(), "b-1".as_bytes().to_vec()),
-                ("C".to_string(), "c-1".as_bytes().to_vec()),
+                ("A".to_string(), "a-1".as_bytes().into()),
+                ("B".to_string(), "b-1".as_bytes().into()),
+                ("C".to_string(), "c-1".as_bytes().into()),
             ]
             .into_iter()
             .collect(),
@@ -278,4 +428,53 @@ mod tests {
         assert_eq!(result["B"], "b-1".as_bytes());
         assert_eq!(result["C"], "c-1".as_bytes());
     }
+
+    #[test]
+    fn statement_cache() {
+        let mut db = Database::default();
+        db.create_table("usertable", &["A", "B", "C"]);
+        for i in 0..10 {
+            db.insert(
+                "usertable".to_string(),
+                format!("id-{}", i),
+                [
+                    ("A".to_string(), "a".as_bytes().into()),
+                    ("B".to_string(), "b".as_bytes().into()),
+                    ("C".to_string(), "c".as_bytes().into()),
+                ]
+                .into_iter()
+                .collect(),
+            )
+            .unwrap();
+        }
+        // every hash map has its own iteration order, but all inserts share
+        // one statement
+        assert_eq!(db.schema_table["usertable"].stmt_table.len(), 1);
+    }
+
+    #[test]
+    fn batch_commit() {
+        let mut db = Database::default().with_batch_commit(Synchronous::Normal);
+        db.create_table("usertable", &["A"]);
+        db.insert(
+            "usertable".to_string(),
+            "id-0".to_string(),
+            [("A".to_string(), "a-0".as_bytes().into())]
+                .into_iter()
+                .collect(),
+        )
+        .unwrap();
+        assert!(!db.connection.is_autocommit());
+        let mut result = BTreeMap::new();
+        db.read(
+            "usertable".to_string(),
+            "id-0".to_string(),
+            HashSet::new(),
+            &mut result,
+        )
+        .unwrap();
+        assert_eq!(result["A"], "a-0".as_bytes());
+        db.flush();
+        assert!(db.connection.is_autocommit());
+    }
 }
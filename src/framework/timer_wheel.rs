@@ -0,0 +1,295 @@
+//! Hierarchical timer wheel.
+//!
+//! Timers are bucketed into [`LEVEL`] levels of 64 slots, each level 64 times
+//! coarser than the one below. Inserting and cancelling are constant time, and
+//! [`TimerWheel::advance`] costs one slot per elapsed tick plus the expired
+//! (or cascaded) timers, regardless of how many timers are pending. The caller
+//! reads clock once and advances, instead of every timer checking clock on its
+//! own.
+//!
+//! An empty wheel does not need advancing. It catches up to the current tick
+//! on next inserting instead, so idle time is not walked through tick by tick.
+//!
+//! Timers expire at tick granularity and never early, i.e. up to one tick
+//! late. Deadline beyond the range of wheel expires at the end of the range,
+//! so the owner should check its actual deadline and insert again.
+//!
+//! This backs sleeping of [`busy_poll`](super::busy_poll). Tokio, on which
+//! simulated tests also run, already drives its timers with a wheel of the
+//! same kind.
+
+use std::time::{Duration, Instant};
+
+pub const LEVEL: usize = 6;
+const SLOT_BITS: u32 = 6;
+const N_SLOT: usize = 1 << SLOT_BITS;
+
+/// Handle of an inserted timer. A key of expired or cancelled timer is
+/// stale, and never refers to a later timer.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct TimerKey {
+    index: usize,
+    generation: u32,
+}
+
+struct Entry<T> {
+    generation: u32,
+    // deadline in ticks
+    tick: u64,
+    item: Option<T>,
+}
+
+pub struct TimerWheel<T> {
+    tick: Duration,
+    start: Instant,
+    now_tick: u64,
+    level_list: Vec<Vec<Vec<TimerKey>>>,
+    entry_list: Vec<Entry<T>>,
+    free_list: Vec<usize>,
+    len: usize,
+}
+
+impl<T> TimerWheel<T> {
+    pub fn new(tick: Duration) -> Self {
+        assert!(tick > Duration::ZERO);
+        Self {
+            tick,
+            start: Instant::now(),
+            now_tick: 0,
+            level_list: (0..LEVEL)
+                .map(|_| (0..N_SLOT).map(|_| Vec::new()).collect())
+                .collect(),
+            entry_list: Vec::new(),
+            free_list: Vec::new(),
+            len: 0,
+        }
+    }
+
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    fn slot(&self, tick: u64) -> (usize, usize) {
+        let level = if tick == self.now_tick {
+            0
+        } else {
+            ((63 - (tick ^ self.now_tick).leading_zeros()) / SLOT_BITS) as usize
+        };
+        let slot = (tick >> (level as u32 * SLOT_BITS)) as usize % N_SLOT;
+        (level, slot)
+    }
+
+    // the tick that `instant` falls into
+    fn floor_tick(&self, instant: Instant) -> u64 {
+        (instant.saturating_duration_since(self.start).as_nanos() / self.tick.as_nanos()) as u64
+    }
+
+    /// Insert timer of `deadline`, while it is `now`.
+    pub fn insert(&mut self, now: Instant, deadline: Instant, item: T) -> TimerKey {
+        if self.is_empty() {
+            // keys left in slots are all stale, so nothing is skipped
+            self.now_tick = self.now_tick.max(self.floor_tick(now));
+        }
+        let delta = deadline.saturating_duration_since(self.start);
+        // round up, so never expire early
+        let tick = ((delta.as_nanos() + self.tick.as_nanos() - 1) / self.tick.as_nanos()) as u64;
+        // the farthest tick that still shares top level with now
+        let limit = self.now_tick | ((1 << (LEVEL as u32 * SLOT_BITS)) - 1);
+        let tick = tick.max(self.now_tick + 1).min(limit);
+
+        let index = if let Some(index) = self.free_list.pop() {
+            let entry = &mut self.entry_list[index];
+            entry.tick = tick;
+            entry.item = Some(item);
+            index
+        } else {
+            self.entry_list.push(Entry {
+                generation: 0,
+                tick,
+                item: Some(item),
+            });
+            self.entry_list.len() - 1
+        };
+        let key = TimerKey {
+            index,
+            generation: self.entry_list[index].generation,
+        };
+        let (level, slot) = self.slot(tick);
+        self.level_list[level][slot].push(key);
+        self.len += 1;
+        key
+    }
+
+    pub fn contains(&self, key: TimerKey) -> bool {
+        self.entry_list
+            .get(key.index)
+            .map(|entry| entry.generation == key.generation && entry.item.is_some())
+            .unwrap_or(false)
+    }
+
+    /// Remove timer from wheel. The key is left in its slot until the slot is
+    /// visited, but it is already stale.
+    pub fn cancel(&mut self, key: TimerKey) -> Option<T> {
+        if !self.contains(key) {
+            return None;
+        }
+        self.release(key.index)
+    }
+
+    fn release(&mut self, index: usize) -> Option<T> {
+        let entry = &mut self.entry_list[index];
+        entry.generation = entry.generation.wrapping_add(1);
+        self.free_list.push(index);
+        self.len -= 1;
+        entry.item.take()
+    }
+
+    /// The earliest instant at which advancing may expire or cascade a timer,
+    /// or none if the wheel is empty. It is the actual expiry for a timer in
+    /// the finest level, and the start of the slot for coarser ones, so the
+    /// owner can sleep until then instead of advancing tick by tick.
+    pub fn next_expiry(&self) -> Option<Instant> {
+        if self.is_empty() {
+            return None;
+        }
+        (0..LEVEL).find_map(|level| {
+            let shift = level as u32 * SLOT_BITS;
+            // timers in a level are always in later slots than the current one
+            let now_slot = (self.now_tick >> shift) as usize % N_SLOT;
+            let slot = (now_slot + 1..N_SLOT).find(|&slot| {
+                self.level_list[level][slot]
+                    .iter()
+                    .any(|&key| self.contains(key))
+            })?;
+            let tick = (self.now_tick >> (shift + SLOT_BITS) << (shift + SLOT_BITS))
+                | (slot as u64) << shift;
+            Some(self.start + Duration::from_nanos(self.tick.as_nanos() as u64 * tick))
+        })
+    }
+
+    /// Move wheel forward to `now`, and call `expire` on every timer whose
+    /// deadline has passed.
+    pub fn advance(&mut self, now: Instant, mut expire: impl FnMut(T)) {
+        let target = self.floor_tick(now);
+        while self.now_tick < target {
+            if self.is_empty() {
+                self.now_tick = target;
+                return;
+            }
+            self.now_tick += 1;
+            // cascade coarser slots that start at this tick, from top down, so
+            // a timer may move down several levels in one tick
+            for level in (1..LEVEL).rev() {
+                let shift = level as u32 * SLOT_BITS;
+                if self.now_tick & ((1 << shift) - 1) != 0 {
+                    continue;
+                }
+                let slot = (self.now_tick >> shift) as usize % N_SLOT;
+                for key in std::mem::take(&mut self.level_list[level][slot]) {
+                    if !self.contains(key) {
+                        continue;
+                    }
+                    let (level, slot) = self.slot(self.entry_list[key.index].tick);
+                    self.level_list[level][slot].push(key);
+                }
+            }
+            let slot = self.now_tick as usize % N_SLOT;
+            for key in std::mem::take(&mut self.level_list[0][slot]) {
+                if self.contains(key) {
+                    expire(self.release(key.index).unwrap());
+                }
+            }
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn expire_in_order() {
+        let mut wheel = TimerWheel::new(Duration::from_millis(1));
+        let start = wheel.start;
+        for i in [5, 1, 3, 70, 5000, 300000] {
+            wheel.insert(start, start + Duration::from_millis(i), i);
+        }
+        assert_eq!(wheel.len(), 6);
+
+        let mut expired = Vec::new();
+        wheel.advance(start + Duration::from_millis(4), |i| expired.push(i));
+        assert_eq!(expired, [1, 3]);
+        for ms in (4..400000).step_by(7) {
+            wheel.advance(start + Duration::from_millis(ms), |i| {
+                // never early, at most one tick (plus the step) late
+                assert!(ms >= i && ms < i + 8);
+                expired.push(i)
+            });
+        }
+        assert_eq!(expired, [1, 3, 5, 70, 5000, 300000]);
+        assert!(wheel.is_empty());
+    }
+
+    #[test]
+    fn cancel() {
+        let mut wheel = TimerWheel::new(Duration::from_millis(1));
+        let start = wheel.start;
+        let key = wheel.insert(start, start + Duration::from_millis(10), "cancelled");
+        assert!(wheel.contains(key));
+        assert_eq!(wheel.cancel(key), Some("cancelled"));
+        assert_eq!(wheel.cancel(key), None);
+
+        // reuse entry of the cancelled one
+        let another = wheel.insert(start, start + Duration::from_millis(10), "another");
+        assert!(!wheel.contains(key));
+        assert_eq!(wheel.cancel(key), None);
+        let mut expired = Vec::new();
+        wheel.advance(start + Duration::from_millis(20), |item| expired.push(item));
+        assert_eq!(expired, ["another"]);
+        assert!(!wheel.contains(another));
+    }
+
+    #[test]
+    fn next_expiry() {
+        let mut wheel = TimerWheel::new(Duration::from_millis(1));
+        let start = wheel.start;
+        assert_eq!(wheel.next_expiry(), None);
+        let key = wheel.insert(start, start + Duration::from_millis(3), 3);
+        wheel.insert(start, start + Duration::from_millis(100), 100);
+        assert_eq!(wheel.next_expiry(), Some(start + Duration::from_millis(3)));
+        wheel.cancel(key);
+        // start of the coarser slot, where 100 is cascaded
+        assert_eq!(wheel.next_expiry(), Some(start + Duration::from_millis(64)));
+
+        let mut expired = Vec::new();
+        wheel.advance(start + Duration::from_millis(64), |i| expired.push(i));
+        assert!(expired.is_empty());
+        assert_eq!(
+            wheel.next_expiry(),
+            Some(start + Duration::from_millis(100))
+        );
+        wheel.advance(start + Duration::from_millis(100), |i| expired.push(i));
+        assert_eq!(expired, [100]);
+        assert_eq!(wheel.next_expiry(), None);
+    }
+
+    #[test]
+    fn insert_after_idle() {
+        let mut wheel = TimerWheel::new(Duration::from_millis(1));
+        let start = wheel.start;
+        // nobody advances an empty wheel
+        let now = start + Duration::from_secs(3600);
+        wheel.insert(now, now + Duration::from_millis(5), "late");
+        assert_eq!(wheel.now_tick, 3600 * 1000);
+
+        let mut expired = Vec::new();
+        wheel.advance(now + Duration::from_millis(4), |item| expired.push(item));
+        assert!(expired.is_empty());
+        wheel.advance(now + Duration::from_millis(5), |item| expired.push(item));
+        assert_eq!(expired, ["late"]);
+    }
+}
@@ -0,0 +1,227 @@
+//! Sampled per-phase request tracing.
+//!
+//! A [`Span`] is started for one in every `n` events, set by
+//! [`set_sample_interval`], and is carried along with the request through
+//! stage tasks. Every [`Span::mark`] records the time since the previous mark
+//! into the histogram of that phase, so the replica latency is broken down
+//! into queueing, verifying, stateful handling, waiting for quorum, executing,
+//! signing and sending. Unsampled span is a zero which is checked and skipped.
+//!
+//! Gauges are sampled with [`sample_gauge`], which counts on its own, so it
+//! does not skew the sampling of spans on the same thread.
+//!
+//! Tracing is disabled by default, in which case starting a span costs one
+//! relaxed load.
+//!
+//! Recording goes into thread local recorders, which deliver their samples
+//! when [`flush`]ed or on thread exit. Call [`print`] after workers stop.
+
+use std::{
+    cell::{Cell, RefCell},
+    fmt::{self, Display, Formatter},
+    sync::{
+        atomic::{AtomicU32, Ordering},
+        Mutex,
+    },
+    thread::LocalKey,
+    time::Duration,
+};
+
+use hdrhistogram::{sync::Recorder, Histogram, SyncHistogram};
+use lazy_static::lazy_static;
+use quanta::Clock;
+
+use crate::framework::latency::{Latency, LocalLatency};
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Phase {
+    // from rx, or from submitting by previous phase, to a worker picking up
+    StatelessQueue,
+    Verify,
+    StatefulQueue,
+    Stateful,
+    // from being ordered, e.g. buffered or logged, to being committed
+    QuorumWait,
+    Execute,
+    Sign,
+    Tx,
+}
+
+impl Phase {
+    const NAME_LIST: [&'static str; 8] = [
+        "stateless queue",
+        "verify",
+        "stateful queue",
+        "stateful",
+        "quorum wait",
+        "execute",
+        "sign",
+        "tx",
+    ];
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Gauge {
+    StatefulQueue,
+    StatelessQueue,
+}
+
+impl Gauge {
+    const NAME_LIST: [&'static str; 2] = ["stateful queue depth", "stateless queue depth"];
+}
+
+static SAMPLE_INTERVAL: AtomicU32 = AtomicU32::new(0);
+
+/// Sample one in every `interval` events, 0 to disable.
+pub fn set_sample_interval(interval: u32) {
+    SAMPLE_INTERVAL.store(interval, Ordering::Relaxed);
+}
+
+struct Tracer {
+    phase_list: Vec<Latency>,
+    gauge_list: Vec<SyncHistogram<u64>>,
+}
+
+lazy_static! {
+    static ref TRACER: Mutex<Tracer> = Mutex::new(Tracer {
+        phase_list: Phase::NAME_LIST
+            .iter()
+            .map(|name| Latency::new(name))
+            .collect(),
+        gauge_list: Gauge::NAME_LIST
+            .iter()
+            .map(|_| Histogram::new(2).unwrap().into())
+            .collect(),
+    });
+}
+
+struct Local {
+    phase_list: Vec<LocalLatency>,
+    gauge_list: Vec<Recorder<u64>>,
+}
+
+thread_local! {
+    static COUNTDOWN: Cell<u32> = Cell::new(0);
+    static GAUGE_COUNTDOWN: Cell<u32> = Cell::new(0);
+    static CLOCK: Clock = Clock::new();
+    // created on first recording, so threads that only start spans, e.g. rx,
+    // never hold a recorder
+    static LOCAL: RefCell<Option<Local>> = RefCell::new(None);
+}
+
+/// Return `true` for one in every sample interval calls on current thread.
+pub fn sample() -> bool {
+    count_down(&COUNTDOWN)
+}
+
+/// Same as [`sample`], for gauges.
+pub fn sample_gauge() -> bool {
+    count_down(&GAUGE_COUNTDOWN)
+}
+
+fn count_down(countdown: &'static LocalKey<Cell<u32>>) -> bool {
+    let interval = SAMPLE_INTERVAL.load(Ordering::Relaxed);
+    if interval == 0 {
+        return false;
+    }
+    countdown.with(|countdown| {
+        if countdown.get() > 1 {
+            countdown.set(countdown.get() - 1);
+            false
+        } else {
+            countdown.set(interval);
+            true
+        }
+    })
+}
+
+fn with_local(f: impl FnOnce(&mut Local)) {
+    LOCAL.with(|local| {
+        let mut local = local.borrow_mut();
+        let local = local.get_or_insert_with(|| {
+            let tracer = TRACER.lock().unwrap();
+            Local {
+                phase_list: tracer.phase_list.iter().map(Latency::local).collect(),
+                gauge_list: tracer
+                    .gauge_list
+                    .iter()
+                    .map(|gauge| gauge.recorder())
+                    .collect(),
+            }
+        });
+        f(local)
+    })
+}
+
+#[derive(Debug, Clone, Copy, Default)]
+pub struct Span(u64); // raw clock reading of last mark, 0 if not sampled
+
+impl Span {
+    pub fn sample() -> Self {
+        if sample() {
+            Self(CLOCK.with(Clock::raw).max(1))
+        } else {
+            Self(0)
+        }
+    }
+
+    pub fn is_sampled(&self) -> bool {
+        self.0 != 0
+    }
+
+    /// Record time since the previous mark as `phase`.
+    pub fn mark(&mut self, phase: Phase) {
+        if !self.is_sampled() {
+            return;
+        }
+        let (delta, now) = CLOCK.with(|clock| {
+            let now = clock.raw();
+            (clock.delta(self.0, now), now)
+        });
+        with_local(|local| local.phase_list[phase as usize] += delta);
+        self.0 = now.max(1);
+    }
+}
+
+pub fn gauge(gauge: Gauge, value: usize) {
+    with_local(|local| local.gauge_list[gauge as usize] += value as u64);
+}
+
+/// Deliver samples recorded on current thread.
+pub fn flush() {
+    LOCAL.with(|local| local.borrow_mut().take());
+}
+
+struct GaugeDisplay<'a>(&'static str, &'a Histogram<u64>);
+impl Display for GaugeDisplay<'_> {
+    fn fmt(&self, f: &mut Formatter<'_>) -> fmt::Result {
+        write!(
+            f,
+            "{}: mean {:.1} p99 {} max {} in total of {} samples",
+            self.0,
+            self.1.mean(),
+            self.1.value_at_quantile(0.99),
+            self.1.max(),
+            self.1.len()
+        )
+    }
+}
+
+/// Print per-phase histograms and gauges, if tracing is enabled.
+pub fn print() {
+    if SAMPLE_INTERVAL.load(Ordering::Relaxed) == 0 {
+        return;
+    }
+    flush();
+    let mut tracer = TRACER.lock().unwrap();
+    // recorders of threads that are still alive and never flush are skipped
+    let timeout = Duration::from_millis(100);
+    for phase in &mut tracer.phase_list {
+        phase.refresh_timeout(timeout);
+        println!("{}", phase);
+    }
+    for (name, gauge) in Gauge::NAME_LIST.iter().zip(&mut tracer.gauge_list) {
+        gauge.refresh_timeout(timeout);
+        println!("{}", GaugeDisplay(*name, gauge));
+    }
+}
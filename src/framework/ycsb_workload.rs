@@ -17,7 +17,7 @@ use rand::{
 use tracing::debug;
 
 use crate::{
-    app::ycsb::Op,
+    app::ycsb::{CompactOp, Op},
     common::{serialize, Opaque},
 };
 
@@ -48,6 +48,9 @@ pub struct Property {
     pub data_integrity: bool,
     pub do_transaction: bool,
     pub operation_count: usize,
+    // encode ops in `CompactOp`, which requires default table, key and field
+    // naming
+    pub compact_op: bool,
 }
 
 impl Default for Property {
@@ -78,6 +81,7 @@ impl Default for Property {
             data_integrity: false,
             do_transaction: true,
             operation_count: 0,
+            compact_op: false,
         }
     }
 }
@@ -115,6 +119,7 @@ impl Property {
             "recordcount" => self.record_count = value.parse().unwrap(),
             "dataintegrity" => self.data_integrity = value.parse().unwrap(),
             "operationcount" => self.operation_count = value.parse().unwrap(),
+            "oskr.compactop" => self.compact_op = value.parse().unwrap(),
             _ => unreachable!(),
         }
     }
@@ -228,7 +233,8 @@ impl AcknowledgedCounterGenerator {
 //   YCSB version
 // * it has no support to adjust item count, and closure cannot be the interface
 //   anyway
-struct ZipfianGenerator {
+// public only for benchmarking
+pub struct ZipfianGenerator {
     item_count: u64,
     base: u64,
     alpha: f64,
@@ -243,7 +249,7 @@ struct ZipfianGenerator {
 
 impl ZipfianGenerator {
     const SCRAMBLED_ITEM_COUNT: u64 = 10000000000;
-    fn new(min: u64, max: u64) -> Self {
+    pub fn new(min: u64, max: u64) -> Self {
         let item_count = max - min;
         let zipfian_constant = 0.99;
         let theta = zipfian_constant;
@@ -280,11 +286,11 @@ impl ZipfianGenerator {
         sum
     }
 
-    fn next_value(&mut self) -> u64 {
+    pub fn next_value(&mut self) -> u64 {
         self.next_long(self.item_count)
     }
 
-    fn next_long(&mut self, item_count: u64) -> u64 {
+    pub fn next_long(&mut self, item_count: u64) -> u64 {
         if item_count != self.count_for_zeta {
             // YCSB's zeta method is too OOP so I use zeta_static instead
             if item_count > self.count_for_zeta {
@@ -343,10 +349,16 @@ impl Workload {
         }
     }
 
-    fn build_key_name(mut key_number: u64, zero_padding: usize, order: Order) -> String {
+    fn build_key_number(key_number: u64, order: Order) -> u64 {
         if order == Order::Hashed {
-            key_number = Self::fnvhash64(key_number);
+            Self::fnvhash64(key_number)
+        } else {
+            key_number
         }
+    }
+
+    fn build_key_name(key_number: u64, zero_padding: usize, order: Order) -> String {
+        let key_number = Self::build_key_number(key_number, order);
         format!("user{key_number:0zero_padding$}")
     }
 
@@ -431,36 +443,49 @@ impl Workload {
         }
     }
 
-    fn build_single_value(&self, key: &str) -> HashMap<String, Opaque> {
-        let mut value_table = HashMap::new();
-        let field = (self.field_chooser)();
-        let field = self.field_name_list[field].clone();
-        let value = if self.property.data_integrity {
-            self.build_deterministic_value(key, &field)
+    fn build_value(&self, key: &str, field: &str) -> Opaque {
+        if self.property.data_integrity {
+            self.build_deterministic_value(key, field)
         } else {
             let field_length = (self.field_length_generator)();
             let mut rng = thread_rng();
             repeat_with(|| rng.gen()).take(field_length).collect()
-        };
+        }
+    }
+
+    fn build_single_value(&self, key: &str) -> HashMap<String, Opaque> {
+        let mut value_table = HashMap::new();
+        let field = (self.field_chooser)();
+        let field = self.field_name_list[field].clone();
+        let value = self.build_value(key, &field);
         value_table.insert(field, value);
         value_table
     }
 
     fn build_value_table(&self, key: &str) -> HashMap<String, Opaque> {
         let mut value_table = HashMap::new();
-        for field in self.field_name_list.clone() {
-            let value = if self.property.data_integrity {
-                self.build_deterministic_value(key, &field)
-            } else {
-                let field_length = (self.field_length_generator)();
-                let mut rng = thread_rng();
-                repeat_with(|| rng.gen()).take(field_length).collect()
-            };
-            value_table.insert(field, value);
+        for field in &self.field_name_list {
+            value_table.insert(field.clone(), self.build_value(key, field));
         }
         value_table
     }
 
+    // compact counterpart of `build_single_value` and `build_value_table`
+    fn build_compact_value(&self, key: &str, all_field: bool) -> (u64, Vec<Opaque>) {
+        let index_list = if all_field {
+            (0..self.field_name_list.len()).collect()
+        } else {
+            vec![(self.field_chooser)()]
+        };
+        (
+            CompactOp::field_mask(index_list.iter().copied()),
+            index_list
+                .into_iter()
+                .map(|index| self.build_value(key, &self.field_name_list[index]))
+                .collect(),
+        )
+    }
+
     fn build_deterministic_value(&self, key: &str, field: &str) -> Opaque {
         let field_length = (self.field_length_generator)();
         let mut value = format!("{key}:{field}").as_bytes().to_vec();
@@ -477,11 +502,22 @@ impl Workload {
             )
         }
         value.truncate(field_length);
-        value
+        value.into()
+    }
+
+    fn build_op(op: Op) -> Opaque {
+        let mut buffer = Vec::new();
+        serialize(op)(&mut buffer);
+        buffer.into()
     }
 
     pub fn new(mut property: Property) -> Self {
         assert_ne!(property.record_count, 0);
+        if property.compact_op {
+            assert_eq!(property.table, CompactOp::TABLE);
+            assert_eq!(property.zero_padding, 1);
+            assert!(property.field_count <= 64);
+        }
         if property.do_transaction {
             // i didn't read this, but infer it from usage
             assert_eq!(property.insert_start, 0);
@@ -564,10 +600,17 @@ impl Workload {
 
     pub fn one_op(&self) -> (OpKind, Box<dyn FnOnce(&Self) + Send>) {
         if !self.property.do_transaction {
+            if self.property.compact_op {
+                let key_number = (self.key_sequence)();
+                assert!(key_number < self.property.insert_start + self.property.insert_count);
+                let key = Self::build_key_number(key_number, self.property.insert_order);
+                let (mask, value_list) = self.build_compact_value(&CompactOp::key_name(key), true);
+                let op = Self::build_op(Op::Compact(CompactOp::Insert(key, mask, value_list)));
+                return (OpKind::Insert(op), Box::new(|_| {}));
+            }
             let (key, value_table) = self.next_insert_entry();
-            let mut buffer = Opaque::new();
-            serialize(Op::Insert(self.property.table.clone(), key, value_table))(&mut buffer);
-            return (OpKind::Insert(buffer), Box::new(|_| {}));
+            let op = Self::build_op(Op::Insert(self.property.table.clone(), key, value_table));
+            return (OpKind::Insert(op), Box::new(|_| {}));
         }
 
         let mut op_kind = (self.operation_chooser)();
@@ -576,6 +619,24 @@ impl Workload {
         } else {
             self.transaction_insert_key_sequence.next_value()
         };
+        if self.property.compact_op {
+            self.fill_compact_op(&mut op_kind, key_number);
+        } else {
+            self.fill_op(&mut op_kind, key_number);
+        }
+        let post_action: Box<dyn FnOnce(&Self) + Send> = if matches!(op_kind, OpKind::Insert(_)) {
+            Box::new(move |context| {
+                context
+                    .transaction_insert_key_sequence
+                    .acknowledge(key_number)
+            })
+        } else {
+            Box::new(|_| {})
+        };
+        (op_kind, post_action)
+    }
+
+    fn fill_op(&self, op_kind: &mut OpKind, key_number: u64) {
         let key = Self::build_key_name(
             key_number,
             self.property.zero_padding,
@@ -594,32 +655,57 @@ impl Workload {
         };
         let table = self.property.table.clone();
 
-        let mut post_action: Box<dyn FnOnce(&Self) + Send> = Box::new(|_| {});
-        match &mut op_kind {
+        match op_kind {
             OpKind::Read(op) => {
-                serialize(Op::Read(table, key, field_set))(op);
+                *op = Self::build_op(Op::Read(table, key, field_set));
                 // TODO data integrity
             }
             OpKind::ReadModifyWrite(read_op, update_op) => {
-                serialize(Op::Read(table.clone(), key.clone(), field_set))(read_op);
-                serialize(Op::Update(table, key, value_table))(update_op);
+                *read_op = Self::build_op(Op::Read(table.clone(), key.clone(), field_set));
+                *update_op = Self::build_op(Op::Update(table, key, value_table));
             }
             OpKind::Scan(op) => {
                 let len = (self.scan_length)();
-                serialize(Op::Scan(table, key, len, field_set))(op);
+                *op = Self::build_op(Op::Scan(table, key, len, field_set));
             }
             OpKind::Update(op) => {
-                serialize(Op::Update(table, key, value_table))(op);
+                *op = Self::build_op(Op::Update(table, key, value_table));
             }
             OpKind::Insert(op) => {
-                serialize(Op::Insert(table, key, value_table))(op);
-                post_action = Box::new(move |context| {
-                    context
-                        .transaction_insert_key_sequence
-                        .acknowledge(key_number)
-                });
+                *op = Self::build_op(Op::Insert(table, key, value_table));
+            }
+        }
+    }
+
+    fn fill_compact_op(&self, op_kind: &mut OpKind, key_number: u64) {
+        let key = Self::build_key_number(key_number, self.property.insert_order);
+        let key_name = CompactOp::key_name(key);
+        let field_mask = if !self.property.read_all_field {
+            1u64 << (self.field_chooser)()
+        } else {
+            0
+        };
+        let (value_mask, value_list) =
+            self.build_compact_value(&key_name, self.property.write_all_field);
+        let build_op = |op| Self::build_op(Op::Compact(op));
+        match op_kind {
+            OpKind::Read(op) => {
+                *op = build_op(CompactOp::Read(key, field_mask));
+            }
+            OpKind::ReadModifyWrite(read_op, update_op) => {
+                *read_op = build_op(CompactOp::Read(key, field_mask));
+                *update_op = build_op(CompactOp::Update(key, value_mask, value_list));
+            }
+            OpKind::Scan(op) => {
+                let len = (self.scan_length)();
+                *op = build_op(CompactOp::Scan(key, len, field_mask));
+            }
+            OpKind::Update(op) => {
+                *op = build_op(CompactOp::Update(key, value_mask, value_list));
+            }
+            OpKind::Insert(op) => {
+                *op = build_op(CompactOp::Insert(key, value_mask, value_list));
             }
         }
-        (op_kind, post_action)
     }
 }
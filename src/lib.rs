@@ -365,7 +365,10 @@ pub mod framework {
     /// library, especially for multithreaded usage.
     pub mod latency;
     pub mod memory_database;
+    pub mod metrics;
     pub mod sqlite;
+    pub mod timer_wheel;
+    pub mod trace;
     #[cfg(any(feature = "tokio", test))]
     pub mod tokio;
     pub mod ycsb_workload;
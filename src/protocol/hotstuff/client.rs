@@ -13,9 +13,10 @@ use tracing::{debug, warn};
 
 use crate::{
     common::{
-        deserialize, generate_id, serialize, ClientId, Config, Opaque, RequestNumber, SignedMessage,
+        deserialize, generate_id, serialize, ClientId, Config, Opaque, PendingTable, RequestNumber,
+        SignedMessage,
     },
-    facade::{AsyncEcosystem, Invoke, Receiver, Transport, TxAgent},
+    facade::{AsyncEcosystem, Invoke, Pipeline, Receiver, Transport, TxAgent},
     protocol::hotstuff::message::{self, ToReplica},
 };
 
@@ -28,6 +29,7 @@ pub struct Client<T: Transport, E> {
     _executor: PhantomData<E>,
 
     request_number: RequestNumber,
+    pending_table: PendingTable<message::Request>,
 }
 
 impl<T: Transport, E> Receiver<T> for Client<T, E> {
@@ -46,6 +48,7 @@ impl<T: Transport, E> Client<T, E> {
             transport: transport.tx_agent(),
             rx,
             request_number: 0,
+            pending_table: PendingTable::default(),
             _executor: PhantomData,
         };
         transport.register(&client, move |remote, buffer| {
@@ -118,3 +121,54 @@ where
         }
     }
 }
+
+#[async_trait]
+impl<T: Transport, E: AsyncEcosystem<Opaque>> Pipeline for Client<T, E>
+where
+    Self: Send + Sync,
+    E: Send + Sync,
+{
+    fn submit(&mut self, op: Opaque) -> RequestNumber {
+        self.request_number += 1;
+        let request = self
+            .pending_table
+            .insert(self.request_number, |lane| message::Request {
+                op,
+                request_number: self.request_number,
+                client_id: lane,
+            });
+        self.transport.send_message_to_all(
+            self,
+            self.config.replica(..),
+            serialize(ToReplica::Request(request)),
+        );
+        self.request_number
+    }
+
+    async fn complete(&mut self) -> (RequestNumber, Opaque) {
+        loop {
+            select! {
+                recv = self.rx.next() => {
+                    let (_remote, buffer) = recv.unwrap();
+                    let reply: SignedMessage<message::Reply> = deserialize(buffer.as_ref()).unwrap();
+                    let reply = reply.assume_verified();
+                    if self.pending_table.receive(reply.request_number, reply.replica_id, &reply.result, self.config.f + 1) {
+                        return (reply.request_number, reply.result);
+                    }
+                }
+                _ = E::sleep_until(self.pending_table.timeout()).fuse() => {
+                    // request is broadcast in the first place, so every
+                    // resending is unexpected
+                    for (request, _) in self.pending_table.expired() {
+                        warn!("resend for request number {}", request.request_number);
+                        self.transport.send_message_to_all(
+                            self,
+                            self.config.replica(..),
+                            serialize(ToReplica::Request(request)),
+                        );
+                    }
+                }
+            }
+        }
+    }
+}
@@ -1,11 +1,13 @@
+use std::collections::HashSet;
+
 use bincode::Options;
 use lazy_static::lazy_static;
 use serde_derive::{Deserialize, Serialize};
 use sha2::{Digest as _, Sha256};
 
 use crate::common::{
-    signed::InauthenticMessage, ClientId, Digest, OpNumber, Opaque, ReplicaId, RequestNumber,
-    SignedMessage, VerifyingKey, ViewNumber,
+    signed::InauthenticMessage, AggregatedMessage, ClientId, Digest, OpNumber, Opaque, ReplicaId,
+    RequestNumber, SignedMessage, VerifyingKey, ViewNumber,
 };
 
 // HotStuff paper omit much implementation details, maybe too much.
@@ -17,8 +19,9 @@ use crate::common::{
 // * Generic message carry full node, and the `node` in VoteGeneric and QC is
 //   represented as node's digest, because we assume the receiver probably get
 //   the node content already.
-// * Add replica id field to VoteGeneric so we can count the number of
-//   deduplicated votes.
+// * Votes are deduplicated by voter's replica id, which is derived from the
+//   verified sender address instead of carried in VoteGeneric, so votes of
+//   different voters have identical content and can be aggregated.
 //
 //   In original HotStuff paper leader collect all votes with different (view
 //   number, partial signature) pair, without checking voter. This is obviously
@@ -32,8 +35,9 @@ use crate::common::{
 //   match current view number, or the message is ignored from ingress. This is
 //   not necessary safe and also could break liveness, but it's the best I can
 //   do.
-// * Define QC as a vector of signed message and simulate threshold signature
-//   by verifying them in sequence.
+// * Define QC as either a vector of signed message which simulates threshold
+//   signature by verifying them in sequence, or one aggregated BLS signature
+//   with the list of signers when replicas use BLS keys.
 //
 //   Rust community does not provide us many production-ready threshold
 //   signature libraries which is well-known to be suitable here (neither C++
@@ -42,6 +46,11 @@ use crate::common::{
 //
 //   Additionally, libhotstuff do the simulation as well, so it is ok to
 //   evaluate with this.
+// * Add NewView message for pacemaker, which carries sender's highest QC to
+//   the leader of next view. It is signed so a faulty client cannot jump views.
+//   Generic is still not signed, so a replica only accepts it from the primary
+//   of its view, and only follows its view when that is right after the view
+//   of its verified justify.
 
 #[derive(Debug, Clone, Serialize, Deserialize)]
 pub enum ToReplica {
@@ -52,6 +61,7 @@ pub enum ToReplica {
     // QC proposes
     Generic(Generic),
     VoteGeneric(SignedMessage<VoteGeneric>),
+    NewView(SignedMessage<NewView>),
 }
 
 #[derive(Debug, Clone, Serialize, Deserialize)]
@@ -71,6 +81,12 @@ pub struct Generic {
 pub struct VoteGeneric {
     pub view_number: ViewNumber,
     pub node: Digest,
+}
+
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct NewView {
+    pub view_number: ViewNumber,
+    pub justify: QuorumCertification,
     pub replica_id: ReplicaId,
 }
 
@@ -117,15 +133,29 @@ impl GenericNode {
 pub struct QuorumCertification {
     pub view_number: ViewNumber,
     pub node: Digest,
-    pub signature: Vec<(ReplicaId, SignedMessage<VoteGeneric>)>,
+    pub signature: QuorumSignature,
+}
+
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub enum QuorumSignature {
+    Individual(Vec<(ReplicaId, SignedMessage<VoteGeneric>)>),
+    Aggregated(Vec<ReplicaId>, AggregatedMessage<VoteGeneric>),
+}
+
+impl Default for QuorumSignature {
+    fn default() -> Self {
+        Self::Individual(Vec::new())
+    }
 }
 
 impl QuorumCertification {
+    /// `verifying_key` returns `None` for replica id that is out of range,
+    /// which fails the verification.
     pub fn verify<'a>(
         &'a self,
         // will be replaced with one single public key when threshold signature
         // is deployed
-        verifying_key: impl Fn(ReplicaId) -> &'a VerifyingKey,
+        verifying_key: impl Fn(ReplicaId) -> Option<&'a VerifyingKey>,
         threshold: usize,
     ) -> Result<(), InauthenticMessage> {
         assert!(threshold > 0);
@@ -133,18 +163,44 @@ impl QuorumCertification {
             return Ok(());
         }
 
-        if self.signature.len() < threshold {
+        let signer_list: Vec<_> = match &self.signature {
+            QuorumSignature::Individual(signature) => {
+                signature.iter().map(|(replica, _)| *replica).collect()
+            }
+            QuorumSignature::Aggregated(signer_list, _) => signer_list.clone(),
+        };
+        // a signer counts once in either form
+        let mut signer_set = HashSet::new();
+        if !signer_list.iter().all(|signer| signer_set.insert(*signer))
+            || signer_set.len() < threshold
+        {
             return Err(InauthenticMessage);
         }
+        let key_list = signer_list
+            .into_iter()
+            .map(|signer| verifying_key(signer).ok_or(InauthenticMessage))
+            .collect::<Result<Vec<_>, _>>()?;
 
-        for (replica, vote) in self.signature.iter().cloned() {
-            if let Ok(verified) = vote.verify(verifying_key(replica)) {
-                if verified.view_number != self.view_number || verified.node != self.node {
-                    return Err(InauthenticMessage); // more strict than necessary, but simpler
+        match &self.signature {
+            QuorumSignature::Individual(signature) => {
+                let verified_list = SignedMessage::verify_batch(
+                    signature.iter().map(|(_, vote)| vote.clone()).zip(key_list),
+                )?;
+                for verified in verified_list {
+                    self.check_vote(&verified)?;
                 }
-            } else {
-                return Err(InauthenticMessage);
             }
+            QuorumSignature::Aggregated(_, aggregated) => {
+                let vote = aggregated.verify(key_list)?;
+                self.check_vote(&vote)?;
+            }
+        }
+        Ok(())
+    }
+
+    fn check_vote(&self, vote: &VoteGeneric) -> Result<(), InauthenticMessage> {
+        if vote.view_number != self.view_number || vote.node != self.node {
+            return Err(InauthenticMessage); // more strict than necessary, but simpler
         }
         Ok(())
     }
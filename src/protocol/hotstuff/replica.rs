@@ -1,14 +1,24 @@
-use std::{borrow::Borrow, collections::HashMap, ops::Index, sync::Arc};
+use std::{
+    borrow::Borrow,
+    collections::{HashMap, HashSet},
+    mem::{replace, take},
+    ops::Index,
+    sync::Arc,
+    time::{Duration, Instant},
+};
 
+use futures::Future;
 use tracing::{debug, trace, warn};
 
 use crate::{
     common::{
-        deserialize, serialize, signed::VerifiedMessage, ClientId, Config, Digest, OpNumber,
-        ReplicaId, RequestNumber, SignedMessage, ViewNumber,
+        deserialize_shared, serialize, signed::VerifiedMessage, AggregatedMessage, ClientId,
+        Config, Digest, OpNumber, Opaque, ReplicaId, RequestNumber, SignedMessage, ViewNumber,
+    },
+    facade::{App, AsyncEcosystem, Receiver, Transport, TxAgent},
+    protocol::hotstuff::message::{
+        self, GenericNode, QuorumCertification, QuorumSignature, ToReplica, GENESIS,
     },
-    facade::{App, Receiver, Transport, TxAgent},
-    protocol::hotstuff::message::{self, GenericNode, QuorumCertification, ToReplica, GENESIS},
     stage::{Handle, State, StatefulContext, StatelessContext},
 };
 
@@ -30,6 +40,19 @@ use crate::{
 //   drive non-empty blocks which is not committed yet to progress. In normal
 //   configuration these blocks will not reach commit point until enough number
 //   of following client requests be proposed.
+// With leader rotation on, every QC ends a view: votes of view v are sent to
+// the leader of view v + 1, who forms the QC and proposes the next block with
+// it, so there is one proposal and one decided block per round once the
+// pipeline is filled. Without rotation votes go back to the proposing leader,
+// and view only changes on pacemaker timeout.
+// The pacemaker timer runs in an async ecosystem and only ticks the replica.
+// A replica that sees no progress during a whole tick while having pending
+// requests moves to next view and sends its highest QC to the new leader.
+// The new leader proposes upon the first new view message instead of waiting
+// for n - f of them, which may let it propose on top of a stale QC, but that
+// only costs liveness and the next timeout fixes it.
+// All replicas buffer client requests (clients broadcast them), so the next
+// leader has them, and buffered requests are removed when proposed by others.
 
 pub struct Replica<T: Transport> {
     address: T::Address,
@@ -38,13 +61,22 @@ pub struct Replica<T: Transport> {
     id: ReplicaId,
     batch_size: usize,
     adaptive_batching: bool,
+    rotate_leader: bool,
 
     // although not present in event-driven HotStuff, current view must be kept,
     // so we have something to fill message field
     // the paper really didn't tell when to update, so probably in pacemaker, i
     // guess
     current_view: ViewNumber,
-    vote_table: HashMap<Digest, HashMap<ReplicaId, SignedMessage<message::VoteGeneric>>>,
+    // votes of a node are counted in the view of the first received one
+    vote_table: HashMap<
+        Digest,
+        (
+            ViewNumber,
+            HashMap<ReplicaId, SignedMessage<message::VoteGeneric>>,
+        ),
+    >,
+    orphan_vote: HashSet<Digest>,
     voted_height: OpNumber,
     block_locked: Digest,
     block_executed: Digest,
@@ -52,6 +84,8 @@ pub struct Replica<T: Transport> {
     qc_high: QuorumCertification,
     block_leaf: Digest,
     will_beat: bool,
+    beat_view: Option<ViewNumber>, // last view of entering as leader on new view
+    progress: bool,                // since last pacemaker tick
 
     client_table: HashMap<ClientId, (RequestNumber, Option<SignedMessage<message::Reply>>)>,
     log: HashMap<Digest, GenericNode>,
@@ -94,8 +128,32 @@ impl<T: Transport> Replica<T> {
             }
         }
 
+        if !block.command.is_empty() {
+            let client_table = &self.client_table;
+            self.request_buffer.retain(|request| {
+                client_table
+                    .get(&request.client_id)
+                    .map(|(request_number, _)| *request_number < request.request_number)
+                    .unwrap_or(true)
+            });
+        }
         self.log.insert(digest, block);
     }
+
+    fn has_uncommitted(&self) -> bool {
+        let executed_height = self[self.block_executed].height;
+        let mut block = self.block_leaf;
+        while let Some(node) = self.log.get(&block) {
+            if node.height <= executed_height {
+                return false;
+            }
+            if !node.command.is_empty() {
+                return true;
+            }
+            block = node.parent;
+        }
+        false
+    }
 }
 
 impl<D: Borrow<Digest>, T: Transport> Index<D> for Replica<T> {
@@ -146,14 +204,18 @@ impl<T: Transport> Replica<T> {
             id: replica_id,
             batch_size,
             adaptive_batching,
+            rotate_leader: false,
             current_view: 0,
             vote_table: HashMap::new(),
+            orphan_vote: HashSet::new(),
             voted_height: 0,
             block_locked: GENESIS.justify.node,
             block_executed: GENESIS.justify.node,
             block_leaf: GENESIS.justify.node,
             qc_high: GENESIS.justify.clone(),
             will_beat: true,
+            beat_view: None,
+            progress: false,
             client_table: HashMap::new(),
             log,
             request_buffer: Vec::new(),
@@ -176,6 +238,10 @@ impl<T: Transport> Replica<T> {
 
         replica
     }
+
+    pub fn set_rotate_leader(&mut self, rotate_leader: bool) {
+        self.rotate_leader = rotate_leader;
+    }
 }
 
 // "algorithm 4" in HotStuff paper
@@ -200,7 +266,15 @@ impl<T: Transport> StatefulContext<'_, Replica<T>> {
         };
 
         let commit_block1 = self[block1].height > self[self.block_locked].height;
-        let decide_block0 = self[block2].parent == *block1 && self[block1].parent == *block0;
+        // a late or stale QC may justify a chain that is already decided, whose
+        // block0 may have been pruned, and it has nothing left to decide
+        let decide_block0 = self[block2].parent == *block1
+            && self[block1].parent == *block0
+            && self
+                .log
+                .get(block0)
+                .map(|block0| block0.height > self[self.block_executed].height)
+                .unwrap_or(false);
 
         self.update_qc_high(self[block3].justify.clone());
         if commit_block1 {
@@ -217,7 +291,40 @@ impl<T: Transport> StatefulContext<'_, Replica<T>> {
             );
             self.on_commit(block0);
             self.block_executed = *block0;
+            self.prune_log();
+        }
+    }
+
+    // blocks below executed one are not reachable by either safety rule (the
+    // locked block is always higher) or commit rule (which stops at executed
+    // block), so they are pruned along with their votes
+    // executed block itself is kept as the anchor of both rules
+    fn prune_log(&mut self) {
+        let height = self[self.block_executed].height;
+        let pruned: Vec<_> = self
+            .log
+            .iter()
+            .filter(|(_, block)| block.height < height)
+            .map(|(digest, _)| *digest)
+            .collect();
+        for digest in pruned {
+            self.log.remove(&digest);
+            self.vote_table.remove(&digest);
         }
+
+        // votes for unknown block are either late ones for pruned block, or
+        // early ones for block that is not inserted yet, which will be known
+        // soon. so remove the ones that are still unknown on next pruning
+        let previous = replace(&mut self.orphan_vote, HashSet::new());
+        let orphan_vote: HashSet<_> = self
+            .vote_table
+            .keys()
+            .filter(|digest| !self.log.contains_key(*digest))
+            .copied()
+            .collect();
+        self.vote_table
+            .retain(|digest, _| !(previous.contains(digest) && orphan_vote.contains(digest)));
+        self.orphan_vote = orphan_vote;
     }
 
     fn on_commit(&mut self, block: &Digest) {
@@ -232,9 +339,23 @@ impl<T: Transport> StatefulContext<'_, Replica<T>> {
 }
 impl<T: Transport> StatelessContext<Replica<T>> {
     fn on_receive_proposal(&self, message: message::Generic) {
-        let block_new = message.node;
+        let view_number = message.view_number;
+        let mut block_new = message.node;
         let digest = block_new.digest();
+        // kept in log until pruned, so stop pinning receiving buffer
+        for request in &mut block_new.command {
+            request.op = request.op.detach();
+        }
         self.submit.stateful(move |replica| {
+            // follow proposer's view, which is one view ahead on rotation
+            // Generic is not signed, so only the view right after its verified
+            // justify is followed, and a replayed QC cannot carry us further
+            if replica.rotate_leader
+                && view_number > replica.current_view
+                && view_number == block_new.justify.view_number + 1
+            {
+                replica.current_view = view_number;
+            }
             let safe_node = if replica.extend(&block_new, &replica.block_locked) {
                 true
             } else if let Some(node) = replica.log.get(&block_new.justify.node) {
@@ -242,63 +363,99 @@ impl<T: Transport> StatelessContext<Replica<T>> {
             } else {
                 false
             };
-            if block_new.height > replica.voted_height && safe_node {
+            if view_number == replica.current_view
+                && block_new.height > replica.voted_height
+                && safe_node
+            {
                 replica.voted_height = block_new.height;
-                let vote_generic = message::VoteGeneric {
-                    view_number: replica.current_view,
-                    node: digest,
-                    replica_id: replica.id,
-                };
-
-                let primary = replica.get_leader();
-                replica.submit.stateless(move |replica| {
-                    let signed =
-                        SignedMessage::sign(vote_generic, replica.config.signing_key(replica));
-                    replica.transport.send_message(
-                        replica,
-                        replica.config.replica(primary),
-                        serialize(ToReplica::VoteGeneric(signed)),
-                    );
-                });
+                replica.progress = true;
+                replica.send_vote(view_number, digest);
             }
 
             replica.insert_log(digest, block_new);
             replica.update(&digest);
+            // votes may arrive earlier than the proposal on rotation
+            replica.form_qc(digest);
         });
     }
 }
 impl<T: Transport> StatefulContext<'_, Replica<T>> {
-    fn on_receive_vote(&mut self, message: VerifiedMessage<message::VoteGeneric>) {
+    fn on_receive_vote(
+        &mut self,
+        replica_id: ReplicaId,
+        message: VerifiedMessage<message::VoteGeneric>,
+    ) {
         self.insert_vote(
             message.node,
-            message.replica_id,
+            replica_id,
+            message.view_number,
             message.signed_message().clone(),
         );
     }
 
+    fn send_vote(&mut self, view_number: ViewNumber, node: Digest) {
+        let vote_generic = message::VoteGeneric { view_number, node };
+        let (replica_id, leader) = (self.id, self.next_leader(view_number));
+        self.submit.stateless(move |replica| {
+            let signed = SignedMessage::sign(vote_generic, replica.config.signing_key(replica));
+            if leader == replica_id {
+                replica.submit.stateful(move |replica| {
+                    replica.insert_vote(node, replica_id, view_number, signed)
+                });
+            } else {
+                replica.transport.send_message(
+                    replica,
+                    replica.config.replica(leader),
+                    serialize(ToReplica::VoteGeneric(signed)),
+                );
+            }
+        });
+    }
+
     fn insert_vote(
         &mut self,
         node: Digest,
         replica_id: ReplicaId,
+        view_number: ViewNumber,
         vote: SignedMessage<message::VoteGeneric>,
     ) {
-        let quorum = self.vote_table.entry(node).or_default();
+        let (quorum_view, quorum) = self
+            .vote_table
+            .entry(node)
+            .or_insert_with(|| (view_number, HashMap::new()));
+        if *quorum_view != view_number {
+            return;
+        }
         quorum.insert(replica_id, vote);
-        let vote_count = quorum.len();
-        if vote_count >= self.config.replica(..).len() - self.config.f {
-            let qc = QuorumCertification {
-                view_number: self.current_view,
-                node,
-                signature: self
-                    .vote_table
-                    .get(&node)
-                    .unwrap()
-                    .clone()
-                    .into_iter()
-                    .collect(),
-            };
-            self.update_qc_high(qc);
+        self.form_qc(node);
+    }
+
+    fn form_qc(&mut self, node: Digest) {
+        // skip building (and aggregating) QC which cannot update qc_high
+        match self.log.get(&node) {
+            Some(block) if block.height > self[&self.qc_high.node].height => {}
+            _ => return,
         }
+        let qc = if let Some((view_number, quorum)) = self.vote_table.get(&node) {
+            if quorum.len() < self.config.replica(..).len() - self.config.f {
+                return;
+            }
+            // aggregate if every vote is BLS signed
+            let signature = if let Some(aggregated) = AggregatedMessage::aggregate(quorum.values())
+            {
+                QuorumSignature::Aggregated(quorum.keys().copied().collect(), aggregated)
+            } else {
+                QuorumSignature::Individual(quorum.clone().into_iter().collect())
+            };
+            QuorumCertification {
+                view_number: *view_number,
+                node,
+                signature,
+            }
+        } else {
+            return;
+        };
+        self.update_qc_high(qc);
     }
 
     // b_leaf and qc_high are read from state
@@ -310,9 +467,11 @@ impl<T: Transport> StatefulContext<'_, Replica<T>> {
     ) {
         let block_leaf = self.block_leaf;
         let qc_high = self.qc_high.clone();
-        let height = self[&self.block_leaf].height + 1;
+        // after a new view the leaf may be lower than what replicas (including
+        // self) have voted for, and a block of the same height would never be
+        // voted, so skip the height
+        let height = self[&self.block_leaf].height.max(self.voted_height) + 1;
         let view_number = self.current_view;
-        let replica_id = self.id;
         self.submit.stateless(move |replica| {
             let block_new = GenericNode::create_leaf(&block_leaf, command, qc_high, height);
             let generic = message::Generic {
@@ -326,15 +485,6 @@ impl<T: Transport> StatefulContext<'_, Replica<T>> {
             );
 
             let digest = block_new.digest();
-            let vote_generic = SignedMessage::sign(
-                message::VoteGeneric {
-                    view_number,
-                    node: digest,
-                    replica_id,
-                },
-                replica.config.signing_key(replica),
-            );
-
             replica.submit.stateful(move |replica| {
                 replica.insert_log(digest, block_new);
                 k(replica, digest);
@@ -342,7 +492,11 @@ impl<T: Transport> StatefulContext<'_, Replica<T>> {
                 // propose locally
                 replica.update(&digest);
                 // vote locally
-                replica.insert_vote(digest, replica.id, vote_generic);
+                if height > replica.voted_height {
+                    replica.voted_height = height;
+                    replica.progress = true;
+                    replica.send_vote(view_number, digest);
+                }
             });
         });
     }
@@ -353,35 +507,48 @@ impl<T: Transport> StatefulContext<'_, Replica<T>> {
         self.config.view_primary(self.current_view)
     }
 
+    // the one who collects votes of view number
+    fn next_leader(&self, view_number: ViewNumber) -> ReplicaId {
+        if self.rotate_leader {
+            self.config.view_primary(view_number + 1)
+        } else {
+            self.config.view_primary(view_number)
+        }
+    }
+
     fn update_qc_high(&mut self, qc_high1: QuorumCertification) {
-        if self[&qc_high1.node].height > self[&self.qc_high.node].height {
+        let height = if let Some(node) = self.log.get(&qc_high1.node) {
+            node.height
+        } else {
+            // late QC for pruned block, cannot be higher anyway
+            return;
+        };
+        if height > self[&self.qc_high.node].height {
             self.block_leaf = qc_high1.node;
             self.qc_high = qc_high1;
-
-            let on_beat = if !self.adaptive_batching {
-                self.request_buffer.len() >= self.batch_size
-            } else if !self.request_buffer.is_empty() {
-                true
-            } else {
-                let mut not_committed = self.block_leaf;
-                loop {
-                    if not_committed == self.block_executed {
-                        break false;
-                    }
-                    if !self[not_committed].command.is_empty() {
-                        break true;
-                    }
-                    not_committed = self[not_committed].parent;
-                }
-            };
-            if on_beat {
-                let command = ..self.batch_size.min(self.request_buffer.len());
-                let command = self.request_buffer.drain(command).collect();
-                self.on_beat(command);
-            } else {
-                debug!("skip beat");
-                self.will_beat = true;
+            if self.rotate_leader && self.qc_high.view_number + 1 > self.current_view {
+                self.current_view = self.qc_high.view_number + 1;
             }
+            self.try_beat();
+        }
+    }
+
+    fn try_beat(&mut self) {
+        if self.get_leader() != self.id {
+            return;
+        }
+        let on_beat = if !self.adaptive_batching {
+            self.request_buffer.len() >= self.batch_size
+        } else {
+            !self.request_buffer.is_empty() || self.has_uncommitted()
+        };
+        if on_beat {
+            let command = ..self.batch_size.min(self.request_buffer.len());
+            let command = self.request_buffer.drain(command).collect();
+            self.on_beat(command);
+        } else {
+            debug!("skip beat");
+            self.will_beat = true;
         }
     }
 
@@ -395,23 +562,87 @@ impl<T: Transport> StatefulContext<'_, Replica<T>> {
         self.will_beat = false;
     }
 
-    // TODO new view
+    fn on_pacemaker(&mut self) {
+        if replace(&mut self.progress, false)
+            || (self.request_buffer.is_empty() && !self.has_uncommitted())
+        {
+            return;
+        }
+
+        self.current_view += 1;
+        warn!("pacemaker timeout, enter view {}", self.current_view);
+        let new_view = message::NewView {
+            view_number: self.current_view,
+            justify: self.qc_high.clone(),
+            replica_id: self.id,
+        };
+        let leader = self.get_leader();
+        if leader == self.id {
+            self.on_new_view(new_view);
+            return;
+        }
+        self.submit.stateless(move |replica| {
+            let signed = SignedMessage::sign(new_view, replica.config.signing_key(replica));
+            replica.transport.send_message(
+                replica,
+                replica.config.replica(leader),
+                serialize(ToReplica::NewView(signed)),
+            );
+        });
+    }
+
+    fn on_new_view(&mut self, message: message::NewView) {
+        if message.view_number < self.current_view || self.beat_view == Some(message.view_number) {
+            return;
+        }
+        self.current_view = message.view_number;
+        if self.get_leader() != self.id {
+            return;
+        }
+        self.beat_view = Some(message.view_number);
+        self.update_qc_high(message.justify);
+        // extend the highest QC no matter whether it was updated just now
+        self.block_leaf = self.qc_high.node;
+        self.try_beat();
+    }
+
+    /// Pacemaker timer loop, which should be spawned into async ecosystem `E`
+    /// and kept running along with replica. A new view is started if no
+    /// progress is made in a whole `interval` while having pending requests.
+    pub fn pacemaker<E: AsyncEcosystem<()> + 'static>(
+        &self,
+        interval: Duration,
+    ) -> impl Future<Output = ()> + Send + 'static {
+        let submit = self.submit.clone();
+        async move {
+            loop {
+                E::sleep_until(Instant::now() + interval).await;
+                submit.stateful(|replica| replica.on_pacemaker());
+            }
+        }
+    }
 }
 
 // the other thing to support
 impl<T: Transport> StatelessContext<Replica<T>> {
     fn receive_buffer(&self, remote: T::Address, buffer: T::RxBuffer) {
-        match deserialize(buffer.as_ref()) {
+        match deserialize_shared(&Opaque::share(buffer)) {
             Ok(ToReplica::Request(request)) => {
                 self.submit
                     .stateful(move |replica| replica.handle_request(remote, request));
                 return;
             }
             Ok(ToReplica::Generic(generic)) => {
-                let verifying_key = |replica| {
+                let primary = self.config.view_primary(generic.view_number);
+                if *self.config.replica(primary) != remote {
+                    warn!("generic not from view primary");
+                    return;
+                }
+                let verifying_key = |replica: ReplicaId| {
                     self.config
-                        .verifying_key(self.config.replica(replica))
-                        .unwrap() // all replica id should have a key
+                        .replica(..)
+                        .get(replica as usize)
+                        .and_then(|replica| self.config.verifying_key(replica))
                 };
                 let threshold = self.config.replica(..).len() - self.config.f;
                 if generic
@@ -435,10 +666,19 @@ impl<T: Transport> StatelessContext<Replica<T>> {
                     warn!("no remote identity");
                     return;
                 };
+                // has verifying key so must be a replica
+                let replica_id = self
+                    .config
+                    .replica(..)
+                    .iter()
+                    .position(|replica| *replica == remote)
+                    .unwrap() as ReplicaId;
                 if let Ok(verified) = vote_generic.verify(verifying_key) {
                     self.submit.stateful(move |replica| {
-                        if verified.view_number == replica.current_view {
-                            replica.on_receive_vote(verified);
+                        if replica.next_leader(verified.view_number) == replica.id
+                            && verified.view_number + 1 >= replica.current_view
+                        {
+                            replica.on_receive_vote(replica_id, verified);
                         }
                     });
                 } else {
@@ -446,6 +686,36 @@ impl<T: Transport> StatelessContext<Replica<T>> {
                 }
                 return;
             }
+            Ok(ToReplica::NewView(new_view)) => {
+                let verifying_key = if let Some(verifying_key) = self.config.verifying_key(&remote)
+                {
+                    verifying_key
+                } else {
+                    warn!("no remote identity");
+                    return;
+                };
+                let verified = if let Ok(verified) = new_view.verify(verifying_key) {
+                    verified
+                } else {
+                    warn!("failed to verify new view");
+                    return;
+                };
+                let verifying_key = |replica: ReplicaId| {
+                    self.config
+                        .replica(..)
+                        .get(replica as usize)
+                        .and_then(|replica| self.config.verifying_key(replica))
+                };
+                let threshold = self.config.replica(..).len() - self.config.f;
+                if verified.justify.verify(verifying_key, threshold).is_err() {
+                    warn!("failed to verify new view justify");
+                    return;
+                }
+                let new_view = (*verified).clone();
+                self.submit
+                    .stateful(move |replica| replica.on_new_view(new_view));
+                return;
+            }
             _ => {}
         }
         warn!("failed to deserialize");
@@ -468,13 +738,15 @@ impl<T: Transport> StatefulContext<'_, Replica<T>> {
             }
         }
 
-        if self.get_leader() != self.id {
-            return;
-        }
-
+        // same as proposal, buffered requests should not pin receiving buffer
+        let message = message::Request {
+            op: message.op.detach(),
+            ..message
+        };
         self.request_buffer.push(message);
 
-        if self.will_beat
+        if self.get_leader() == self.id
+            && self.will_beat
             && (self.adaptive_batching || self.request_buffer.len() >= self.batch_size)
         {
             let command = ..self.batch_size.min(self.request_buffer.len());
@@ -484,7 +756,10 @@ impl<T: Transport> StatefulContext<'_, Replica<T>> {
     }
 
     fn execute(&mut self, block: &Digest) {
-        for (i, request) in self[block].command.clone().into_iter().enumerate() {
+        // same as PBFT, move command out during execution to lend ops to app
+        let height = self[block].height;
+        let command = take(&mut self.log.get_mut(block).unwrap().command);
+        for (i, request) in command.iter().enumerate() {
             if let Some((request_number, reply)) = self.client_table.get(&request.client_id) {
                 if *request_number > request.request_number
                     || (*request_number == request.request_number && reply.is_some())
@@ -494,8 +769,9 @@ impl<T: Transport> StatefulContext<'_, Replica<T>> {
             }
 
             debug!("execute");
-            let op_number = self[block].height * self.batch_size as OpNumber + i as OpNumber;
-            let result = self.app.execute(op_number, request.op.clone());
+            self.progress = true;
+            let op_number = height * self.batch_size as OpNumber + i as OpNumber;
+            let result = self.app.execute(op_number, &request.op);
             let reply = message::Reply {
                 request_number: request.request_number,
                 result,
@@ -521,5 +797,7 @@ impl<T: Transport> StatefulContext<'_, Replica<T>> {
                 });
             });
         }
+        self.log.get_mut(block).unwrap().command = command;
+        self.app.flush();
     }
 }
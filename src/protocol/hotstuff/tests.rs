@@ -1,13 +1,22 @@
-use std::time::Duration;
+use std::{
+    cell::Cell,
+    panic::{set_hook, take_hook},
+    sync::{Arc, Mutex, Once},
+    time::Duration,
+};
 
 use tokio::{spawn, sync::oneshot, time::timeout};
 
 use crate::{
-    app::mock::App, facade::Invoke, framework::tokio::AsyncEcosystem, simulated::Transport,
+    app::mock::App,
+    common::{deserialize, Opaque},
+    facade::{Invoke, Receiver, Transport as _, TxAgent},
+    framework::tokio::AsyncEcosystem,
+    simulated::{self, Transport},
     tests::TRACING,
 };
 
-use super::{Client, Replica};
+use super::{message::ToReplica, Client, Replica};
 
 #[tokio::test(start_paused = true)]
 async fn single_request() {
@@ -22,7 +31,105 @@ async fn single_request() {
 
     let (stop_tx, stop) = oneshot::channel();
     spawn(async move { transport.deliver_until(stop).await });
-    let request = spawn(async move { client.invoke(b"hello".to_vec()).await });
+    let request = spawn(async move { client.invoke(b"hello".to_vec().into()).await });
+
+    assert_eq!(
+        timeout(Duration::from_millis(1), request)
+            .await
+            .unwrap()
+            .unwrap(),
+        b"reply: hello".to_vec()
+    );
+    stop_tx.send(()).unwrap();
+}
+
+#[tokio::test(start_paused = true)]
+async fn rotate_leader() {
+    *TRACING;
+    let config = Transport::config_builder(4, 1);
+    let mut transport = Transport::new(config());
+
+    for i in 0..4 {
+        let replica = Replica::register_new(config(), &mut transport, i, App::default(), 1, true);
+        replica.with_stateful(|replica| replica.set_rotate_leader(true));
+    }
+    let mut client: Client<_, AsyncEcosystem> = Client::register_new(config(), &mut transport);
+
+    let (stop_tx, stop) = oneshot::channel();
+    spawn(async move { transport.deliver_until(stop).await });
+    let request = spawn(async move {
+        for i in 0..10 {
+            assert_eq!(
+                client.invoke(format!("#{}", i).into()).await,
+                Opaque::from(format!("reply: #{}", i))
+            );
+        }
+    });
+
+    timeout(Duration::from_millis(1), request)
+        .await
+        .unwrap()
+        .unwrap();
+    stop_tx.send(()).unwrap();
+}
+
+#[tokio::test(start_paused = true)]
+async fn pacemaker_skip_faulty_leader() {
+    *TRACING;
+    let config = Transport::config_builder(4, 1);
+    let mut transport = Transport::new(config());
+    // replica 0 is the leader of view 0, and if rotating, of every 4th view
+    transport.insert_filter(0, |source, dest, _, _| {
+        source != "replica-0" && dest != "replica-0"
+    });
+
+    let mut pacemaker_list = Vec::new();
+    for i in 0..4 {
+        let replica = Replica::register_new(config(), &mut transport, i, App::default(), 1, true);
+        replica.with_stateful(|replica| {
+            replica.set_rotate_leader(true);
+            pacemaker_list.push(spawn(
+                replica.pacemaker::<AsyncEcosystem>(Duration::from_millis(10)),
+            ));
+        });
+    }
+    let mut client: Client<_, AsyncEcosystem> = Client::register_new(config(), &mut transport);
+
+    let (stop_tx, stop) = oneshot::channel();
+    spawn(async move { transport.deliver_until(stop).await });
+    let request = spawn(async move { client.invoke(b"hello".to_vec().into()).await });
+
+    assert_eq!(
+        timeout(Duration::from_millis(200), request)
+            .await
+            .unwrap()
+            .unwrap(),
+        b"reply: hello".to_vec()
+    );
+    stop_tx.send(()).unwrap();
+    for pacemaker in pacemaker_list {
+        pacemaker.abort();
+    }
+}
+
+#[tokio::test(start_paused = true)]
+async fn aggregated_qc() {
+    *TRACING;
+    let config = || {
+        let mut config = Transport::config_builder(4, 1)();
+        config.use_bls();
+        config
+    };
+    let mut transport = Transport::new(config());
+
+    for i in 0..4 {
+        Replica::register_new(config(), &mut transport, i, App::default(), 1, true);
+    }
+    let mut client: Client<_, AsyncEcosystem> = Client::register_new(config(), &mut transport);
+
+    let (stop_tx, stop) = oneshot::channel();
+    spawn(async move { transport.deliver_until(stop).await });
+    let request = spawn(async move { client.invoke(b"hello".to_vec().into()).await });
 
     assert_eq!(
         timeout(Duration::from_millis(1), request)
@@ -33,3 +140,110 @@ async fn single_request() {
     );
     stop_tx.send(()).unwrap();
 }
+
+#[tokio::test(start_paused = true)]
+async fn pipelined_client() {
+    *TRACING;
+    let config = Transport::config_builder(4, 1);
+    let mut transport = Transport::new(config());
+
+    for i in 0..4 {
+        Replica::register_new(config(), &mut transport, i, App::default(), 1, true);
+    }
+    let mut client: Client<_, AsyncEcosystem> = Client::register_new(config(), &mut transport);
+
+    let (stop_tx, stop) = oneshot::channel();
+    spawn(async move { transport.deliver_until(stop).await });
+    simulated::pipelined(&mut client, 2, 5).await;
+    stop_tx.send(()).unwrap();
+}
+
+// stage tasks run on spawned tokio tasks, whose panics do not fail the test and
+// have no visible effect when a quorum is left, so record them on the runtime
+// thread instead
+thread_local! {
+    static PANICKED: Cell<bool> = Cell::new(false);
+}
+
+fn record_panic() {
+    static HOOK: Once = Once::new();
+    HOOK.call_once(|| {
+        let default_hook = take_hook();
+        set_hook(Box::new(move |info| {
+            PANICKED.with(|panicked| panicked.set(true));
+            default_hook(info);
+        }));
+    });
+}
+
+struct Replay(String);
+impl Receiver<Transport> for Replay {
+    fn get_address(&self) -> &String {
+        &self.0
+    }
+}
+
+#[tokio::test(start_paused = true)]
+async fn replay_decided_generic() {
+    *TRACING;
+    record_panic();
+    let config = Transport::config_builder(4, 1);
+    let mut transport = Transport::new(config());
+    let generic_list = Arc::new(Mutex::new(Vec::new()));
+    transport.insert_filter(0, {
+        let generic_list = generic_list.clone();
+        move |source, dest, message, _| {
+            if source == "replica-0"
+                && dest == "replica-1"
+                && matches!(deserialize::<ToReplica>(message), Ok(ToReplica::Generic(_)))
+            {
+                generic_list.lock().unwrap().push(message.to_vec());
+            }
+            true
+        }
+    });
+
+    for i in 0..4 {
+        Replica::register_new(config(), &mut transport, i, App::default(), 1, true);
+    }
+    let mut client: Client<_, AsyncEcosystem> = Client::register_new(config(), &mut transport);
+    let tx_agent = transport.tx_agent();
+
+    let (stop_tx, stop) = oneshot::channel();
+    spawn(async move { transport.deliver_until(stop).await });
+    let request = spawn(async move {
+        for i in 0..10 {
+            assert_eq!(
+                client.invoke(format!("#{}", i).into()).await,
+                Opaque::from(format!("reply: #{}", i))
+            );
+        }
+        // every recorded proposal is justified by a QC that replica 1 has
+        // already acted on, and the earlier ones reach blocks it has pruned
+        let generic_list = generic_list.lock().unwrap().clone();
+        assert!(generic_list.len() >= 10);
+        for generic in generic_list {
+            tx_agent.send_message(
+                &Replay("replica-0".to_string()),
+                &"replica-1".to_string(),
+                |buffer| {
+                    buffer[..generic.len()].copy_from_slice(&generic);
+                    generic.len() as u16
+                },
+            );
+        }
+        for i in 10..20 {
+            assert_eq!(
+                client.invoke(format!("#{}", i).into()).await,
+                Opaque::from(format!("reply: #{}", i))
+            );
+        }
+    });
+
+    timeout(Duration::from_millis(10), request)
+        .await
+        .unwrap()
+        .unwrap();
+    stop_tx.send(()).unwrap();
+    assert!(!PANICKED.with(Cell::get));
+}
@@ -13,10 +13,10 @@ use tracing::{debug, warn};
 
 use crate::{
     common::{
-        deserialize, generate_id, serialize, ClientId, Config, Opaque, RequestNumber,
+        deserialize, generate_id, serialize, ClientId, Config, Opaque, PendingTable, RequestNumber,
         SignedMessage, ViewNumber,
     },
-    facade::{AsyncEcosystem, Invoke, Receiver, Transport, TxAgent},
+    facade::{AsyncEcosystem, Invoke, Pipeline, Receiver, Transport, TxAgent},
     protocol::pbft::message::{self, ToReplica},
 };
 
@@ -30,6 +30,7 @@ pub struct Client<T: Transport, E> {
 
     request_number: RequestNumber,
     view_number: ViewNumber,
+    pending_table: PendingTable<message::Request>,
 }
 
 impl<T: Transport, E> Receiver<T> for Client<T, E> {
@@ -49,6 +50,7 @@ impl<T: Transport, E> Client<T, E> {
             rx,
             request_number: 0,
             view_number: 0,
+            pending_table: PendingTable::default(),
             _executor: PhantomData,
         };
         transport.register(&client, move |remote, buffer| {
@@ -129,3 +131,62 @@ where
         }
     }
 }
+
+#[async_trait]
+impl<T: Transport, E: AsyncEcosystem<Opaque>> Pipeline for Client<T, E>
+where
+    Self: Send + Sync,
+    E: Send + Sync,
+{
+    fn submit(&mut self, op: Opaque) -> RequestNumber {
+        self.request_number += 1;
+        let request = self
+            .pending_table
+            .insert(self.request_number, |lane| message::Request {
+                op,
+                request_number: self.request_number,
+                client_id: lane,
+            });
+        let primary = self.config.view_primary(self.view_number);
+        self.transport.send_message(
+            self,
+            self.config.replica(primary),
+            serialize(ToReplica::Request(request)),
+        );
+        self.request_number
+    }
+
+    async fn complete(&mut self) -> (RequestNumber, Opaque) {
+        loop {
+            select! {
+                recv = self.rx.next() => {
+                    let (_remote, buffer) = recv.unwrap();
+                    let reply: SignedMessage<message::Reply> = deserialize(buffer.as_ref()).unwrap();
+                    let reply = reply.assume_verified();
+                    if reply.view_number > self.view_number {
+                        self.view_number = reply.view_number;
+                    }
+                    if self.pending_table.receive(reply.request_number, reply.replica_id, &reply.result, self.config.f + 1) {
+                        return (reply.request_number, reply.result);
+                    }
+                }
+                _ = E::sleep_until(self.pending_table.timeout()).fuse() => {
+                    // backups learn the address of a new lane from its first
+                    // resending, same as the first request of a client
+                    for (request, fresh) in self.pending_table.expired() {
+                        if !fresh {
+                            warn!("resend for request number {}", request.request_number);
+                        } else {
+                            debug!("resend for request number {}", request.request_number);
+                        }
+                        self.transport.send_message_to_all(
+                            self,
+                            self.config.replica(..),
+                            serialize(ToReplica::Request(request)),
+                        );
+                    }
+                }
+            }
+        }
+    }
+}
@@ -1,7 +1,8 @@
 use serde_derive::{Deserialize, Serialize};
 
 use crate::common::{
-    signed::SignedMessage, ClientId, Digest, OpNumber, Opaque, ReplicaId, RequestNumber, ViewNumber,
+    signed::SignedMessage, ClientId, Digest, OpNumber, Opaque, ReplicaId, RequestNumber,
+    SignedView, ViewNumber,
 };
 
 #[derive(Debug, Clone, Serialize, Deserialize)]
@@ -15,6 +16,23 @@ pub enum ToReplica {
     PrePrepare(SignedMessage<PrePrepare>), // request batch piggybacked
     Prepare(SignedMessage<Prepare>),
     Commit(SignedMessage<Commit>),
+    Checkpoint(SignedMessage<Checkpoint>),
+}
+
+// borrowed mirror of `ToReplica` for receiving, variants must keep the same
+// order
+#[derive(Debug, Serialize, Deserialize)]
+pub enum ToReplicaView<'a> {
+    Request(Request),
+    RelayedRequest(Request),
+    #[serde(borrow)]
+    PrePrepare(SignedView<'a, PrePrepare>),
+    #[serde(borrow)]
+    Prepare(SignedView<'a, Prepare>),
+    #[serde(borrow)]
+    Commit(SignedView<'a, Commit>),
+    #[serde(borrow)]
+    Checkpoint(SignedView<'a, Checkpoint>),
 }
 
 #[derive(Debug, Clone, Serialize, Deserialize)]
@@ -55,3 +73,10 @@ pub struct Commit {
     pub digest: Digest,
     pub replica_id: ReplicaId,
 }
+
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct Checkpoint {
+    pub op_number: OpNumber,
+    pub digest: Digest, // chained digest of all executed batches
+    pub replica_id: ReplicaId,
+}
@@ -1,19 +1,31 @@
 use std::{
-    collections::{HashMap, HashSet},
+    collections::HashMap,
     io::Write,
-    sync::Arc,
+    mem::take,
+    sync::{
+        atomic::{AtomicUsize, Ordering},
+        Arc,
+    },
+    time::{Duration, Instant},
 };
 
+use crossbeam::queue::SegQueue;
+use futures::{
+    channel::mpsc::{unbounded, UnboundedSender},
+    Future, StreamExt,
+};
 use sha2::{Digest as _, Sha256};
 use tracing::{debug, info, warn};
 
 use crate::{
     common::{
-        deserialize, serialize, signed::VerifiedMessage, ClientId, Config, Digest, OpNumber,
-        ReplicaId, RequestNumber, SignedMessage, ViewNumber,
+        deserialize_shared, deserialize_view_shared, serialize, signed::VerifiedMessage, ClientId,
+        Config, Digest, OpNumber, Opaque, ReplicaId, ReplicaSet, RequestNumber, SignedMessage,
+        ViewNumber, Window,
     },
-    facade::{App, Receiver, Transport, TxAgent},
-    protocol::pbft::message::{self, ToReplica},
+    facade::{App, AsyncEcosystem, Receiver, Transport, TxAgent},
+    framework::trace::{Phase, Span},
+    protocol::pbft::message::{self, ToReplica, ToReplicaView},
     stage::{Handle, State, StatefulContext, StatelessContext},
 };
 
@@ -40,6 +52,25 @@ use crate::{
 // optimitic to get best performance (without increasing out of order message).
 // Finally, these reorder buffers must be cleared on view change as well
 // obivously.
+// log is garbage collected up to the latest stable checkpoint, i.e. 2f + 1
+// matching checkpoints including local one. Log item of op number n is at
+// index n - log_offset - 1, and any message for op number not above
+// log_offset is dropped.
+// reorder buffers and commit quorum are windows starting right above
+// log_offset (reorder log starts above the log tail), and messages too far
+// ahead of the window are dropped as well, same as out of window message in
+// PBFT paper's high water mark. the window spans two checkpoint intervals, and
+// primary does not pre-prepare beyond it, so replicas that keep up with
+// stable checkpoints never drop honest messages.
+// primary keeps at most `pipeline_window` batches pre-prepared but not yet
+// committed (0 means the concurrency estimation above). a batch is closed when
+// it is full, or when it is not empty and either adaptive batching is on or
+// its first request has waited longer than `batch_timeout`. the timeout is
+// checked on request and commit events, and there is no timer in stage, so
+// under low load a partial batch relies on `batch_timer` running in an async
+// ecosystem. at most one deadline is armed at a time: it is armed when request
+// buffer becomes non-empty, and on firing it is armed again for the current
+// batch if the one it was armed for has been closed meanwhile.
 
 pub struct Replica<T: Transport> {
     address: T::Address,
@@ -48,6 +79,8 @@ pub struct Replica<T: Transport> {
     id: ReplicaId,
     batch_size: usize,
     adaptive_batching: bool,
+    pipeline_window: usize,
+    batch_timeout: Option<Duration>,
 
     view_number: ViewNumber,
     op_number: OpNumber, // one OpNumber for a batch
@@ -55,12 +88,22 @@ pub struct Replica<T: Transport> {
 
     client_table: HashMap<ClientId, (RequestNumber, Option<SignedMessage<message::Reply>>)>,
     log: Vec<LogItem>,
+    log_offset: OpNumber, // op number of stable checkpoint
     request_buffer: Vec<message::Request>,
-    commit_quorum: HashMap<OpNumber, HashSet<ReplicaId>>,
-
-    reorder_log: HashMap<OpNumber, LogItem>,
-    reorder_prepare: HashMap<OpNumber, Vec<VerifiedMessage<message::Prepare>>>,
-    reorder_commit: HashMap<OpNumber, Vec<VerifiedMessage<message::Commit>>>,
+    batch_start: Instant, // arrival of the first request in request buffer
+    request_span: Span,   // of a request in request buffer, if any is sampled
+    batch_expired: bool,  // set by batch timer
+    batch_timer: Option<UnboundedSender<Instant>>, // batch start to time out
+    batch_armed: bool,    // a batch start is sent to batch timer and not fired
+    commit_quorum: Window<ReplicaSet>,
+    // hash(batch digest, previous history digest) of executed batches
+    history_digest: Digest,
+    checkpoint_quorum:
+        HashMap<(OpNumber, Digest), HashMap<ReplicaId, SignedMessage<message::Checkpoint>>>,
+
+    reorder_log: Window<LogItem>,
+    reorder_prepare: Window<Vec<VerifiedMessage<message::Prepare>>>,
+    reorder_commit: Window<Vec<VerifiedMessage<message::Commit>>>,
 
     app: Box<dyn App + Send>,
     pub(super) route_table: HashMap<ClientId, T::Address>,
@@ -76,6 +119,7 @@ struct LogItem {
     pre_prepare: SignedMessage<message::PrePrepare>,
     prepare_quorum: HashMap<ReplicaId, SignedMessage<message::Prepare>>,
     committed: bool,
+    span: Span, // of one request in batch
 }
 
 pub struct Shared<T: Transport> {
@@ -86,9 +130,11 @@ pub struct Shared<T: Transport> {
 
 impl<T: Transport> Replica<T> {
     fn log_item(&self, op_number: OpNumber) -> Option<&LogItem> {
-        if let Some(item) = self.log.get((op_number - 1) as usize) {
+        if op_number <= self.log_offset {
+            None
+        } else if let Some(item) = self.log.get((op_number - self.log_offset - 1) as usize) {
             Some(item)
-        } else if let Some(item) = self.reorder_log.get(&op_number) {
+        } else if let Some(item) = self.reorder_log.get(op_number) {
             Some(item)
         } else {
             None
@@ -96,9 +142,11 @@ impl<T: Transport> Replica<T> {
     }
 
     fn log_item_mut(&mut self, op_number: OpNumber) -> Option<&mut LogItem> {
-        if let Some(item) = self.log.get_mut((op_number - 1) as usize) {
+        if op_number <= self.log_offset {
+            None
+        } else if let Some(item) = self.log.get_mut((op_number - self.log_offset - 1) as usize) {
             Some(item)
-        } else if let Some(item) = self.reorder_log.get_mut(&op_number) {
+        } else if let Some(item) = self.reorder_log.get_mut(op_number) {
             Some(item)
         } else {
             None
@@ -121,7 +169,7 @@ impl<T: Transport> Replica<T> {
     fn committed(&self, op_number: OpNumber) -> bool {
         // a little bit duplicated, but I accept that
         self.prepared(op_number)
-            && if let Some(commit_quorum) = self.commit_quorum.get(&op_number) {
+            && if let Some(commit_quorum) = self.commit_quorum.get(op_number) {
                 commit_quorum.len() >= self.config.f * 2 + 1
             } else {
                 false
@@ -170,16 +218,26 @@ impl<T: Transport> Replica<T> {
             id: replica_id,
             batch_size,
             adaptive_batching,
+            pipeline_window: 0,
+            batch_timeout: None,
             view_number: 0,
             op_number: 0,
             commit_number: 0,
             client_table: HashMap::new(),
             log: Vec::new(),
+            log_offset: 0,
             request_buffer: Vec::new(),
-            commit_quorum: HashMap::new(),
-            reorder_log: HashMap::new(),
-            reorder_prepare: HashMap::new(),
-            reorder_commit: HashMap::new(),
+            batch_start: Instant::now(),
+            request_span: Span::default(),
+            batch_expired: false,
+            batch_timer: None,
+            batch_armed: false,
+            commit_quorum: Window::new(1, Self::window_limit(batch_size)),
+            history_digest: Default::default(),
+            checkpoint_quorum: HashMap::new(),
+            reorder_log: Window::new(1, Self::window_limit(batch_size)),
+            reorder_prepare: Window::new(1, Self::window_limit(batch_size)),
+            reorder_commit: Window::new(1, Self::window_limit(batch_size)),
             app: Box::new(app),
             route_table: HashMap::new(),
             shared: Arc::new(Shared {
@@ -197,25 +255,89 @@ impl<T: Transport> Replica<T> {
                 move |remote, buffer| {
                     // shortcut: if we don't have verifying key for remote, we
                     // cannot do verify so skip stateless task
+                    let mut span = Span::sample();
                     if config.verifying_key(&remote).is_some() {
-                        submit.stateless(move |replica| replica.receive_buffer(remote, buffer));
+                        submit.stateless(move |replica| {
+                            span.mark(Phase::StatelessQueue);
+                            replica.receive_buffer(remote, buffer, span)
+                        });
                     } else {
-                        submit.stateful(move |replica| replica.receive_buffer(remote, buffer));
+                        submit.stateful(move |replica| {
+                            span.mark(Phase::StatefulQueue);
+                            replica.receive_buffer(remote, buffer, &mut span);
+                            span.mark(Phase::Stateful);
+                        });
                     }
                 }
             });
         });
         replica
     }
+
+    pub fn set_pipeline(&mut self, window: usize, batch_timeout: Option<Duration>) {
+        self.pipeline_window = window;
+        self.batch_timeout = batch_timeout;
+    }
+
+    fn pipeline_available(&self) -> bool {
+        if (self.op_number - self.log_offset) as usize >= Self::window_limit(self.batch_size) {
+            return false;
+        }
+        let n_inflight = (self.op_number - self.commit_number) as usize;
+        if self.pipeline_window != 0 {
+            return n_inflight < self.pipeline_window;
+        }
+
+        // notice this assume all servers set up the same number of workers as
+        // leader
+        let estimated_available_concurrency = Arc::strong_count(&self.shared);
+        // each on-the-fly op number takes n concurrency to sign/verify
+        // pre-prepare/prepare, and n concurrency to sign/verify commit
+        let op_concurrency = self.config.replica(..).len() * 2;
+        let estimated_allocated_concurrency = n_inflight * op_concurrency;
+
+        // we give extra concurrency for one op, for
+        // * the potential pipelining feature of the system
+        // * the fact that sometimes op commits out of order
+        // * allow system to move on when available concurrecy is too small
+        estimated_allocated_concurrency < estimated_available_concurrency + op_concurrency
+    }
+
+    fn batch_ready(&self) -> bool {
+        self.request_buffer.len() >= self.batch_size
+            || (!self.request_buffer.is_empty()
+                && (self.adaptive_batching
+                    || self.batch_expired
+                    || self
+                        .batch_timeout
+                        .map(|timeout| self.batch_start.elapsed() >= timeout)
+                        .unwrap_or(false)))
+    }
+
+    fn start_batch(&mut self) {
+        self.batch_start = Instant::now();
+        self.batch_expired = false;
+        self.arm_batch_timer();
+    }
+
+    fn arm_batch_timer(&mut self) {
+        if let Some(batch_timer) = &self.batch_timer {
+            if !self.batch_armed {
+                self.batch_armed = true;
+                // timer is gone only on shutdown
+                let _ = batch_timer.unbounded_send(self.batch_start);
+            }
+        }
+    }
 }
 
 impl<'a, T: Transport> StatefulContext<'a, Replica<T>> {
-    fn receive_buffer(&mut self, remote: T::Address, buffer: T::RxBuffer) {
+    fn receive_buffer(&mut self, remote: T::Address, buffer: T::RxBuffer, span: &mut Span) {
         #[allow(clippy::single_match)] // although no future plan to add more branch
         // just to keep uniform shape
-        match deserialize(buffer.as_ref()) {
+        match deserialize_shared(&Opaque::share(buffer)) {
             Ok(ToReplica::Request(request)) => {
-                self.handle_request(remote, request);
+                self.handle_request(remote, request, span);
                 return;
             }
             _ => {}
@@ -225,60 +347,109 @@ impl<'a, T: Transport> StatefulContext<'a, Replica<T>> {
 }
 
 impl<T: Transport> StatelessContext<Replica<T>> {
-    fn receive_buffer(&self, remote: T::Address, buffer: T::RxBuffer) {
-        let mut buffer = buffer.as_ref();
-        match deserialize(&mut buffer) {
-            Ok(ToReplica::RelayedRequest(request)) => {
-                self.submit
-                    .stateful(|replica| replica.handle_relayed_request(remote, request));
+    fn receive_buffer(&self, remote: T::Address, buffer: T::RxBuffer, span: Span) {
+        let buffer = Opaque::share(buffer);
+        match deserialize_view_shared(&buffer) {
+            Ok((ToReplicaView::RelayedRequest(request), _)) => {
+                self.submit_stateful(span, |replica, span| {
+                    replica.handle_relayed_request(remote, request, span)
+                });
                 return;
             }
-            Ok(ToReplica::PrePrepare(pre_prepare)) => {
+            Ok((ToReplicaView::PrePrepare(pre_prepare), batch_buffer)) => {
                 if let Ok(pre_prepare) =
                     pre_prepare.verify(self.config.verifying_key(&remote).unwrap())
                 {
-                    if Sha256::digest(buffer)[..] == pre_prepare.digest {
-                        let batch: Result<Vec<message::Request>, _> = deserialize(buffer);
+                    if Sha256::digest(batch_buffer)[..] == pre_prepare.digest {
+                        let batch: Result<Vec<message::Request>, _> =
+                            deserialize_shared(&buffer.slice_ref(batch_buffer));
                         if let Ok(batch) = batch {
-                            self.submit.stateful(|replica| {
-                                replica.handle_pre_prepare(remote, pre_prepare, batch)
+                            self.submit_stateful(span, |replica, span| {
+                                replica.handle_pre_prepare(remote, pre_prepare, batch, span)
                             });
                             return;
                         }
                     }
                 }
             }
-            Ok(ToReplica::Prepare(prepare)) => {
+            Ok((ToReplicaView::Prepare(prepare), _)) => {
                 if let Ok(prepare) = prepare.verify(self.config.verifying_key(&remote).unwrap()) {
-                    self.submit
-                        .stateful(|replica| replica.handle_prepare(remote, prepare));
-                    return;
+                    if self.config.replica_id(&remote) == Some(prepare.replica_id) {
+                        self.submit_stateful(span, |replica, _| {
+                            replica.handle_prepare(remote, prepare)
+                        });
+                        return;
+                    }
                 }
             }
-            Ok(ToReplica::Commit(commit)) => {
+            Ok((ToReplicaView::Commit(commit), _)) => {
                 if let Ok(commit) = commit.verify(self.config.verifying_key(&remote).unwrap()) {
-                    self.submit
-                        .stateful(|replica| replica.handle_commit(remote, commit));
-                    return;
+                    if self.config.replica_id(&remote) == Some(commit.replica_id) {
+                        self.submit_stateful(span, |replica, _| {
+                            replica.handle_commit(remote, commit)
+                        });
+                        return;
+                    }
+                }
+            }
+            Ok((ToReplicaView::Checkpoint(checkpoint), _)) => {
+                if let Ok(checkpoint) =
+                    checkpoint.verify(self.config.verifying_key(&remote).unwrap())
+                {
+                    // quorums are keyed by replica id, which must be the sender
+                    // itself, or one replica could vote as many
+                    if self.config.replica_id(&remote) == Some(checkpoint.replica_id) {
+                        self.submit_stateful(span, |replica, _| {
+                            replica.handle_checkpoint(remote, checkpoint)
+                        });
+                        return;
+                    }
                 }
             }
             _ => {}
         }
         warn!("fail to verify replica message");
     }
+
+    // end verify phase of span, and trace stateful task
+    // task may take the span to carry the request through later phases, and
+    // then it marks stateful phase itself
+    fn submit_stateful(
+        &self,
+        mut span: Span,
+        task: impl for<'a> FnOnce(&mut StatefulContext<'a, Replica<T>>, &mut Span) + Send + 'static,
+    ) {
+        span.mark(Phase::Verify);
+        self.submit.stateful(move |replica| {
+            span.mark(Phase::StatefulQueue);
+            task(replica, &mut span);
+            span.mark(Phase::Stateful);
+        });
+    }
 }
 
 impl<'a, T: Transport> StatefulContext<'a, Replica<T>> {
-    fn handle_request(&mut self, remote: T::Address, message: message::Request) {
+    fn handle_request(&mut self, remote: T::Address, message: message::Request, span: &mut Span) {
         self.route_table.insert(message.client_id, remote.clone());
-        self.handle_request_internal(Some(remote), message);
+        self.handle_request_internal(Some(remote), message, span);
     }
 
-    fn handle_relayed_request(&mut self, _remote: T::Address, message: message::Request) {
-        self.handle_request_internal(self.route_table.get(&message.client_id).cloned(), message);
+    fn handle_relayed_request(
+        &mut self,
+        _remote: T::Address,
+        message: message::Request,
+        span: &mut Span,
+    ) {
+        let remote = self.route_table.get(&message.client_id).cloned();
+        self.handle_request_internal(remote, message, span);
     }
 
-    fn handle_request_internal(&mut self, remote: Option<T::Address>, message: message::Request) {
+    fn handle_request_internal(
+        &mut self,
+        remote: Option<T::Address>,
+        message: message::Request,
+        span: &mut Span,
+    ) {
         if let Some((request_number, reply)) = self.client_table.get(&message.client_id) {
             if *request_number > message.request_number {
                 return;
@@ -307,33 +478,74 @@ impl<'a, T: Transport> StatefulContext<'a, Replica<T>> {
             return;
         }
 
+        if self.request_buffer.is_empty() && self.batch_timeout.is_some() {
+            self.start_batch();
+        }
+        // buffered and then logged until next stable checkpoint, so stop
+        // pinning receiving buffer
+        let message = message::Request {
+            op: message.op.detach(),
+            ..message
+        };
+        // one sampled request per batch is traced through
+        span.mark(Phase::Stateful);
+        let span = take(span);
+        if !self.request_span.is_sampled() {
+            self.request_span = span;
+        }
         self.request_buffer.push(message);
+        self.close_ready_batch();
+    }
 
-        // notice this assume all servers set up the same number of workers as
-        // leader
-        let estimated_available_concurrency = Arc::strong_count(&self.shared);
-        // each on-the-fly op number takes n concurrency to sign/verify
-        // pre-prepare/prepare, and n concurrency to sign/verify commit
-        let op_concurrency = self.config.replica(..).len() * 2;
-        let estimated_allocated_concurrency =
-            (self.op_number - self.commit_number) as usize * op_concurrency;
-
-        // we give extra concurrency for one op, for
-        // * the potential pipelining feature of the system
-        // * the fact that sometimes op commits out of order
-        // * allow system to move on when available concurrecy is too small
-        if estimated_allocated_concurrency < estimated_available_concurrency + op_concurrency {
-            if self.request_buffer.len() >= self.batch_size || self.adaptive_batching {
-                self.close_batch();
+    /// Batch timer loop, which should be spawned into async ecosystem `E` and
+    /// kept running along with replica, if batch timeout is set. A partial
+    /// batch is closed as soon as its first request has waited for batch
+    /// timeout, instead of on the next request or commit.
+    pub fn batch_timer<E: AsyncEcosystem<()> + 'static>(
+        &mut self,
+    ) -> impl Future<Output = ()> + Send + 'static {
+        let (timer, mut start_list) = unbounded();
+        self.batch_timer = Some(timer);
+        let timeout = self.batch_timeout.unwrap_or_default();
+        let submit = self.submit.clone();
+        async move {
+            // batch starts are in order, so are the deadlines
+            while let Some(batch_start) = start_list.next().await {
+                E::sleep_until(batch_start + timeout).await;
+                submit.stateful(move |replica| {
+                    replica.batch_armed = false;
+                    if replica.request_buffer.is_empty() || !replica.is_primary() {
+                        return;
+                    }
+                    if replica.batch_start == batch_start {
+                        replica.batch_expired = true;
+                        replica.close_ready_batch();
+                    } else {
+                        // the batch is closed already, and leftover requests
+                        // started another one, which expires later
+                        replica.arm_batch_timer();
+                    }
+                });
             }
         }
     }
 
+    fn close_ready_batch(&mut self) {
+        while self.pipeline_available() && self.batch_ready() {
+            self.close_batch();
+        }
+    }
+
     fn close_batch(&mut self) {
         assert!(self.is_primary());
 
         let batch = ..self.batch_size.min(self.request_buffer.len());
         let batch: Vec<_> = self.request_buffer.drain(batch).collect();
+        let span = take(&mut self.request_span);
+        if !self.request_buffer.is_empty() && self.batch_timeout.is_some() {
+            // leftover requests just arrived in a burst, good enough
+            self.start_batch();
+        }
 
         self.op_number += 1;
         let mut pre_prepare = message::PrePrepare {
@@ -374,6 +586,7 @@ impl<'a, T: Transport> StatefulContext<'a, Replica<T>> {
                     pre_prepare,
                     prepare_quorum: HashMap::new(),
                     committed: false,
+                    span,
                 });
             });
         });
@@ -394,23 +607,27 @@ impl<'a, T: Transport> StatefulContext<'a, Replica<T>> {
 
         let digest = item.digest;
         let op_number = item.op_number;
-        if op_number != self.log.len() as OpNumber + 1 {
+        let expect_number = self.log_offset + self.log.len() as OpNumber + 1;
+        if op_number != expect_number {
             debug!(
                 "out of order log item: {} (expect {})",
-                item.op_number,
-                self.log.len() as OpNumber + 1
+                item.op_number, expect_number
             );
-            self.reorder_log.insert(op_number, item);
+            if !self.reorder_log.insert(op_number, item) {
+                warn!("log item {} out of window", op_number);
+                return;
+            }
         } else {
             self.log.push(item);
-            let mut insert_number = self.log.len() as OpNumber + 1;
-            while let Some(item) = self.reorder_log.remove(&insert_number) {
+            let mut insert_number = expect_number + 1;
+            while let Some(item) = self.reorder_log.remove(insert_number) {
                 self.log.push(item);
                 insert_number += 1;
             }
+            self.reorder_log.advance(insert_number);
         }
 
-        if let Some(mut prepare_list) = self.reorder_prepare.remove(&op_number) {
+        if let Some(mut prepare_list) = self.reorder_prepare.remove(op_number) {
             while !self.prepared(op_number) {
                 if let Some(prepare) = prepare_list.pop() {
                     if prepare.digest == digest {
@@ -421,7 +638,7 @@ impl<'a, T: Transport> StatefulContext<'a, Replica<T>> {
                 }
             }
         }
-        if let Some(mut commit_list) = self.reorder_commit.remove(&op_number) {
+        if let Some(mut commit_list) = self.reorder_commit.remove(op_number) {
             while !self.committed(op_number) {
                 if let Some(commit) = commit_list.pop() {
                     if commit.digest == digest {
@@ -439,6 +656,7 @@ impl<'a, T: Transport> StatefulContext<'a, Replica<T>> {
         _remote: T::Address,
         message: VerifiedMessage<message::PrePrepare>,
         batch: Vec<message::Request>,
+        span: &mut Span,
     ) {
         if message.view_number < self.view_number {
             return;
@@ -452,10 +670,18 @@ impl<'a, T: Transport> StatefulContext<'a, Replica<T>> {
             return;
         }
 
-        if self.log_item(message.op_number).is_some() {
+        if message.op_number <= self.log_offset || self.log_item(message.op_number).is_some() {
             return;
         }
 
+        let batch = batch
+            .into_iter()
+            .map(|request| message::Request {
+                op: request.op.detach(),
+                ..request
+            })
+            .collect();
+        span.mark(Phase::Stateful);
         self.insert_log_item(LogItem {
             view_number: message.view_number,
             op_number: message.op_number,
@@ -464,6 +690,7 @@ impl<'a, T: Transport> StatefulContext<'a, Replica<T>> {
             pre_prepare: message.signed_message().clone(),
             prepare_quorum: HashMap::new(),
             committed: false,
+            span: take(span),
         });
 
         let prepare = message::Prepare {
@@ -497,7 +724,7 @@ impl<'a, T: Transport> StatefulContext<'a, Replica<T>> {
     }
 
     fn handle_prepare(&mut self, _remote: T::Address, message: VerifiedMessage<message::Prepare>) {
-        if message.view_number < self.view_number {
+        if message.view_number < self.view_number || message.op_number <= self.log_offset {
             return;
         }
         if message.view_number > self.view_number {
@@ -509,10 +736,12 @@ impl<'a, T: Transport> StatefulContext<'a, Replica<T>> {
             item
         } else {
             info!("no log item match prepare {}", message.op_number);
-            self.reorder_prepare
-                .entry(message.op_number)
-                .or_default()
-                .push(message);
+            if let Some(prepare_list) = self
+                .reorder_prepare
+                .get_or_insert_with(message.op_number, Vec::new)
+            {
+                prepare_list.push(message);
+            }
             return;
         };
 
@@ -568,7 +797,7 @@ impl<'a, T: Transport> StatefulContext<'a, Replica<T>> {
     }
 
     fn handle_commit(&mut self, _remote: T::Address, message: VerifiedMessage<message::Commit>) {
-        if message.view_number < self.view_number {
+        if message.view_number < self.view_number || message.op_number <= self.log_offset {
             return;
         }
         if message.view_number > self.view_number {
@@ -580,10 +809,12 @@ impl<'a, T: Transport> StatefulContext<'a, Replica<T>> {
             item
         } else {
             info!("no log item match commit {}", message.op_number);
-            self.reorder_commit
-                .entry(message.op_number)
-                .or_default()
-                .push(message);
+            if let Some(commit_list) = self
+                .reorder_commit
+                .get_or_insert_with(message.op_number, Vec::new)
+            {
+                commit_list.push(message);
+            }
             return;
         };
 
@@ -597,10 +828,14 @@ impl<'a, T: Transport> StatefulContext<'a, Replica<T>> {
     }
 
     fn insert_commit(&mut self, commit: &message::Commit) {
-        self.commit_quorum
-            .entry(commit.op_number)
-            .or_default()
-            .insert(commit.replica_id);
+        if let Some(commit_quorum) = self
+            .commit_quorum
+            .get_or_insert_with(commit.op_number, ReplicaSet::default)
+        {
+            commit_quorum.insert(commit.replica_id);
+        } else {
+            return;
+        }
 
         if self.committed(commit.op_number) {
             debug!("committed");
@@ -609,53 +844,181 @@ impl<'a, T: Transport> StatefulContext<'a, Replica<T>> {
             self.execute_committed();
 
             if self.is_primary() {
-                if self.request_buffer.len() >= self.batch_size
-                    || (self.adaptive_batching && !self.request_buffer.is_empty())
-                {
-                    self.close_batch();
-                }
+                self.close_ready_batch();
             }
         }
     }
 
     fn execute_committed(&mut self) {
-        while let Some(item) = self.log.get(self.commit_number as usize) {
+        while let Some(item) = self
+            .log
+            .get((self.commit_number - self.log_offset) as usize)
+        {
             assert_eq!(item.op_number, self.commit_number + 1);
             if !item.committed {
                 break;
             }
 
             let op_number = item.op_number;
-            // why have to clone?
-            for (i, request) in item.batch.clone().into_iter().enumerate() {
+            let digest = item.digest;
+            // move batch out during execution so app can borrow ops from it
+            // while replica state is mutably borrowed, and put it back later
+            let index = (self.commit_number - self.log_offset) as usize;
+            let batch = take(&mut self.log[index].batch);
+            let mut span = take(&mut self.log[index].span);
+            span.mark(Phase::QuorumWait);
+            let mut reply_list = Vec::with_capacity(batch.len());
+            for (i, request) in batch.iter().enumerate() {
                 let op_number = op_number * self.batch_size as OpNumber + i as OpNumber;
-                let result = self.app.execute(op_number, request.op);
-                let reply = message::Reply {
+                let result = self.app.execute(op_number, &request.op);
+                reply_list.push(message::Reply {
                     view_number: self.view_number,
                     request_number: request.request_number,
                     client_id: request.client_id,
                     replica_id: self.id,
                     result,
-                };
-                self.submit.stateless(move |replica| {
+                });
+            }
+            self.log[index].batch = batch;
+            self.app.flush();
+            span.mark(Phase::Execute);
+            self.send_reply_list(reply_list, span);
+
+            self.commit_number += 1;
+            self.history_digest = Sha256::new()
+                .chain_update(digest)
+                .chain_update(self.history_digest)
+                .finalize()
+                .into();
+            if op_number % (Self::CHECKPOINT_INTERVAL / self.batch_size).max(1) as OpNumber == 0 {
+                self.send_checkpoint(op_number);
+            }
+        }
+    }
+
+    // same as Zyzzyva, the interval is per request not per op number
+    const CHECKPOINT_INTERVAL: usize = 10000;
+
+    // high water mark above stable checkpoint, in op numbers
+    fn window_limit(batch_size: usize) -> usize {
+        2 * (Self::CHECKPOINT_INTERVAL / batch_size).max(1)
+    }
+
+    fn send_checkpoint(&mut self, op_number: OpNumber) {
+        debug!("checkpoint op number {}", op_number);
+        let checkpoint = message::Checkpoint {
+            op_number,
+            digest: self.history_digest,
+            replica_id: self.id,
+        };
+        self.submit.stateless(move |replica| {
+            let signed =
+                SignedMessage::sign(checkpoint.clone(), replica.config.signing_key(replica));
+            replica.transport.send_message_to_all(
+                replica,
+                replica.config.replica(..),
+                serialize(ToReplica::Checkpoint(signed.clone())),
+            );
+            replica.submit.stateful(move |replica| {
+                replica.insert_checkpoint(&checkpoint, &signed);
+            });
+        });
+    }
+
+    fn handle_checkpoint(
+        &mut self,
+        _remote: T::Address,
+        checkpoint: VerifiedMessage<message::Checkpoint>,
+    ) {
+        self.insert_checkpoint(&*checkpoint, checkpoint.signed_message());
+    }
+
+    fn insert_checkpoint(
+        &mut self,
+        checkpoint: &message::Checkpoint,
+        signed: &SignedMessage<message::Checkpoint>,
+    ) {
+        if checkpoint.op_number <= self.log_offset {
+            return;
+        }
+
+        let (id, threshold) = (self.id, self.config.f * 2 + 1);
+        let quorum = self
+            .checkpoint_quorum
+            .entry((checkpoint.op_number, checkpoint.digest))
+            .or_default();
+        quorum.insert(checkpoint.replica_id, signed.clone());
+        // local checkpoint is included only after executing up to op number,
+        // with matching digest
+        if quorum.len() >= threshold && quorum.contains_key(&id) {
+            self.garbage_collect(checkpoint.op_number);
+        }
+    }
+
+    fn garbage_collect(&mut self, op_number: OpNumber) {
+        debug!("stable checkpoint {}", op_number);
+        assert!(op_number <= self.commit_number);
+        let log_offset = self.log_offset;
+        self.log.drain(..(op_number - log_offset) as usize);
+        self.log_offset = op_number;
+        self.commit_quorum.advance(op_number + 1);
+        self.reorder_log.advance(op_number + 1);
+        self.reorder_prepare.advance(op_number + 1);
+        self.reorder_commit.advance(op_number + 1);
+        // no view change yet, so the proof of stable checkpoint is not kept
+        self.checkpoint_quorum.retain(|(n, _), _| *n > op_number);
+        // window moves, which may be what the pipeline is waiting for
+        if self.is_primary() {
+            self.close_ready_batch();
+        }
+    }
+
+    // replies of a batch are signed in parallel chunks, one stateless task
+    // per chunk, and the last finished chunk submits one stateful task to
+    // update client table and send all replies
+    // every chunk has a copy of span, and only the last finished one marks
+    fn send_reply_list(&self, reply_list: Vec<message::Reply>, span: Span) {
+        if reply_list.is_empty() {
+            return;
+        }
+        // same concurrency estimation as in `handle_request_internal`
+        let n_chunk = Arc::strong_count(&self.shared).min(reply_list.len());
+        let chunk_size = (reply_list.len() + n_chunk - 1) / n_chunk;
+        let n_chunk = (reply_list.len() + chunk_size - 1) / chunk_size;
+        let signed_list = Arc::new(SegQueue::new());
+        let countdown = Arc::new(AtomicUsize::new(n_chunk));
+        let mut reply_list = reply_list.into_iter();
+        for _ in 0..n_chunk {
+            let chunk: Vec<_> = reply_list.by_ref().take(chunk_size).collect();
+            let signed_list = signed_list.clone();
+            let countdown = countdown.clone();
+            let mut span = span;
+            self.submit.stateless(move |replica| {
+                for reply in chunk {
+                    let (client_id, request_number) = (reply.client_id, reply.request_number);
                     let reply = SignedMessage::sign(reply, replica.config.signing_key(replica));
-                    replica.submit.stateful(move |replica| {
-                        replica.client_table.insert(
-                            request.client_id,
-                            (request.request_number, Some(reply.clone())),
-                        );
-                        if let Some(remote) = replica.route_table.get(&request.client_id) {
+                    signed_list.push((client_id, request_number, reply));
+                }
+                if countdown.fetch_sub(1, Ordering::AcqRel) != 1 {
+                    return;
+                }
+                span.mark(Phase::Sign);
+                replica.submit.stateful(move |replica| {
+                    while let Some((client_id, request_number, reply)) = signed_list.pop() {
+                        replica
+                            .client_table
+                            .insert(client_id, (request_number, Some(reply.clone())));
+                        if let Some(remote) = replica.route_table.get(&client_id) {
                             replica
                                 .transport
                                 .send_message(replica, remote, serialize(reply));
                         } else {
                             debug!("no route record, skip reply");
                         }
-                    });
+                    }
+                    span.mark(Phase::Tx);
                 });
-            }
-
-            self.commit_number += 1;
+            });
         }
     }
 }
@@ -10,7 +10,7 @@ use crate::{
     facade::{Invoke, Receiver},
     framework::tokio::AsyncEcosystem,
     protocol::pbft::message::{self, ToReplica},
-    simulated::Transport,
+    simulated::{self, Report, Transport},
     stage::Handle,
     tests::TRACING,
 };
@@ -73,9 +73,12 @@ async fn one_request() {
     let (stop_tx, stop) = oneshot::channel();
     spawn(async move { transport.deliver_until(stop).await });
     assert_eq!(
-        timeout(Duration::from_micros(1), client.invoke(b"hello".to_vec()))
-            .await
-            .unwrap(),
+        timeout(
+            Duration::from_micros(1),
+            client.invoke(b"hello".to_vec().into())
+        )
+        .await
+        .unwrap(),
         b"reply: hello".to_vec()
     );
     stop_tx.send(()).unwrap();
@@ -113,3 +116,183 @@ async fn multiple_client() {
         .unwrap();
     stop_tx.send(()).unwrap();
 }
+
+#[tokio::test(start_paused = true)]
+async fn authenticator() {
+    *TRACING;
+    let config = Transport::config_builder(4, 1);
+    let mut transport = Transport::new(config());
+    let replica: Vec<_> = (0..4)
+        .map(|i| {
+            let mut config = config();
+            config.use_authenticator(i);
+            Replica::register_new(config, &mut transport, i, App::default(), 1, false)
+        })
+        .collect();
+    let client: Client<_, AsyncEcosystem> = Client::register_new(config(), &mut transport);
+    let client = [client];
+    generate_route(&replica, &client);
+    let mut client = client.into_iter().next().unwrap();
+
+    let (stop_tx, stop) = oneshot::channel();
+    spawn(async move { transport.deliver_until(stop).await });
+    assert_eq!(
+        timeout(
+            Duration::from_micros(1),
+            client.invoke(b"hello".to_vec().into())
+        )
+        .await
+        .unwrap(),
+        b"reply: hello".to_vec()
+    );
+    stop_tx.send(()).unwrap();
+}
+
+#[tokio::test(start_paused = true)]
+async fn pipeline_window() {
+    *TRACING;
+    let config = Transport::config_builder(4, 1);
+    let mut transport = Transport::new(config());
+    let replica: Vec<_> = (0..4)
+        .map(|i| {
+            let replica =
+                Replica::register_new(config(), &mut transport, i, App::default(), 2, false);
+            // at most one in-flight batch, partial batch is closed on the next
+            // event after it times out
+            replica.with_stateful(|replica| replica.set_pipeline(1, Some(Duration::ZERO)));
+            replica
+        })
+        .collect();
+    let client: Vec<Client<_, AsyncEcosystem>> = (0..5)
+        .map(|_| Client::register_new(config(), &mut transport))
+        .collect();
+    generate_route(&replica, &client);
+    let client: Vec<_> = client
+        .into_iter()
+        .enumerate()
+        .map(|(i, mut client)| {
+            spawn(async move {
+                for j in 0..3 {
+                    assert_eq!(
+                        client.invoke(format!("client-{}-{}", i, j).into()).await,
+                        Opaque::from(format!("reply: client-{}-{}", i, j))
+                    );
+                }
+            })
+        })
+        .collect();
+
+    let (stop_tx, stop) = oneshot::channel();
+    spawn(async move { transport.deliver_until(stop).await });
+    timeout(Duration::from_micros(10), join_all(client))
+        .await
+        .unwrap();
+    stop_tx.send(()).unwrap();
+}
+
+#[tokio::test(start_paused = true)]
+async fn batch_timer() {
+    *TRACING;
+    let config = Transport::config_builder(4, 1);
+    let mut transport = Transport::new(config());
+    let mut timer_list = Vec::new();
+    let replica: Vec<_> = (0..4)
+        .map(|i| {
+            let replica =
+                Replica::register_new(config(), &mut transport, i, App::default(), 10, false);
+            replica.with_stateful(|replica| {
+                replica.set_pipeline(0, Some(Duration::from_millis(1)));
+                timer_list.push(spawn(replica.batch_timer::<AsyncEcosystem>()));
+            });
+            replica
+        })
+        .collect();
+    let client: Client<_, AsyncEcosystem> = Client::register_new(config(), &mut transport);
+    let client = [client];
+    generate_route(&replica, &client);
+    let mut client = client.into_iter().next().unwrap();
+
+    let (stop_tx, stop) = oneshot::channel();
+    spawn(async move { transport.deliver_until(stop).await });
+    // the only request never fills the batch, and no other event comes before
+    // client resending
+    assert_eq!(
+        timeout(
+            Duration::from_millis(2),
+            client.invoke(b"hello".to_vec().into())
+        )
+        .await
+        .unwrap(),
+        b"reply: hello".to_vec()
+    );
+    stop_tx.send(()).unwrap();
+    for timer in timer_list {
+        timer.abort();
+    }
+}
+
+#[tokio::test(start_paused = true)]
+async fn pipelined_client() {
+    *TRACING;
+    let config = Transport::config_builder(4, 1);
+    let mut transport = Transport::new(config());
+    let _replica: Vec<_> = (0..4)
+        .map(|i| Replica::register_new(config(), &mut transport, i, App::default(), 1, false))
+        .collect();
+    let mut client: Client<_, AsyncEcosystem> = Client::register_new(config(), &mut transport);
+
+    let (stop_tx, stop) = oneshot::channel();
+    spawn(async move { transport.deliver_until(stop).await });
+    // lanes are unknown to backups until the first resending
+    simulated::pipelined(&mut client, 2, 5).await;
+    stop_tx.send(()).unwrap();
+}
+
+async fn simulate(n: usize, batch_size: usize, n_client: usize) -> Report {
+    simulated::simulate(n, |config, transport| {
+        let replica: Vec<_> = (0..n)
+            .map(|i| {
+                let replica = Replica::register_new(
+                    config(),
+                    transport,
+                    i as _,
+                    App::default(),
+                    batch_size,
+                    true,
+                );
+                replica.with_stateful(|replica| replica.set_pipeline(2, None));
+                replica
+            })
+            .collect();
+        let client: Vec<Client<_, AsyncEcosystem>> = (0..n_client)
+            .map(|_| Client::register_new(config(), transport))
+            .collect();
+        generate_route(&replica, &client);
+        (replica, client)
+    })
+    .await
+}
+
+#[tokio::test(start_paused = true)]
+async fn simulated_performance() {
+    *TRACING;
+    let report = simulate(4, 10, 20).await;
+    println!("{}", report);
+    // request, pre-prepare, prepare, commit and reply, each of the three
+    // replica rounds is signed and verified before moving on
+    assert!(report.p50 >= Duration::from_micros(5 * 10 + 3 * (20 + 40)));
+}
+
+// cargo test --lib pbft::tests::simulated_sweep -- --ignored --nocapture
+#[tokio::test(start_paused = true)]
+#[ignore]
+async fn simulated_sweep() {
+    *TRACING;
+    for n in [4, 7, 10, 16, 31] {
+        // larger batch does not fit into one pre-prepare packet
+        for batch_size in [1, 10, 100, 500] {
+            let report = simulate(n, batch_size, batch_size * 2).await;
+            println!("n = {} batch size = {}: {}", n, batch_size, report);
+        }
+    }
+}
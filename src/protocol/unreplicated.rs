@@ -15,10 +15,10 @@ use tracing::{debug, warn};
 
 use crate::{
     common::{
-        deserialize, generate_id, serialize, ClientId, Config, OpNumber, Opaque, ReplicaId,
-        RequestNumber, SignedMessage,
+        deserialize, deserialize_shared, generate_id, serialize, ClientId, Config, OpNumber,
+        Opaque, PendingTable, ReplicaId, RequestNumber, SignedMessage,
     },
-    facade::{self, App, AsyncEcosystem, Invoke, Receiver, Transport, TxAgent},
+    facade::{self, App, AsyncEcosystem, Invoke, Pipeline, Receiver, Transport, TxAgent},
     stage::{Handle, State, StatefulContext, StatelessContext},
 };
 
@@ -45,6 +45,7 @@ pub struct Client<T: Transport, E> {
     _executor: PhantomData<E>,
 
     request_number: RequestNumber,
+    pending_table: PendingTable<RequestMessage>,
 }
 
 impl<T: Transport, E> facade::Receiver<T> for Client<T, E> {
@@ -64,6 +65,7 @@ impl<T: Transport, E> Client<T, E> {
             rx,
             signed,
             request_number: 0,
+            pending_table: PendingTable::default(),
             _executor: PhantomData,
         };
         transport.register(&client, move |remote, buffer| {
@@ -118,6 +120,53 @@ where
     }
 }
 
+#[async_trait]
+impl<T: Transport, E: AsyncEcosystem<Opaque>> Pipeline for Client<T, E>
+where
+    Self: Send,
+{
+    fn submit(&mut self, op: Opaque) -> RequestNumber {
+        self.request_number += 1;
+        let request = self
+            .pending_table
+            .insert(self.request_number, |lane| RequestMessage {
+                client_id: lane,
+                request_number: self.request_number,
+                op,
+            });
+        self.transport
+            .send_message(self, self.config.replica(0), serialize(request));
+        self.request_number
+    }
+
+    async fn complete(&mut self) -> (RequestNumber, Opaque) {
+        loop {
+            select! {
+                _ = E::sleep_until(self.pending_table.timeout()).fuse() => {
+                    for (request, _) in self.pending_table.expired() {
+                        warn!("resend for request number {}", request.request_number);
+                        self.transport
+                            .send_message(self, self.config.replica(0), serialize(request));
+                    }
+                }
+                recv = self.rx.next() => {
+                    let (_remote, buffer) = recv.unwrap();
+                    let reply: ReplyMessage = if self.signed {
+                        let reply: SignedMessage<ReplyMessage> =
+                            deserialize(buffer.as_ref()).unwrap();
+                        reply.assume_verified()
+                    } else {
+                        deserialize(buffer.as_ref()).unwrap()
+                    };
+                    if self.pending_table.receive(reply.request_number, 0, &reply.result, 1) {
+                        return (reply.request_number, reply.result);
+                    }
+                }
+            }
+        }
+    }
+}
+
 pub struct Replica<T: Transport> {
     address: T::Address,
     transport: T::TxAgent,
@@ -211,7 +260,7 @@ impl<'a, T: Transport> StatefulContext<'a, Replica<T>> {
     }
 
     fn receive_buffer(&mut self, remote: T::Address, buffer: T::RxBuffer) {
-        let request: RequestMessage = deserialize(buffer.as_ref()).unwrap();
+        let request: RequestMessage = deserialize_shared(&Opaque::share(buffer)).unwrap();
         if let Some(reply) = self.client_table.get(&request.client_id) {
             if reply.request_number > request.request_number {
                 return;
@@ -224,7 +273,8 @@ impl<'a, T: Transport> StatefulContext<'a, Replica<T>> {
 
         self.op_number += 1;
         let op_number = self.op_number;
-        let result = self.app.execute(op_number, request.op);
+        let result = self.app.execute(op_number, &request.op);
+        self.app.flush();
         let reply = ReplyMessage {
             request_number: request.request_number,
             result,
@@ -241,8 +291,12 @@ mod tests {
     use tokio::{spawn, sync::oneshot, time::timeout};
 
     use crate::{
-        app::mock::App, common::Opaque, facade::Invoke, framework::tokio::AsyncEcosystem,
-        simulated::Transport, tests::TRACING,
+        app::mock::App,
+        common::Opaque,
+        facade::Invoke,
+        framework::tokio::AsyncEcosystem,
+        simulated::{self, Transport},
+        tests::TRACING,
     };
 
     use super::{Client, Replica};
@@ -259,9 +313,12 @@ mod tests {
         let (stop_tx, stop) = oneshot::channel();
         spawn(async move { transport.deliver_until(stop).await });
         assert_eq!(
-            timeout(Duration::from_micros(1), client.invoke(b"hello".to_vec()))
-                .await
-                .unwrap(),
+            timeout(
+                Duration::from_micros(1),
+                client.invoke(b"hello".to_vec().into())
+            )
+            .await
+            .unwrap(),
             b"reply: hello".to_vec()
         );
         stop_tx.send(()).unwrap();
@@ -291,4 +348,19 @@ mod tests {
         }
         stop_tx.send(()).unwrap();
     }
+
+    #[tokio::test(start_paused = true)]
+    async fn pipeline() {
+        *TRACING;
+        let config = Transport::config_builder(1, 0);
+        let mut transport = Transport::new(config());
+        Replica::register_new(config(), &mut transport, 0, App::default(), false);
+        let mut client: Client<_, AsyncEcosystem> =
+            Client::register_new(config(), &mut transport, false);
+
+        let (stop_tx, stop) = oneshot::channel();
+        spawn(async move { transport.deliver_until(stop).await });
+        simulated::pipelined(&mut client, 2, 10).await;
+        stop_tx.send(()).unwrap();
+    }
 }
@@ -32,6 +32,8 @@ pub struct Client<T: Transport, E> {
 
     request_number: RequestNumber,
     view_number: ViewNumber,
+    // state of the only request in flight, which is why `Pipeline` is not
+    // implemented
     response_table: HashMap<ReplicaId, Response>,
     certification: Option<(
         Opaque,
@@ -1,7 +1,8 @@
 use serde_derive::{Deserialize, Serialize};
 
 use crate::common::{
-    ClientId, Digest, OpNumber, Opaque, ReplicaId, RequestNumber, SignedMessage, ViewNumber,
+    ClientId, Digest, OpNumber, Opaque, ReplicaId, RequestNumber, SignedMessage, SignedView,
+    ViewNumber,
 };
 
 #[derive(Debug, Clone, Serialize, Deserialize)]
@@ -13,6 +14,22 @@ pub enum ToReplica {
     Checkpoint(SignedMessage<Checkpoint>),
 }
 
+// borrowed mirror of `ToReplica` for receiving, variants must keep the same
+// order
+// the batch of order request is left in remaining buffer, so its digest can
+// be computed without serializing it again
+#[derive(Debug, Serialize, Deserialize)]
+pub enum ToReplicaView<'a> {
+    Request(Request),
+    #[serde(borrow)]
+    OrderRequest(SignedView<'a, OrderRequest>),
+    Commit(Commit),
+    #[serde(borrow)]
+    ConfirmRequest(SignedView<'a, ConfirmRequest>),
+    #[serde(borrow)]
+    Checkpoint(SignedView<'a, Checkpoint>),
+}
+
 #[derive(Debug, Clone, Serialize, Deserialize)]
 pub enum ToClient {
     SpeculativeResponse(
@@ -4,3 +4,6 @@ pub mod client;
 pub use client::Client;
 pub mod replica;
 pub use replica::Replica;
+
+#[cfg(test)]
+mod tests;
@@ -6,11 +6,12 @@ use tracing::{debug, info, warn};
 
 use crate::{
     common::{
-        deserialize, serialize, signed::VerifiedMessage, ClientId, Config, Digest, OpNumber,
-        ReplicaId, RequestNumber, SignedMessage, ViewNumber,
+        deserialize_shared, deserialize_view_shared, serialize, signed::VerifiedMessage, ClientId,
+        Config, Digest, OpNumber, Opaque, ReplicaId, RequestNumber, SignedMessage, ViewNumber,
+        Window,
     },
     facade::{App, Receiver, Transport, TxAgent},
-    protocol::zyzzyva::message::{self, ToClient, ToReplica},
+    protocol::zyzzyva::message::{self, ToClient, ToReplica, ToReplicaView},
     stage::{Handle, State, StatefulContext, StatelessContext},
 };
 
@@ -35,8 +36,9 @@ pub struct Replica<T: Transport> {
     request_buffer: Vec<message::Request>,
     // op number => (item, batch digest, order request)
     // too lazy to define new type :)
-    reorder_history: HashMap<OpNumber, (LogItem, Digest, SignedMessage<message::OrderRequest>)>,
-    route_table: HashMap<ClientId, T::Address>,
+    // starts right above history tail
+    reorder_history: Window<(LogItem, Digest, SignedMessage<message::OrderRequest>)>,
+    pub(super) route_table: HashMap<ClientId, T::Address>,
 
     shared: Arc<Shared<T>>,
 }
@@ -99,7 +101,9 @@ impl<T: Transport> Replica<T> {
             client_table: HashMap::new(),
             checkpoint_quorum: HashMap::new(),
             request_buffer: Vec::new(),
-            reorder_history: HashMap::new(),
+            // primary orders up to two checkpoint intervals above commit
+            // number, a backup lagging behind further drops the orders
+            reorder_history: Window::new(1, 2 * (Self::CHECKPOINT_INTERVAL / batch_size).max(1)),
             route_table: HashMap::new(),
             shared: Arc::new(Shared {
                 transport: transport.tx_agent(),
@@ -121,13 +125,14 @@ impl<T: Transport> Replica<T> {
 
 impl<T: Transport> StatelessContext<Replica<T>> {
     fn receive_buffer(&self, remote: T::Address, buffer: T::RxBuffer) {
-        match deserialize(buffer.as_ref()) {
-            Ok(ToReplica::Request(request)) => {
+        let buffer = Opaque::share(buffer);
+        match deserialize_view_shared(&buffer) {
+            Ok((ToReplicaView::Request(request), _)) => {
                 self.submit
                     .stateful(move |state| state.handle_request(remote, request));
                 return;
             }
-            Ok(ToReplica::OrderRequest(order_request, batch)) => {
+            Ok((ToReplicaView::OrderRequest(order_request), batch_buffer)) => {
                 let verifying_key = if let Some(key) = self.config.verifying_key(&remote) {
                     key
                 } else {
@@ -140,57 +145,56 @@ impl<T: Transport> StatelessContext<Replica<T>> {
                     warn!("fail to verify order request");
                     return;
                 };
-                if Digest::from(Sha256::digest(
-                    bincode::options().serialize(&batch).unwrap(),
-                )) != order_request.digest
-                {
+                if Digest::from(Sha256::digest(batch_buffer)) != order_request.digest {
                     warn!("order request digest mismatch");
                     return;
                 }
+                let batch = if let Ok(batch) = deserialize_shared(&buffer.slice_ref(batch_buffer)) {
+                    batch
+                } else {
+                    warn!("malformed order request batch");
+                    return;
+                };
                 self.submit
                     .stateful(move |state| state.handle_order_request(order_request, batch));
                 return;
             }
-            Ok(ToReplica::Commit(commit)) => {
-                let mut certification = commit.certification.into_iter();
-                let (replica_id, sample_response) = certification.next().unwrap();
-                let sample_response = if let Ok(response) = sample_response.verify(
-                    self.config
-                        .verifying_key(self.config.replica(replica_id))
-                        .unwrap(),
-                ) {
-                    response
+            Ok((ToReplicaView::Commit(commit), _)) => {
+                let (replica_list, response_list): (Vec<_>, Vec<_>) =
+                    commit.certification.into_iter().unzip();
+                let verified_list = if let Ok(verified_list) =
+                    SignedMessage::verify_batch(response_list.into_iter().zip(
+                        replica_list.iter().map(|replica_id| {
+                            self.config
+                                .verifying_key(self.config.replica(*replica_id))
+                                .unwrap()
+                        }),
+                    )) {
+                    verified_list
                 } else {
                     warn!("failed to verify commit certification");
                     return;
                 };
+                let mut certification = replica_list.into_iter().zip(verified_list);
+                let (replica_id, sample_response) = if let Some(sample) = certification.next() {
+                    sample
+                } else {
+                    warn!("empty commit certification");
+                    return;
+                };
                 let mut certification: HashMap<_, _> = certification
-                    .map_while(|(replica_id, speculative_response)| {
-                        if let Ok(speculative_response) = speculative_response.verify(
-                            self.config
-                                .verifying_key(self.config.replica(replica_id))
-                                .as_ref()
-                                .unwrap(),
-                        ) {
-                            if (
-                                speculative_response.view_number,
-                                speculative_response.op_number,
-                                speculative_response.digest,
-                                speculative_response.history_digest,
-                            ) == (
-                                sample_response.view_number,
-                                sample_response.op_number,
-                                sample_response.digest,
-                                sample_response.history_digest,
-                            ) {
-                                Some((replica_id, speculative_response))
-                            } else {
-                                None
-                            }
-                        } else {
-                            warn!("failed to verify commit certification");
-                            None
-                        }
+                    .take_while(|(_, speculative_response)| {
+                        (
+                            speculative_response.view_number,
+                            speculative_response.op_number,
+                            speculative_response.digest,
+                            speculative_response.history_digest,
+                        ) == (
+                            sample_response.view_number,
+                            sample_response.op_number,
+                            sample_response.digest,
+                            sample_response.history_digest,
+                        )
                     })
                     .collect();
                 certification.insert(replica_id, sample_response);
@@ -203,7 +207,7 @@ impl<T: Transport> StatelessContext<Replica<T>> {
                     .stateful(move |state| state.handle_commit(remote, (client_id, certification)));
                 return;
             }
-            Ok(ToReplica::Checkpoint(checkpoint)) => {
+            Ok((ToReplicaView::Checkpoint(checkpoint), _)) => {
                 let verifying_key = if let Some(key) = self.config.verifying_key(&remote) {
                     key
                 } else {
@@ -216,6 +220,11 @@ impl<T: Transport> StatelessContext<Replica<T>> {
                     warn!("fail to verify checkpoint");
                     return;
                 };
+                // checkpoint quorum is keyed by replica id
+                if self.config.replica_id(&remote) != Some(checkpoint.replica_id) {
+                    warn!("checkpoint replica id mismatch");
+                    return;
+                }
                 self.submit
                     .stateful(move |state| state.handle_checkpoint(remote, checkpoint));
                 return;
@@ -254,6 +263,12 @@ impl<T: Transport> StatefulContext<'_, Replica<T>> {
             todo!("confirm request");
         }
 
+        // kept in history until next stable checkpoint, so stop pinning
+        // receiving buffer
+        let message = message::Request {
+            op: message.op.detach(),
+            ..message
+        };
         self.request_buffer.push(message);
         while self.request_buffer.len() >= self.batch_size
             && self.op_number
@@ -338,6 +353,7 @@ impl<T: Transport> StatefulContext<'_, Replica<T>> {
             // however, this is still good enough, since the Zyzzyva paper, we
             // are not required to handle reordering at all, just state transfer
             // whenever it is out of order
+            // stale or too far ahead item is simply dropped
             self.reorder_history
                 .insert(item.op_number, (item, digest, order_request.clone()));
             return;
@@ -364,7 +380,7 @@ impl<T: Transport> StatefulContext<'_, Replica<T>> {
             // for now i cannot think of a case even during view change
             // should be similar to viewstamped replication right?
             let op_number = item.op_number * self.batch_size as OpNumber + i as OpNumber;
-            let result = self.app.execute(op_number, request.op.clone());
+            let result = self.app.execute(op_number, &request.op);
             let client_id = request.client_id;
             let request_number = request.request_number;
             let mut response = message::SpeculativeResponse {
@@ -410,13 +426,14 @@ impl<T: Transport> StatefulContext<'_, Replica<T>> {
                 });
             });
         }
+        self.app.flush();
 
         let item_number = item.op_number;
         let history_digest = item.history_digest;
         self.history.push(item);
 
-        if let Some((item, digest, order_request)) = self.reorder_history.remove(&(item_number + 1))
-        {
+        self.reorder_history.advance(item_number + 1);
+        if let Some((item, digest, order_request)) = self.reorder_history.remove(item_number + 1) {
             self.speculative_execute(item, digest, &order_request);
         }
 
@@ -454,6 +471,13 @@ impl<T: Transport> StatefulContext<'_, Replica<T>> {
             todo!("state transfer");
         }
 
+        let batch = batch
+            .into_iter()
+            .map(|request| message::Request {
+                op: request.op.detach(),
+                ..request
+            })
+            .collect();
         self.speculative_execute(
             LogItem {
                 view_number: self.view_number,
@@ -502,7 +526,10 @@ impl<T: Transport> StatefulContext<'_, Replica<T>> {
                 debug!("checkpoint commit {}", checkpoint.op_number);
                 // TODO garbage collect
 
-                self.app.commit(checkpoint.op_number);
+                // app op number is translated from batch op number, see
+                // `speculative_execute`
+                self.app
+                    .commit((checkpoint.op_number + 1) * self.batch_size as OpNumber - 1);
                 self.commit_number = checkpoint.op_number;
 
                 while self.request_buffer.len() >= self.batch_size
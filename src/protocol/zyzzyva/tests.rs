@@ -0,0 +1,66 @@
+use std::time::Duration;
+
+use crate::{
+    app::mock::App,
+    facade::Receiver,
+    framework::tokio::AsyncEcosystem,
+    simulated::{self, Report, Transport},
+    stage::Handle,
+    tests::TRACING,
+};
+
+use super::{Client, Replica};
+
+fn generate_route(
+    replica_list: &[Handle<Replica<Transport>>],
+    client_list: &[Client<Transport, AsyncEcosystem>],
+) {
+    for replica in replica_list {
+        replica.with_stateful(|replica| {
+            replica.route_table.extend(
+                client_list
+                    .iter()
+                    .map(|client| (client.id, client.get_address().clone())),
+            );
+        });
+    }
+}
+
+// batch only closes when it is full, so there should be enough clients
+async fn simulate(n: usize, batch_size: usize, n_client: usize) -> Report {
+    simulated::simulate(n, |config, transport| {
+        let replica: Vec<_> = (0..n)
+            .map(|i| Replica::register_new(config(), transport, i as _, App::default(), batch_size))
+            .collect();
+        // fast path only
+        let client: Vec<Client<_, AsyncEcosystem>> = (0..n_client)
+            .map(|_| Client::register_new(config(), transport, true))
+            .collect();
+        generate_route(&replica, &client);
+        (replica, client)
+    })
+    .await
+}
+
+#[tokio::test(start_paused = true)]
+async fn simulated_performance() {
+    *TRACING;
+    let report = simulate(4, 1, 4).await;
+    println!("{}", report);
+    // request, order request and speculative response, with order request
+    // signed and verified, and response signed
+    assert!(report.p50 >= Duration::from_micros(3 * 10 + 20 + 40 + 20));
+}
+
+// cargo test --lib zyzzyva::tests::simulated_sweep -- --ignored --nocapture
+#[tokio::test(start_paused = true)]
+#[ignore]
+async fn simulated_sweep() {
+    *TRACING;
+    for n in [4, 7, 10, 16, 31] {
+        for batch_size in [1, 10, 100, 500] {
+            let report = simulate(n, batch_size, batch_size * 2).await;
+            println!("n = {} batch size = {}: {}", n, batch_size, report);
+        }
+    }
+}
@@ -1,32 +1,128 @@
+//! Besides functional testing, the simulated facilities can model the
+//! performance of protocols. With tokio's paused clock, time only advances
+//! when every task is waiting, so a test runs through virtual time as a
+//! discrete event simulation, as long as every cost is expressed as a sleep:
+//! * [`Transport::link`] delays messages by link latency and by queueing
+//!   behind earlier messages on the sender's egress link of limited
+//!   bandwidth.
+//! * [`CostModel`] charges signing, verifying and sending to the stage task
+//!   doing them, and limits the number of stage workers of each replica. A
+//!   task keeps its worker (and state, if stateful) busy for the charged time,
+//!   and the messages it sends and the tasks it submits are released only
+//!   after that, so the cost is on the critical path of whatever follows.
+//! * [`closed_loop`] drives clients and reports throughput and latency in
+//!   virtual time.
+//!
+//! The cost model is disabled by default, in which case every task finishes
+//! instantly as before.
+
 use std::{
+    cell::{Cell, RefCell},
     collections::HashMap,
-    fmt::Debug,
+    fmt::{self, Debug, Display, Formatter},
     io::Write,
     ops::{Deref, DerefMut},
     sync::Arc,
     time::Duration,
 };
 
-use futures::Future;
+use futures::{future::join_all, Future};
 use rand::{thread_rng, Rng};
 #[cfg(not(doc))]
 use tokio::{
     pin, select, spawn,
     sync::{
         mpsc::{unbounded_channel, UnboundedReceiver, UnboundedSender},
-        Mutex, MutexGuard,
+        oneshot, Mutex, MutexGuard, OwnedSemaphorePermit, Semaphore,
     },
-    time::{sleep, Instant},
+    time::{sleep, timeout, Instant},
 };
 use tracing::trace;
 
 #[cfg(not(doc))]
 use crate::stage_prod::State;
 use crate::{
-    common::{Config, SigningKey},
-    facade::{self, Receiver},
+    common::{
+        signed::{self, Operation},
+        Config, Opaque, SigningKey,
+    },
+    facade::{self, Invoke, Pipeline, Receiver},
 };
 
+/// CPU cost of operations, charged in virtual time. See [`set_cost_model`].
+#[derive(Debug, Clone, Default)]
+pub struct CostModel {
+    pub sign: Duration,
+    pub verify: Duration,
+    /// Serializing and sending one message, per byte.
+    pub tx_byte: Duration,
+    /// Number of stage workers of every replica, 0 for unlimited.
+    pub n_worker: usize,
+}
+
+type Effect = Box<dyn FnOnce() + Send>;
+
+thread_local! {
+    // tokio tests run on current thread runtime, so this is per test
+    static COST_MODEL: RefCell<CostModel> = RefCell::new(CostModel::default());
+    // charged by the stage task that is currently running
+    static CHARGE: Cell<Duration> = Cell::new(Duration::ZERO);
+    // sending and submitting of the stage task that is currently running
+    static EFFECT: RefCell<Option<Vec<Effect>>> = RefCell::new(None);
+}
+
+/// Set cost model for current test. Call it before registering replicas,
+/// which take worker count when creating stage.
+pub fn set_cost_model(cost_model: CostModel) {
+    COST_MODEL.with(|model| *model.borrow_mut() = cost_model);
+    signed::set_hook(Some(|operation| match operation {
+        Operation::Sign => charge(|cost| cost.sign),
+        Operation::Verify => charge(|cost| cost.verify),
+    }));
+}
+
+/// Charge the running stage task. Cost charged outside stage tasks, e.g. by
+/// clients or rx callbacks, is discarded.
+pub fn charge(cost: impl FnOnce(&CostModel) -> Duration) {
+    let cost = COST_MODEL.with(|model| cost(&model.borrow()));
+    CHARGE.with(|charge| charge.set(charge.get() + cost));
+}
+
+// hold `effect` until the running stage task has paid its cost, or perform it
+// right away outside stage tasks
+fn defer(effect: impl FnOnce() + Send + 'static) {
+    let effect = EFFECT.with(|effect_list| {
+        if let Some(effect_list) = &mut *effect_list.borrow_mut() {
+            effect_list.push(Box::new(effect));
+            None
+        } else {
+            Some(effect)
+        }
+    });
+    if let Some(effect) = effect {
+        effect();
+    }
+}
+
+// run a stage task and return what it charged, along with its deferred effects
+fn charged(task: impl FnOnce()) -> (Duration, Vec<Effect>) {
+    CHARGE.with(|charge| charge.set(Duration::ZERO));
+    EFFECT.with(|effect_list| *effect_list.borrow_mut() = Some(Vec::new()));
+    task();
+    let effect_list = EFFECT.with(|effect_list| effect_list.borrow_mut().take().unwrap());
+    (CHARGE.with(Cell::take), effect_list)
+}
+
+// pay the cost of a finished stage task, then release its effects
+async fn settle((cost, effect_list): (Duration, Vec<Effect>)) {
+    if cost > Duration::ZERO {
+        sleep(cost).await;
+    }
+    for effect in effect_list {
+        effect();
+    }
+}
+
 type Address = String;
 type Message = Vec<u8>;
 
@@ -39,7 +135,7 @@ pub struct Transport {
     // multicast recv table
     filter_table: FilterTable,
 }
-type RecvTable = HashMap<Address, Box<dyn Fn(Address, RxBuffer) + Send>>;
+type RecvTable = HashMap<Address, Box<dyn Fn(Address, RxBuffer) + Send + Sync>>;
 type FilterTable =
     HashMap<u32, Box<dyn Fn(&Address, &Address, &[u8], &mut Duration) -> bool + Send>>;
 
@@ -68,10 +164,15 @@ impl facade::TxAgent for TxAgent {
     ) {
         let mut buffer = [0; 9000];
         let message_length = message(&mut buffer);
-        let message = buffer[..message_length as usize].to_vec();
-        self.tx
-            .send((source.get_address().clone(), dest.clone(), message, false))
-            .unwrap();
+        charge(|cost| cost.tx_byte * message_length as u32);
+        let message = (
+            source.get_address().clone(),
+            dest.clone(),
+            buffer[..message_length as usize].to_vec(),
+            false,
+        );
+        let tx = self.tx.clone();
+        defer(move || tx.send(message).unwrap());
     }
     fn send_message_to_all(
         &self,
@@ -84,14 +185,15 @@ impl facade::TxAgent for TxAgent {
         let message = buffer[..message_length as usize].to_vec();
         for dest in dest_list {
             if dest != source.get_address() {
-                self.tx
-                    .send((
-                        source.get_address().clone(),
-                        dest.clone(),
-                        message.clone(),
-                        false,
-                    ))
-                    .unwrap();
+                charge(|cost| cost.tx_byte * message_length as u32);
+                let message = (
+                    source.get_address().clone(),
+                    dest.clone(),
+                    message.clone(),
+                    false,
+                );
+                let tx = self.tx.clone();
+                defer(move || tx.send(message).unwrap());
             }
         }
     }
@@ -111,7 +213,7 @@ impl facade::Transport for Transport {
     fn register(
         &mut self,
         receiver: &impl Receiver<Self>,
-        rx_agent: impl Fn(Self::Address, Self::RxBuffer) + 'static + Send,
+        rx_agent: impl Fn(Self::Address, Self::RxBuffer) + 'static + Send + Sync,
     ) where
         Self: Sized,
     {
@@ -123,7 +225,7 @@ impl facade::Transport for Transport {
 
     fn register_multicast(
         &mut self,
-        rx_agent: impl Fn(Self::Address, Self::RxBuffer) + 'static + Send,
+        rx_agent: impl Fn(Self::Address, Self::RxBuffer) + 'static + Send + Sync,
     ) {
         todo!()
     }
@@ -266,6 +368,126 @@ impl Transport {
             true
         }
     }
+
+    /// Link of `latency` and `bandwidth` in bytes per second. Every sender has
+    /// one egress link, on which messages are transmitted one after another,
+    /// and receiving side is not limited.
+    #[cfg(not(doc))]
+    pub fn link(
+        latency: Duration,
+        bandwidth: f64,
+    ) -> impl Fn(&Address, &Address, &[u8], &mut Duration) -> bool + 'static + Send {
+        // sender => when its egress link becomes idle
+        let idle_table = std::sync::Mutex::new(HashMap::new());
+        move |source, _, message, delay| {
+            let now = Instant::now();
+            let mut idle_table = idle_table.lock().unwrap();
+            let idle = idle_table.entry(source.clone()).or_insert(now);
+            *idle = (*idle).max(now) + Duration::from_secs_f64(message.len() as f64 / bandwidth);
+            *delay += (*idle - now) + latency;
+            true
+        }
+    }
+}
+
+/// Result of [`closed_loop`].
+#[derive(Debug, Clone)]
+pub struct Report {
+    pub n_request: usize,
+    /// Requests per second in virtual time.
+    pub throughput: f64,
+    pub p50: Duration,
+    pub p99: Duration,
+}
+
+impl Display for Report {
+    fn fmt(&self, f: &mut Formatter<'_>) -> fmt::Result {
+        write!(
+            f,
+            "{:.0} ops/sec, latency p50 {:?} p99 {:?} in total of {} requests",
+            self.throughput, self.p50, self.p99, self.n_request
+        )
+    }
+}
+
+/// Keep every client invoking one request after another for `duration` of
+/// virtual time. Transport should be delivering meanwhile.
+#[cfg(not(doc))]
+pub async fn closed_loop(
+    client_list: Vec<impl Invoke + Send + 'static>,
+    duration: Duration,
+) -> Report {
+    let start = Instant::now();
+    let latency_list = join_all(client_list.into_iter().map(|mut client| {
+        spawn(async move {
+            let mut latency_list = Vec::new();
+            while Instant::now() < start + duration {
+                let invoke_start = Instant::now();
+                client.invoke(Opaque::default()).await;
+                latency_list.push(Instant::now() - invoke_start);
+            }
+            latency_list
+        })
+    }))
+    .await;
+    let elapsed = Instant::now() - start;
+    let mut latency_list: Vec<_> = latency_list.into_iter().flat_map(Result::unwrap).collect();
+    assert!(!latency_list.is_empty());
+    latency_list.sort_unstable();
+    let quantile = |q: f64| latency_list[((latency_list.len() - 1) as f64 * q) as usize];
+    Report {
+        n_request: latency_list.len(),
+        throughput: latency_list.len() as f64 / elapsed.as_secs_f64(),
+        p50: quantile(0.5),
+        p99: quantile(0.99),
+    }
+}
+
+/// Closed loop of `n_client` on the common deployment, so reports of all
+/// protocols are comparable: replicas and clients on one switch, with 10us
+/// latency and 10Gbps links, and costs in the order of libsecp256k1 on a
+/// server core, with 8 workers per replica. `setup` registers replicas and
+/// clients of the protocol, and the returned replicas are kept until the end.
+#[cfg(not(doc))]
+pub async fn simulate<R, C: Invoke + Send + 'static>(
+    n_replica: usize,
+    setup: impl FnOnce(&dyn Fn() -> Config<Transport>, &mut Transport) -> (R, Vec<C>),
+) -> Report {
+    set_cost_model(CostModel {
+        sign: Duration::from_micros(20),
+        verify: Duration::from_micros(40),
+        tx_byte: Duration::from_nanos(1),
+        n_worker: 8,
+    });
+    let config = Transport::config_builder(n_replica, (n_replica - 1) / 3);
+    let mut transport = Transport::new(config());
+    transport.insert_filter(0, Transport::link(Duration::from_micros(10), 1.25e9));
+    let (_replica, client_list) = setup(&config, &mut transport);
+
+    let (stop_tx, stop) = oneshot::channel();
+    spawn(async move { transport.deliver_until(stop).await });
+    let report = closed_loop(client_list, Duration::from_millis(100)).await;
+    stop_tx.send(()).unwrap();
+    report
+}
+
+/// Submit `n_outstanding` requests at a time through `client` for `n_round`
+/// rounds, and check that every one completes with the result of mock app.
+/// Transport should be delivering meanwhile.
+#[cfg(not(doc))]
+pub async fn pipelined(client: &mut impl Pipeline, n_round: usize, n_outstanding: usize) {
+    for round in 0..n_round {
+        let mut op_table: HashMap<_, _> = (0..n_outstanding)
+            .map(|i| (client.submit(format!("{}-{}", round, i).into()), i))
+            .collect();
+        while !op_table.is_empty() {
+            let (request_number, result) = timeout(Duration::from_secs(2), client.complete())
+                .await
+                .unwrap();
+            let i = op_table.remove(&request_number).unwrap();
+            assert_eq!(result, Opaque::from(format!("reply: {}-{}", round, i)));
+        }
+    }
 }
 
 #[cfg(not(doc))]
@@ -286,8 +508,17 @@ mod undoc {
 
     impl<S: State> From<S> for Handle<S> {
         fn from(state: S) -> Self {
+            let n_worker = COST_MODEL.with(|model| model.borrow().n_worker);
             Self(Submit {
+                // same as production stage, which takes shared once per
+                // worker, and stateless tasks never wait for state
+                shared: Arc::new(state.shared()),
                 state: Arc::new(Mutex::new(state)),
+                worker: if n_worker != 0 {
+                    Some(Arc::new(Semaphore::new(n_worker)))
+                } else {
+                    None
+                },
             })
         }
     }
@@ -302,7 +533,7 @@ mod undoc {
 
         pub fn with_stateless(&self, f: impl FnOnce(&StatelessContext<S>)) {
             f(&StatelessContext {
-                shared: self.0.state.try_lock().unwrap().shared(),
+                shared: self.0.shared.clone(),
                 submit: self.0.clone(),
             });
         }
@@ -314,7 +545,7 @@ mod undoc {
     }
 
     pub struct StatelessContext<S: State> {
-        shared: S::Shared,
+        shared: Arc<S::Shared>,
         pub submit: Submit<S>,
     }
 
@@ -334,18 +565,23 @@ mod undoc {
     impl<S: State> Deref for StatelessContext<S> {
         type Target = S::Shared;
         fn deref(&self) -> &Self::Target {
-            &self.shared
+            &*self.shared
         }
     }
 
     pub struct Submit<S: State> {
         state: Arc<Mutex<S>>,
+        shared: Arc<S::Shared>,
+        // idle workers, none if unlimited
+        worker: Option<Arc<Semaphore>>,
     }
 
     impl<S: State> Clone for Submit<S> {
         fn clone(&self) -> Self {
             Self {
                 state: self.state.clone(),
+                shared: self.shared.clone(),
+                worker: self.worker.clone(),
             }
         }
     }
@@ -356,12 +592,19 @@ mod undoc {
             task: impl for<'a> FnOnce(&mut StatefulContext<'a, S>) + Send + 'static,
         ) where
             S: Send + 'static,
+            S::Shared: Send + Sync + 'static,
         {
             let submit = self.clone();
-            spawn(async move {
-                task(&mut StatefulContext {
-                    state: submit.state.lock().await,
-                    submit: submit.clone(),
+            defer(move || {
+                spawn(async move {
+                    // always take worker before state, so no one holds state
+                    // while waiting for worker
+                    let _worker = submit.acquire_worker().await;
+                    let mut context = StatefulContext {
+                        state: submit.state.lock().await,
+                        submit: submit.clone(),
+                    };
+                    settle(charged(|| task(&mut context))).await;
                 });
             });
         }
@@ -369,14 +612,27 @@ mod undoc {
         pub fn stateless(&self, task: impl FnOnce(&StatelessContext<S>) + Send + 'static)
         where
             S: Send + 'static,
+            S::Shared: Send + Sync + 'static,
         {
             let submit = self.clone();
-            spawn(async move {
-                task(&StatelessContext {
-                    submit: submit.clone(),
-                    shared: submit.state.lock().await.shared(),
+            defer(move || {
+                spawn(async move {
+                    let _worker = submit.acquire_worker().await;
+                    let context = StatelessContext {
+                        submit: submit.clone(),
+                        shared: submit.shared.clone(),
+                    };
+                    settle(charged(|| task(&context))).await;
                 });
             });
         }
+
+        async fn acquire_worker(&self) -> Option<OwnedSemaphorePermit> {
+            if let Some(worker) = &self.worker {
+                Some(worker.clone().acquire_owned().await.unwrap())
+            } else {
+                None
+            }
+        }
     }
 }
@@ -1,15 +1,27 @@
 use std::{
+    cell::Cell,
+    iter,
+    mem::{align_of, size_of, ManuallyDrop, MaybeUninit},
     ops::{Deref, DerefMut},
-    sync::{Arc, Mutex, MutexGuard},
+    ptr::{self, null},
+    sync::{
+        atomic::{AtomicU64, AtomicUsize, Ordering},
+        Arc, Mutex, MutexGuard,
+    },
     thread::{self, Thread},
 };
 
 use crossbeam::{
+    deque::{self, Injector, Stealer, Worker},
     queue::{ArrayQueue, SegQueue},
     utils::Backoff,
 };
 
-use crate::framework::latency::{Latency, MeasureClock};
+use crate::framework::{
+    latency::{Latency, MeasureClock},
+    metrics::Metrics,
+    trace::{self, Gauge},
+};
 
 pub trait State {
     type Shared;
@@ -22,9 +34,10 @@ pub struct Handle<S: State> {
     metric: Metric,
 }
 
+// shared with metrics exporter
 struct Metric {
-    stateful: Latency,
-    stateless: Latency,
+    stateful: Arc<Mutex<Latency>>,
+    stateless: Arc<Mutex<Latency>>,
 }
 
 pub struct StatefulContext<'a, S: State> {
@@ -39,11 +52,129 @@ pub struct StatelessContext<S: State> {
 
 pub struct Submit<S: State> {
     stateful_list: SegQueue<StatefulTask<S>>,
-    stateless_list: SegQueue<StatelessTask<S>>,
+    // stateless tasks submitted from worker threads go into worker's local
+    // deque, and the rest (e.g. from rx thread) go here
+    stateless_list: Injector<StatelessTask<S>>,
+    stealer_list: Mutex<Vec<Stealer<StatelessTask<S>>>>,
+    n_stealer: AtomicUsize,
     will_park_list: ArrayQueue<Thread>,
+    // number of tasks that not fit into inline storage
+    n_heap_task: AtomicU64,
+}
+
+// task closures are stored inline without allocation, as long as its size
+// and alignment fit into `TaskStorage`, otherwise a boxed closure is stored
+// instead
+// the size is picked to fit PBFT's reply closure, which carries a signed
+// reply and the request it replies to
+struct TaskStorage(MaybeUninit<[usize; 24]>);
+
+struct Task<F: Copy> {
+    storage: TaskStorage,
+    call: F,
+    drop: unsafe fn(*mut TaskStorage),
+}
+type StatefulCall<S> = for<'a, 'b> unsafe fn(*mut TaskStorage, &'b mut StatefulContext<'a, S>);
+type StatelessCall<S> = for<'a> unsafe fn(*mut TaskStorage, &'a StatelessContext<S>);
+type StatefulTask<S> = Task<StatefulCall<S>>;
+type StatelessTask<S> = Task<StatelessCall<S>>;
+
+impl<F: Copy> Task<F> {
+    fn fit<T>() -> bool {
+        size_of::<T>() <= size_of::<TaskStorage>() && align_of::<T>() <= align_of::<TaskStorage>()
+    }
+
+    // safety: `call` must consume storage as `T`
+    unsafe fn new<T>(value: T, call: F) -> Self {
+        unsafe fn drop_storage<T>(storage: *mut TaskStorage) {
+            ptr::drop_in_place(storage as *mut T);
+        }
+
+        assert!(Self::fit::<T>());
+        let mut storage = TaskStorage(MaybeUninit::uninit());
+        ptr::write(storage.0.as_mut_ptr() as *mut T, value);
+        Self {
+            storage,
+            call,
+            drop: drop_storage::<T>,
+        }
+    }
+}
+
+impl<F: Copy> Drop for Task<F> {
+    fn drop(&mut self) {
+        // only reached by tasks that never run, e.g. remaining on shutdown
+        unsafe { (self.drop)(&mut self.storage) }
+    }
+}
+
+impl<S: State> StatefulTask<S> {
+    fn stateful(
+        task: impl for<'a> FnOnce(&mut StatefulContext<'a, S>) + Send + 'static,
+        n_heap_task: &AtomicU64,
+    ) -> Self {
+        unsafe fn call<S: State, T: for<'a> FnOnce(&mut StatefulContext<'a, S>)>(
+            storage: *mut TaskStorage,
+            context: &mut StatefulContext<'_, S>,
+        ) {
+            ptr::read(storage as *mut T)(context)
+        }
+
+        fn new<S: State, T: for<'a> FnOnce(&mut StatefulContext<'a, S>) + Send + 'static>(
+            task: T,
+            n_heap_task: &AtomicU64,
+        ) -> StatefulTask<S> {
+            unsafe {
+                if StatefulTask::<S>::fit::<T>() {
+                    Task::new(task, call::<S, T> as StatefulCall<S>)
+                } else {
+                    n_heap_task.fetch_add(1, Ordering::Relaxed);
+                    Task::new(Box::new(task), call::<S, Box<T>> as StatefulCall<S>)
+                }
+            }
+        }
+        new(task, n_heap_task)
+    }
+
+    fn run(self, context: &mut StatefulContext<'_, S>) {
+        let mut task = ManuallyDrop::new(self);
+        unsafe { (task.call)(&mut task.storage, context) }
+    }
+}
+
+impl<S: State> StatelessTask<S> {
+    fn stateless(
+        task: impl FnOnce(&StatelessContext<S>) + Send + 'static,
+        n_heap_task: &AtomicU64,
+    ) -> Self {
+        unsafe fn call<S: State, T: FnOnce(&StatelessContext<S>)>(
+            storage: *mut TaskStorage,
+            context: &StatelessContext<S>,
+        ) {
+            ptr::read(storage as *mut T)(context)
+        }
+
+        fn new<S: State, T: FnOnce(&StatelessContext<S>) + Send + 'static>(
+            task: T,
+            n_heap_task: &AtomicU64,
+        ) -> StatelessTask<S> {
+            unsafe {
+                if StatelessTask::<S>::fit::<T>() {
+                    Task::new(task, call::<S, T> as StatelessCall<S>)
+                } else {
+                    n_heap_task.fetch_add(1, Ordering::Relaxed);
+                    Task::new(Box::new(task), call::<S, Box<T>> as StatelessCall<S>)
+                }
+            }
+        }
+        new(task, n_heap_task)
+    }
+
+    fn run(self, context: &StatelessContext<S>) {
+        let mut task = ManuallyDrop::new(self);
+        unsafe { (task.call)(&mut task.storage, context) }
+    }
 }
-type StatefulTask<S> = Box<dyn for<'a> FnOnce(&mut StatefulContext<'a, S>) + Send>;
-type StatelessTask<S> = Box<dyn FnOnce(&StatelessContext<S>) + Send>;
 
 impl<S: State> From<S> for Handle<S> {
     fn from(state: S) -> Self {
@@ -51,12 +182,15 @@ impl<S: State> From<S> for Handle<S> {
             state: Mutex::new(state),
             submit: Arc::new(Submit {
                 stateful_list: SegQueue::new(),
-                stateless_list: SegQueue::new(),
+                stateless_list: Injector::new(),
+                stealer_list: Mutex::new(Vec::new()),
+                n_stealer: AtomicUsize::new(0),
                 will_park_list: ArrayQueue::new(64), // configurable?
+                n_heap_task: AtomicU64::new(0),
             }),
             metric: Metric {
-                stateful: Latency::new("stateful"),
-                stateless: Latency::new("stateless"),
+                stateful: Arc::new(Mutex::new(Latency::new("stateful"))),
+                stateless: Arc::new(Mutex::new(Latency::new("stateless"))),
             },
         }
     }
@@ -103,12 +237,21 @@ impl<S: State> Submit<S> {
         &self,
         task: impl for<'a> FnOnce(&mut StatefulContext<'a, S>) + Send + 'static,
     ) {
-        self.stateful_list.push(Box::new(task));
+        self.stateful_list
+            .push(StatefulTask::stateful(task, &self.n_heap_task));
         self.unpark_one();
     }
 
     pub fn stateless(&self, task: impl FnOnce(&StatelessContext<S>) + Send + 'static) {
-        self.stateless_list.push(Box::new(task));
+        let task = StatelessTask::stateless(task, &self.n_heap_task);
+        let (submit, local) = LOCAL_QUEUE.with(Cell::get);
+        if submit == self as *const _ as *const () {
+            // safety: registered by `LocalQueue::new` of this submit, which
+            // keeps the deque alive until unregistering
+            unsafe { &*(local as *const Worker<StatelessTask<S>>) }.push(task);
+        } else {
+            self.stateless_list.push(task);
+        }
         self.unpark_one();
     }
 
@@ -126,7 +269,83 @@ impl<S: State> Submit<S> {
     }
 }
 
-enum Task<'a, S: State> {
+thread_local! {
+    // (submit, deque) of the worker running on current thread, type erased
+    // because thread local cannot be generic
+    static LOCAL_QUEUE: Cell<(*const (), *const ())> = Cell::new((null(), null()));
+}
+
+// per-worker stateless task deque, which steals from injector and other
+// workers when running out of local tasks
+struct LocalQueue<'a, S: State> {
+    submit: &'a Submit<S>,
+    worker: Box<Worker<StatelessTask<S>>>, // boxed for stable address
+    index: usize,
+    stealer_list: Vec<Stealer<StatelessTask<S>>>,
+}
+
+impl<'a, S: State> LocalQueue<'a, S> {
+    fn new(submit: &'a Submit<S>) -> Self {
+        let worker = Box::new(Worker::new_fifo());
+        let index = {
+            let mut stealer_list = submit.stealer_list.lock().unwrap();
+            stealer_list.push(worker.stealer());
+            submit
+                .n_stealer
+                .store(stealer_list.len(), Ordering::Release);
+            stealer_list.len() - 1
+        };
+        LOCAL_QUEUE.with(|local| {
+            local.set((
+                submit as *const _ as *const (),
+                &*worker as *const _ as *const (),
+            ))
+        });
+        Self {
+            submit,
+            worker,
+            index,
+            stealer_list: Vec::new(),
+        }
+    }
+
+    fn pop(&mut self) -> Option<StatelessTask<S>> {
+        if let Some(task) = self.worker.pop() {
+            return Some(task);
+        }
+        // workers only join at the beginning, so this is rarely refreshed
+        if self.stealer_list.len() != self.submit.n_stealer.load(Ordering::Acquire) {
+            self.stealer_list = self.submit.stealer_list.lock().unwrap().clone();
+        }
+        iter::repeat_with(|| {
+            self.submit
+                .stateless_list
+                .steal_batch_and_pop(&self.worker)
+                .or_else(|| {
+                    self.stealer_list
+                        .iter()
+                        .enumerate()
+                        .filter(|(i, _)| *i != self.index)
+                        .map(|(_, stealer)| stealer.steal())
+                        .collect()
+                })
+        })
+        .find(|steal| !steal.is_retry())
+        .and_then(deque::Steal::success)
+    }
+}
+
+impl<'a, S: State> Drop for LocalQueue<'a, S> {
+    fn drop(&mut self) {
+        LOCAL_QUEUE.with(|local| local.set((null(), null())));
+        // leave remaining tasks to whoever still running
+        while let Some(task) = self.worker.pop() {
+            self.submit.stateless_list.push(task);
+        }
+    }
+}
+
+enum Steal<'a, S: State> {
     Stateful(StatefulTask<S>, StatefulContext<'a, S>),
     Stateless(StatelessTask<S>, StatelessContext<S>),
     Shutdown,
@@ -136,37 +355,48 @@ impl<S: State> Handle<S> {
     fn steal_with_state<'a>(
         &'a self,
         context: StatefulContext<'a, S>,
+        local: &mut LocalQueue<'_, S>,
         shutdown: &mut impl FnMut() -> bool,
-    ) -> Task<'_, S> {
+        idle: &mut impl FnMut(),
+    ) -> Steal<'a, S> {
         let backoff = Backoff::new();
+        let mut idled = false;
         while !shutdown() {
             if let Some(task) = self.submit.stateful_list.pop() {
-                return Task::Stateful(task, context);
+                return Steal::Stateful(task, context);
             }
 
-            if let Some(task) = self.submit.stateless_list.pop() {
+            if let Some(task) = local.pop() {
                 let context = StatelessContext {
                     shared: context.shared(),
                     submit: context.submit,
                 };
                 // state dropped
-                return Task::Stateless(task, context);
+                return Steal::Stateless(task, context);
             }
 
+            // only notify once per idle period, backoff is the one to spin
+            if !idled {
+                idle();
+                idled = true;
+            }
             backoff.snooze();
         }
-        Task::Shutdown
+        Steal::Shutdown
     }
 
     fn steal_without_state(
         &self,
         context: StatelessContext<S>,
+        local: &mut LocalQueue<'_, S>,
         shutdown: &mut impl FnMut() -> bool,
-    ) -> Task<'_, S> {
+        idle: &mut impl FnMut(),
+    ) -> Steal<'_, S> {
         let backoff = Backoff::new();
+        let mut idled = false;
         while !shutdown() {
-            if let Some(task) = self.submit.stateless_list.pop() {
-                return Task::Stateless(task, context);
+            if let Some(task) = local.pop() {
+                return Steal::Stateless(task, context);
             }
 
             if let Ok(state) = self.state.try_lock() {
@@ -174,58 +404,135 @@ impl<S: State> Handle<S> {
                     state,
                     submit: context.submit,
                 };
-                return self.steal_with_state(context, shutdown);
+                return self.steal_with_state(context, local, shutdown, idle);
             }
 
+            if !idled {
+                idle();
+                idled = true;
+            }
             backoff.snooze();
         }
-        Task::Shutdown
+        Steal::Shutdown
     }
 
-    pub fn run_worker(&self, mut shutdown: impl FnMut() -> bool) {
+    pub fn run_worker(&self, shutdown: impl FnMut() -> bool) {
+        self.run_worker_with_idle(shutdown, || {})
+    }
+
+    /// Same as `run_worker`, and call `idle` every time worker runs out of
+    /// task, e.g. to flush buffered packets.
+    pub fn run_worker_with_idle(&self, shutdown: impl FnMut() -> bool, idle: impl FnMut()) {
+        self.run_worker_with_hooks(shutdown, idle, || {})
+    }
+
+    /// Same as `run_worker_with_idle`, and also call `task_done` after every
+    /// task, e.g. to flush packets that have been buffered for too long while
+    /// worker keeps busy.
+    pub fn run_worker_with_hooks(
+        &self,
+        mut shutdown: impl FnMut() -> bool,
+        mut idle: impl FnMut(),
+        mut task_done: impl FnMut(),
+    ) {
         let context = StatelessContext {
             shared: self.state.lock().unwrap().shared(),
             submit: self.submit.clone(),
         };
 
-        let mut stateful_latency = self.metric.stateful.local();
-        let mut stateless_latency = self.metric.stateless.local();
+        let mut stateful_latency = self.metric.stateful.lock().unwrap().local();
+        let mut stateless_latency = self.metric.stateless.lock().unwrap().local();
         let clock = MeasureClock::default();
 
-        let mut steal = self.steal_without_state(context, &mut shutdown);
+        let mut local = LocalQueue::new(&self.submit);
+        let mut steal = self.steal_without_state(context, &mut local, &mut shutdown, &mut idle);
         loop {
             match steal {
-                Task::Stateful(task, mut context) => {
+                Steal::Stateful(task, mut context) => {
+                    self.trace_queue_depth();
                     let measure = clock.measure();
-                    task(&mut context);
+                    task.run(&mut context);
                     stateful_latency += measure;
-                    steal = self.steal_with_state(context, &mut shutdown);
+                    task_done();
+                    steal = self.steal_with_state(context, &mut local, &mut shutdown, &mut idle);
                 }
-                Task::Stateless(task, context) => {
+                Steal::Stateless(task, context) => {
+                    self.trace_queue_depth();
                     let measure = clock.measure();
-                    task(&context);
+                    task.run(&context);
                     stateless_latency += measure;
-                    steal = self.steal_without_state(context, &mut shutdown);
+                    task_done();
+                    steal = self.steal_without_state(context, &mut local, &mut shutdown, &mut idle);
+                }
+                Steal::Shutdown => {
+                    trace::flush();
+                    return;
                 }
-                Task::Shutdown => return,
             }
         }
     }
 
-    pub fn run_stateless_worker(&self, mut shutdown: impl FnMut() -> bool) {
+    fn trace_queue_depth(&self) {
+        if trace::sample_gauge() {
+            trace::gauge(Gauge::StatefulQueue, self.submit.stateful_list.len());
+            trace::gauge(Gauge::StatelessQueue, self.submit.stateless_list.len());
+        }
+    }
+
+    pub fn run_stateless_worker(&self, shutdown: impl FnMut() -> bool) {
+        self.run_stateless_worker_with_idle(shutdown, || {})
+    }
+
+    pub fn run_stateless_worker_with_idle(
+        &self,
+        shutdown: impl FnMut() -> bool,
+        idle: impl FnMut(),
+    ) {
+        self.run_stateless_worker_with_hooks(shutdown, idle, || {})
+    }
+
+    pub fn run_stateless_worker_with_hooks(
+        &self,
+        mut shutdown: impl FnMut() -> bool,
+        mut idle: impl FnMut(),
+        mut task_done: impl FnMut(),
+    ) {
         let context = StatelessContext {
             shared: self.state.lock().unwrap().shared(),
             submit: self.submit.clone(),
         };
-        let mut stateless_latency = self.metric.stateless.local();
+        let mut stateless_latency = self.metric.stateless.lock().unwrap().local();
         let clock = MeasureClock::default();
+        let mut local = LocalQueue::new(&self.submit);
+        let mut idled = false;
         while !shutdown() {
-            if let Some(task) = self.submit.stateless_list.pop() {
+            if let Some(task) = local.pop() {
+                self.trace_queue_depth();
                 let measure = clock.measure();
-                task(&context);
+                task.run(&context);
                 stateless_latency += measure;
+                task_done();
+                idled = false;
+            } else if !idled {
+                idle();
+                idled = true;
             }
         }
+        trace::flush();
+    }
+
+    /// Register task latency and queue lengths. Tasks in per-worker local
+    /// deques are not counted into stateless queue.
+    pub fn export_metrics(&self, metrics: &mut Metrics<'_>)
+    where
+        S: 'static,
+    {
+        metrics.latency("stateful", self.metric.stateful.clone());
+        metrics.latency("stateless", self.metric.stateless.clone());
+        let submit = self.submit.clone();
+        metrics.gauge("stateful_queue", move || submit.stateful_list.len() as _);
+        let submit = self.submit.clone();
+        metrics.gauge("stateless_queue", move || submit.stateless_list.len() as _);
     }
 
     pub fn unpark_all(&self) {
@@ -237,9 +544,15 @@ impl<S: State> Handle<S> {
 
 impl<S: State> Drop for Handle<S> {
     fn drop(&mut self) {
-        self.metric.stateful.refresh();
-        println!("{}", self.metric.stateful);
-        self.metric.stateless.refresh();
-        println!("{}", self.metric.stateless);
+        let mut stateful = self.metric.stateful.lock().unwrap();
+        stateful.refresh();
+        println!("{}", stateful);
+        let mut stateless = self.metric.stateless.lock().unwrap();
+        stateless.refresh();
+        println!("{}", stateless);
+        let n_heap_task = self.submit.n_heap_task.load(Ordering::Relaxed);
+        if n_heap_task != 0 {
+            println!("heap allocated task: {}", n_heap_task);
+        }
     }
 }